@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define BUFFER_SIZE 256ULL * 1024 * 1024
+#define MINIMUM_RUN_TIME 0.5
+
+static double _now(void);
+static void _benchmark(CRC32_ENGINE engine, const uint8_t *buffer, uint64_t size, uint32_t expected);
+
+// Measures each CRC32 engine on a GPT header, a GPT entry array and a large buffer standing in for a whole image.
+int main(int argc, char **argv)
+{
+    uint64_t sizes[] = {92, 8184 * 128, BUFFER_SIZE};
+    uint64_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+
+    if (argc > 1)
+    {
+        sizes[size_count - 1] = strtoull(argv[1], NULL, 0) * 1024 * 1024;
+    }
+
+    uint8_t *buffer = malloc(sizes[size_count - 1]);
+    if (NULL == buffer)
+    {
+        perror("Error allocating benchmark buffer");
+        exit(1);
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (uint64_t i = 0; i < sizes[size_count - 1]; ++i)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(state >> 56);
+    }
+
+    for (uint64_t i = 0; i < size_count; ++i)
+    {
+        uint32_t expected = update_crc32_with_engine(CRC32_ENGINE_TABLE, 0, buffer, sizes[i]);
+        printf("%llu bytes:\n", (unsigned long long)sizes[i]);
+
+        for (CRC32_ENGINE engine = CRC32_ENGINE_AUTO; engine < CRC32_ENGINE_COUNT; ++engine)
+        {
+            _benchmark(engine, buffer, sizes[i], expected);
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+static double _now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void _benchmark(CRC32_ENGINE engine, const uint8_t *buffer, uint64_t size, uint32_t expected)
+{
+    if (!is_crc32_engine_available(engine))
+    {
+        printf("  %-12s unavailable\n", get_crc32_engine_name(engine));
+        return;
+    }
+
+    uint32_t crc = 0;
+    uint64_t iterations = 0;
+    double start = _now();
+    double elapsed;
+
+    do
+    {
+        crc = update_crc32_with_engine(engine, 0, buffer, size);
+        iterations++;
+        elapsed = _now() - start;
+    } while (elapsed < MINIMUM_RUN_TIME);
+
+    printf("  %-12s %10.2f MB/s  %s\n", get_crc32_engine_name(engine), size * iterations / elapsed / 1e6,
+           crc == expected ? "ok" : "MISMATCH");
+}
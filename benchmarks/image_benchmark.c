@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "write_image.h"
+
+typedef struct _IO_COUNTERS
+{
+    uint64_t ReadCalls;
+    uint64_t WriteCalls;
+    uint64_t BytesWritten;
+} IO_COUNTERS;
+
+typedef struct _RUN_RESULT
+{
+    double Seconds;
+    bool HasCounters;
+    IO_COUNTERS Counters;
+} RUN_RESULT;
+
+static uint64_t tree_files;
+static uint64_t tree_bytes;
+
+static double _now(void);
+static bool _read_io_counters(IO_COUNTERS *counters);
+static int _count_entry(const char *path, const struct stat *status, int type, struct FTW *walk);
+static void _benchmark(const char *tree_path, const char *image_path, const IMAGE_OPTIONS *options);
+
+// Runs write_image() on each tree in a child process, so peak RSS and I/O counters belong to that tree alone.
+int main(int argc, char **argv)
+{
+    IMAGE_OPTIONS options = {
+        .Sparse = false,
+        .Format = IMAGE_FORMAT_RAW,
+        .Jobs = 1,
+        .ImageSize = 0,
+        .AutoSize = true,
+        .Headroom = 10,
+        .Update = false,
+        .Reproducible = false,
+        .Seed = NULL,
+        .BuildTime = time(NULL),
+    };
+
+    int option;
+    while (-1 != (option = getopt(argc, argv, "sj:")))
+    {
+        switch (option)
+        {
+        case 's':
+            options.Sparse = true;
+            break;
+        case 'j':
+            options.Jobs = (uint32_t)strtoul(optarg, NULL, 10);
+            if (0 == options.Jobs)
+            {
+                options.Jobs = 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s] [-j jobs] <output image> <input tree>...\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        fprintf(stderr, "Usage: %s [-s] [-j jobs] <output image> <input tree>...\n", argv[0]);
+        exit(1);
+    }
+
+    printf("%-24s %8s %10s %9s %9s %10s %10s %10s %10s\n",
+           "tree", "files", "input MB", "seconds", "MB/s", "peak RSS", "reads", "writes", "written MB");
+
+    for (int i = optind + 1; i < argc; ++i)
+    {
+        _benchmark(argv[i], argv[optind], &options);
+    }
+
+    unlink(argv[optind]);
+    return 0;
+}
+
+static double _now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// syscr and syscw count every read and write family call of the process, worker threads included.
+static bool _read_io_counters(IO_COUNTERS *counters)
+{
+    FILE *file = fopen("/proc/self/io", "r");
+    if (NULL == file)
+    {
+        return false;
+    }
+
+    char line[128];
+    uint32_t found = 0;
+    while (NULL != fgets(line, sizeof(line), file))
+    {
+        unsigned long long value;
+        if (1 == sscanf(line, "syscr: %llu", &value))
+        {
+            counters->ReadCalls = value;
+            found++;
+        }
+        else if (1 == sscanf(line, "syscw: %llu", &value))
+        {
+            counters->WriteCalls = value;
+            found++;
+        }
+        else if (1 == sscanf(line, "wchar: %llu", &value))
+        {
+            counters->BytesWritten = value;
+            found++;
+        }
+    }
+
+    fclose(file);
+    return 3 == found;
+}
+
+static int _count_entry(const char *path, const struct stat *status, int type, struct FTW *walk)
+{
+    (void)path;
+    (void)walk;
+
+    if (FTW_F == type)
+    {
+        tree_files++;
+        tree_bytes += status->st_size;
+    }
+
+    return 0;
+}
+
+static void _benchmark(const char *tree_path, const char *image_path, const IMAGE_OPTIONS *options)
+{
+    tree_files = 0;
+    tree_bytes = 0;
+    if (0 != nftw(tree_path, _count_entry, 64, FTW_PHYS))
+    {
+        fprintf(stderr, "Error scanning %s: %s\n", tree_path, strerror(errno));
+        exit(1);
+    }
+
+    int result_pipe[2];
+    if (0 != pipe(result_pipe))
+    {
+        perror("Error creating result pipe");
+        exit(1);
+    }
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0)
+    {
+        perror("Error starting benchmark process");
+        exit(1);
+    }
+
+    if (0 == child)
+    {
+        // The per entry progress messages would dominate the measurement on a terminal.
+        int null_descriptor = open("/dev/null", O_WRONLY);
+        if (null_descriptor >= 0)
+        {
+            dup2(null_descriptor, STDOUT_FILENO);
+            close(null_descriptor);
+        }
+
+        FILE *output_file = fopen(image_path, "wb");
+        if (NULL == output_file)
+        {
+            perror("Error opening output image");
+            exit(1);
+        }
+
+        RUN_RESULT result = {0};
+        IO_COUNTERS before = {0};
+        IO_COUNTERS after = {0};
+        bool has_before = _read_io_counters(&before);
+
+        double start = _now();
+        write_image(tree_path, output_file, options);
+        result.Seconds = _now() - start;
+
+        result.HasCounters = has_before && _read_io_counters(&after);
+        result.Counters.ReadCalls = after.ReadCalls - before.ReadCalls;
+        result.Counters.WriteCalls = after.WriteCalls - before.WriteCalls;
+        result.Counters.BytesWritten = after.BytesWritten - before.BytesWritten;
+
+        if (sizeof(result) != write(result_pipe[1], &result, sizeof(result)))
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(result_pipe[1]);
+
+    RUN_RESULT result;
+    bool has_result = sizeof(result) == read(result_pipe[0], &result, sizeof(result));
+    close(result_pipe[0]);
+
+    int status;
+    struct rusage usage;
+    if (child != wait4(child, &status, 0, &usage))
+    {
+        perror("Error waiting for benchmark process");
+        exit(1);
+    }
+
+    if (!has_result || !WIFEXITED(status) || 0 != WEXITSTATUS(status))
+    {
+        fprintf(stderr, "Benchmark of %s failed\n", tree_path);
+        exit(1);
+    }
+
+    printf("%-24s %8llu %10.1f %9.3f %9.1f %8.1fMB", tree_path, (unsigned long long)tree_files, tree_bytes / 1e6,
+           result.Seconds, tree_bytes / 1e6 / result.Seconds, usage.ru_maxrss / 1024.0);
+    if (result.HasCounters)
+    {
+        printf(" %10llu %10llu %10.1f\n", (unsigned long long)result.Counters.ReadCalls,
+               (unsigned long long)result.Counters.WriteCalls, result.Counters.BytesWritten / 1e6);
+    }
+    else
+    {
+        printf(" %10s %10s %10s\n", "-", "-", "-");
+    }
+}
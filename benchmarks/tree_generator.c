@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define WRITE_BUFFER_SIZE 1024 * 1024
+#define MAXIMUM_ROOT_LENGTH 1024
+
+#define TINY_DIRECTORIES 100
+#define TINY_FILES_PER_DIRECTORY 200
+#define TINY_MAXIMUM_SIZE 4096
+#define BLOB_COUNT 2
+#define DEFAULT_BLOB_MB 2048
+#define DEEP_LEVELS 64
+#define DEEP_FILES_PER_LEVEL 4
+#define WIDE_FILES 50000
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+static uint8_t write_buffer[WRITE_BUFFER_SIZE];
+
+static void _make_directory(const char *path);
+static void _make_file(const char *path, uint64_t size);
+static void _fill_random(uint8_t *buffer, uint64_t size);
+static void _generate_tiny(const char *root);
+static void _generate_blobs(const char *root, uint64_t blob_size);
+static void _generate_deep(const char *root);
+static void _generate_wide(const char *root);
+
+// Creates one directory per benchmark tree below the output directory. The content is pseudo random and the same on every run.
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr,
+                "Usage: %s <output directory> [blob size in MiB]\n"
+                "  creates tiny/ (%u small files), blobs/ (%u large files, default %u MiB each),\n"
+                "  deep/ (%u nested directories) and wide/ (one directory with %u files)\n",
+                argv[0], TINY_DIRECTORIES * TINY_FILES_PER_DIRECTORY, BLOB_COUNT, DEFAULT_BLOB_MB, DEEP_LEVELS, WIDE_FILES);
+        exit(1);
+    }
+
+    if (strlen(argv[1]) >= MAXIMUM_ROOT_LENGTH - 8)
+    {
+        fprintf(stderr, "Output directory path is too long\n");
+        exit(1);
+    }
+
+    uint64_t blob_size = (argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_BLOB_MB) * 1024 * 1024;
+    char path[MAXIMUM_ROOT_LENGTH];
+
+    _make_directory(argv[1]);
+
+    snprintf(path, sizeof(path), "%s/tiny", argv[1]);
+    _generate_tiny(path);
+    snprintf(path, sizeof(path), "%s/blobs", argv[1]);
+    _generate_blobs(path, blob_size);
+    snprintf(path, sizeof(path), "%s/deep", argv[1]);
+    _generate_deep(path);
+    snprintf(path, sizeof(path), "%s/wide", argv[1]);
+    _generate_wide(path);
+
+    return 0;
+}
+
+static void _make_directory(const char *path)
+{
+    if (0 != mkdir(path, 0755) && EEXIST != errno)
+    {
+        fprintf(stderr, "Error creating directory %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void _make_file(const char *path, uint64_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (NULL == file)
+    {
+        fprintf(stderr, "Error creating file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    while (size > 0)
+    {
+        uint64_t chunk = size < sizeof(write_buffer) ? size : sizeof(write_buffer);
+        _fill_random(write_buffer, chunk);
+        if (chunk != fwrite(write_buffer, 1, chunk, file))
+        {
+            fprintf(stderr, "Error writing file %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        size -= chunk;
+    }
+
+    if (0 != fclose(file))
+    {
+        fprintf(stderr, "Error writing file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void _fill_random(uint8_t *buffer, uint64_t size)
+{
+    for (uint64_t i = 0; i < size; i += 8)
+    {
+        random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t value = random_state;
+        for (uint64_t j = i; j < size && j < i + 8; ++j)
+        {
+            buffer[j] = (uint8_t)(value >> 56);
+            value <<= 8;
+        }
+    }
+}
+
+static void _generate_tiny(const char *root)
+{
+    char path[4096];
+    _make_directory(root);
+
+    for (uint32_t i = 0; i < TINY_DIRECTORIES; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/d%03u", root, i);
+        _make_directory(path);
+
+        for (uint32_t j = 0; j < TINY_FILES_PER_DIRECTORY; ++j)
+        {
+            random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+            snprintf(path, sizeof(path), "%s/d%03u/f%04u.dat", root, i, j);
+            _make_file(path, (random_state >> 33) % (TINY_MAXIMUM_SIZE + 1));
+        }
+    }
+}
+
+static void _generate_blobs(const char *root, uint64_t blob_size)
+{
+    char path[4096];
+    _make_directory(root);
+
+    for (uint32_t i = 0; i < BLOB_COUNT; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/blob%u.bin", root, i);
+        _make_file(path, blob_size);
+    }
+}
+
+static void _generate_deep(const char *root)
+{
+    char path[4096];
+    size_t length = (size_t)snprintf(path, sizeof(path), "%s", root);
+    _make_directory(path);
+
+    for (uint32_t level = 0; level < DEEP_LEVELS; ++level)
+    {
+        for (uint32_t i = 0; i < DEEP_FILES_PER_LEVEL; ++i)
+        {
+            char file_path[4096 + 16];
+            snprintf(file_path, sizeof(file_path), "%s/f%u.txt", path, i);
+            _make_file(file_path, 512 * (i + 1));
+        }
+
+        length += (size_t)snprintf(path + length, sizeof(path) - length, "/l%02u", level);
+        _make_directory(path);
+    }
+}
+
+static void _generate_wide(const char *root)
+{
+    char path[4096];
+    _make_directory(root);
+
+    for (uint32_t i = 0; i < WIDE_FILES; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/f%07u.bin", root, i);
+        _make_file(path, i % 2 ? 0 : 1024);
+    }
+}
@@ -0,0 +1,83 @@
+#include "build_stats.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    [STATS_PHASE_TOTAL] = "total",
+    [STATS_PHASE_SCAN] = "scan",
+    [STATS_PHASE_CACHE] = "cache",
+    [STATS_PHASE_LAYOUT] = "layout",
+    [STATS_PHASE_METADATA] = "metadata_write",
+    [STATS_PHASE_FILE_DATA] = "file_data",
+    [STATS_PHASE_ZERO_FILL] = "zero_fill",
+    [STATS_PHASE_GPT] = "gpt",
+    [STATS_PHASE_VERIFY] = "verify",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_COUNTER_FILES] = "files",
+    [STATS_COUNTER_DIRECTORIES] = "directories",
+    [STATS_COUNTER_BYTES_READ] = "bytes_read",
+    [STATS_COUNTER_BYTES_CACHED] = "bytes_cached",
+    [STATS_COUNTER_BYTES_WRITTEN] = "bytes_written",
+    [STATS_COUNTER_CLUSTERS_ALLOCATED] = "clusters_allocated",
+    [STATS_COUNTER_DIRECTORY_EXTENSIONS] = "directory_extensions",
+};
+
+// Every thread that runs a build times its own phases, so builds on separate threads do not mix up their phases.
+static _Thread_local uint64_t phase_starts[STATS_PHASE_COUNT];
+static _Thread_local uint64_t phase_times[STATS_PHASE_COUNT];
+static atomic_uint_fast64_t merged_phase_times[STATS_PHASE_COUNT];
+// Relaxed increments, the values are only read once all workers are joined.
+static atomic_uint_fast64_t counters[STATS_COUNTER_COUNT];
+
+static uint64_t _now(void);
+
+void start_stats_phase(STATS_PHASE phase)
+{
+    phase_starts[phase] = _now();
+}
+
+void stop_stats_phase(STATS_PHASE phase)
+{
+    phase_times[phase] += _now() - phase_starts[phase];
+}
+
+void merge_stats_phases(void)
+{
+    for (uint32_t i = 0; i < STATS_PHASE_COUNT; ++i)
+    {
+        atomic_fetch_add_explicit(&merged_phase_times[i], phase_times[i], memory_order_relaxed);
+        phase_times[i] = 0;
+    }
+}
+
+void add_stats_counter(STATS_COUNTER counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+void write_stats_report(FILE *file)
+{
+    fprintf(file, "{\n  \"phases\": {\n");
+    for (uint32_t i = 0; i < STATS_PHASE_COUNT; ++i)
+    {
+        fprintf(file, "    \"%s\": %.6f%s\n", phase_names[i], (phase_times[i] + atomic_load(&merged_phase_times[i])) / 1e9, i + 1 < STATS_PHASE_COUNT ? "," : "");
+    }
+
+    fprintf(file, "  },\n  \"counters\": {\n");
+    for (uint32_t i = 0; i < STATS_COUNTER_COUNT; ++i)
+    {
+        fprintf(file, "    \"%s\": %llu%s\n", counter_names[i], (unsigned long long)atomic_load(&counters[i]), i + 1 < STATS_COUNTER_COUNT ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+}
+
+static uint64_t _now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,47 @@
+#ifndef _BUILD_STATS_H_
+#define _BUILD_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum _STATS_PHASE
+{
+    STATS_PHASE_TOTAL,
+    STATS_PHASE_SCAN,
+    STATS_PHASE_CACHE,
+    STATS_PHASE_LAYOUT,
+    STATS_PHASE_METADATA,
+    STATS_PHASE_FILE_DATA,
+    STATS_PHASE_ZERO_FILL,
+    STATS_PHASE_GPT,
+    STATS_PHASE_VERIFY,
+    STATS_PHASE_COUNT,
+} STATS_PHASE;
+
+typedef enum _STATS_COUNTER
+{
+    STATS_COUNTER_FILES,
+    STATS_COUNTER_DIRECTORIES,
+    STATS_COUNTER_BYTES_READ,
+    STATS_COUNTER_BYTES_CACHED,
+    STATS_COUNTER_BYTES_WRITTEN,
+    STATS_COUNTER_CLUSTERS_ALLOCATED,
+    STATS_COUNTER_DIRECTORY_EXTENSIONS,
+    STATS_COUNTER_COUNT,
+} STATS_COUNTER;
+
+// Phases are timed with the monotonic clock and may only be started and stopped by the thread that runs the build, a phase run twice adds up.
+// Each thread keeps its own phase times, the report shows those of the calling thread and of every merged one. Counters are shared by the whole process.
+void start_stats_phase(STATS_PHASE phase);
+void stop_stats_phase(STATS_PHASE phase);
+
+// Moves the finished phase times of the calling thread into the shared totals of the report, so builds on several threads add up.
+// Called by a thread that built images before it exits, phases it has not stopped yet are kept.
+void merge_stats_phases(void);
+
+// Safe to call from any thread.
+void add_stats_counter(STATS_COUNTER counter, uint64_t value);
+
+void write_stats_report(FILE *file);
+
+#endif /* _BUILD_STATS_H_ */
@@ -0,0 +1,321 @@
+#include "crc32.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32_tables.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HARDWARE_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HARDWARE_ARM 1
+#if defined(__clang__)
+#define CRC32_ARM_TARGET __attribute__((target("crc")))
+#else
+#define CRC32_ARM_TARGET __attribute__((target("+crc")))
+#endif
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_LITTLE_ENDIAN 1
+#endif
+
+typedef uint32_t (*CRC32_FUNCTION)(uint32_t crc, const uint8_t *data, uint64_t size);
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static CRC32_FUNCTION selected_function = NULL;
+
+static void _select_engine(void);
+static CRC32_FUNCTION _get_engine_function(CRC32_ENGINE engine);
+static uint32_t _update_table(uint32_t crc, const uint8_t *data, uint64_t size);
+static uint32_t _update_slice_by_8(uint32_t crc, const uint8_t *data, uint64_t size);
+static uint32_t _update_slice_by_16(uint32_t crc, const uint8_t *data, uint64_t size);
+#if defined(CRC32_HARDWARE_X86) || defined(CRC32_HARDWARE_ARM)
+static uint32_t _update_hardware(uint32_t crc, const uint8_t *data, uint64_t size);
+#endif
+
+uint32_t calculate_crc32(const void *buffer, uint64_t size)
+{
+    return update_crc32(0, buffer, size);
+}
+
+uint32_t update_crc32(uint32_t crc, const void *buffer, uint64_t size)
+{
+    pthread_once(&engine_once, _select_engine);
+
+    // The register is kept inverted between calls.
+    return selected_function(crc ^ 0xFFFFFFFF, buffer, size) ^ 0xFFFFFFFF;
+}
+
+uint32_t update_crc32_with_engine(CRC32_ENGINE engine, uint32_t crc, const void *buffer, uint64_t size)
+{
+    if (!is_crc32_engine_available(engine))
+    {
+        return update_crc32(crc, buffer, size);
+    }
+
+    return _get_engine_function(engine)(crc ^ 0xFFFFFFFF, buffer, size) ^ 0xFFFFFFFF;
+}
+
+bool is_crc32_engine_available(CRC32_ENGINE engine)
+{
+    switch (engine)
+    {
+    case CRC32_ENGINE_AUTO:
+    case CRC32_ENGINE_TABLE:
+    case CRC32_ENGINE_SLICE_BY_8:
+    case CRC32_ENGINE_SLICE_BY_16:
+        return true;
+    case CRC32_ENGINE_HARDWARE:
+#if defined(CRC32_HARDWARE_X86)
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#elif defined(CRC32_HARDWARE_ARM)
+        return 0 != (getauxval(AT_HWCAP) & HWCAP_CRC32);
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *get_crc32_engine_name(CRC32_ENGINE engine)
+{
+    switch (engine)
+    {
+    case CRC32_ENGINE_AUTO:
+        return "auto";
+    case CRC32_ENGINE_TABLE:
+        return "table";
+    case CRC32_ENGINE_SLICE_BY_8:
+        return "slice-by-8";
+    case CRC32_ENGINE_SLICE_BY_16:
+        return "slice-by-16";
+    case CRC32_ENGINE_HARDWARE:
+#if defined(CRC32_HARDWARE_X86)
+        return "pclmulqdq";
+#elif defined(CRC32_HARDWARE_ARM)
+        return "armv8-crc";
+#else
+        return "hardware";
+#endif
+    default:
+        return "unknown";
+    }
+}
+
+static void _select_engine(void)
+{
+    if (is_crc32_engine_available(CRC32_ENGINE_HARDWARE))
+    {
+        selected_function = _get_engine_function(CRC32_ENGINE_HARDWARE);
+    }
+    else
+    {
+        selected_function = _get_engine_function(CRC32_ENGINE_SLICE_BY_16);
+    }
+}
+
+static CRC32_FUNCTION _get_engine_function(CRC32_ENGINE engine)
+{
+    switch (engine)
+    {
+    case CRC32_ENGINE_TABLE:
+        return _update_table;
+    case CRC32_ENGINE_SLICE_BY_8:
+        return _update_slice_by_8;
+    case CRC32_ENGINE_SLICE_BY_16:
+        return _update_slice_by_16;
+#if defined(CRC32_HARDWARE_X86) || defined(CRC32_HARDWARE_ARM)
+    case CRC32_ENGINE_HARDWARE:
+        return _update_hardware;
+#endif
+    default:
+        pthread_once(&engine_once, _select_engine);
+        return selected_function;
+    }
+}
+
+static uint32_t _update_table(uint32_t crc, const uint8_t *data, uint64_t size)
+{
+    for (uint64_t n = 0; n < size; n++)
+        crc = crc32_tables[0][(crc ^ data[n]) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+static uint32_t _update_slice_by_8(uint32_t crc, const uint8_t *data, uint64_t size)
+{
+#if defined(CRC32_LITTLE_ENDIAN)
+    while (size >= 8)
+    {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+
+        crc = crc32_tables[7][low & 0xFF] ^ crc32_tables[6][(low >> 8) & 0xFF] ^
+              crc32_tables[5][(low >> 16) & 0xFF] ^ crc32_tables[4][low >> 24] ^
+              crc32_tables[3][high & 0xFF] ^ crc32_tables[2][(high >> 8) & 0xFF] ^
+              crc32_tables[1][(high >> 16) & 0xFF] ^ crc32_tables[0][high >> 24];
+
+        data += 8;
+        size -= 8;
+    }
+#endif /* CRC32_LITTLE_ENDIAN */
+
+    return _update_table(crc, data, size);
+}
+
+static uint32_t _update_slice_by_16(uint32_t crc, const uint8_t *data, uint64_t size)
+{
+#if defined(CRC32_LITTLE_ENDIAN)
+    while (size >= 16)
+    {
+        uint32_t words[4];
+        memcpy(words, data, sizeof(words));
+        words[0] ^= crc;
+
+        crc = crc32_tables[15][words[0] & 0xFF] ^ crc32_tables[14][(words[0] >> 8) & 0xFF] ^
+              crc32_tables[13][(words[0] >> 16) & 0xFF] ^ crc32_tables[12][words[0] >> 24] ^
+              crc32_tables[11][words[1] & 0xFF] ^ crc32_tables[10][(words[1] >> 8) & 0xFF] ^
+              crc32_tables[9][(words[1] >> 16) & 0xFF] ^ crc32_tables[8][words[1] >> 24] ^
+              crc32_tables[7][words[2] & 0xFF] ^ crc32_tables[6][(words[2] >> 8) & 0xFF] ^
+              crc32_tables[5][(words[2] >> 16) & 0xFF] ^ crc32_tables[4][words[2] >> 24] ^
+              crc32_tables[3][words[3] & 0xFF] ^ crc32_tables[2][(words[3] >> 8) & 0xFF] ^
+              crc32_tables[1][(words[3] >> 16) & 0xFF] ^ crc32_tables[0][words[3] >> 24];
+
+        data += 16;
+        size -= 16;
+    }
+#endif /* CRC32_LITTLE_ENDIAN */
+
+    return _update_table(crc, data, size);
+}
+
+#if defined(CRC32_HARDWARE_X86)
+
+// Carry-less multiplication folding as described in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+// Four 128-bit lanes are folded 64 bytes at a time, reduced to one lane, then to 32 bits with a Barrett reduction.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _update_hardware(uint32_t crc, const uint8_t *data, uint64_t size)
+{
+    if (size < 64)
+    {
+        return _update_slice_by_16(crc, data, size);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x1C6E41596, 0x154442BD4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0CCAA009E, 0x1751997D0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163CD6124);
+    const __m128i polynomial = _mm_set_epi64x(0x1F7011641, 0x1DB710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    data += 64;
+    size -= 64;
+
+    while (size >= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 48)));
+
+        data += 64;
+        size -= 64;
+    }
+
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+
+    while (size >= 16)
+    {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)),
+                           _mm_loadu_si128((const __m128i *)data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 -> 64 bits, which also appends the 32 zero bits the reduction expects.
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+
+    // 64 -> 32 bits.
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Bit-reflected Barrett reduction.
+    x2 = x1;
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), polynomial, 0x10);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), polynomial, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return _update_slice_by_16(crc, data, size);
+}
+
+#elif defined(CRC32_HARDWARE_ARM)
+
+// The ARMv8 CRC32X instructions implement this exact polynomial, eight bytes per instruction.
+CRC32_ARM_TARGET
+static uint32_t _update_hardware(uint32_t crc, const uint8_t *data, uint64_t size)
+{
+    while (size > 0 && 0 != ((uintptr_t)data & 7))
+    {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+
+    while (size >= 32)
+    {
+        uint64_t words[4];
+        memcpy(words, data, sizeof(words));
+        crc = __crc32d(crc, words[0]);
+        crc = __crc32d(crc, words[1]);
+        crc = __crc32d(crc, words[2]);
+        crc = __crc32d(crc, words[3]);
+        data += 32;
+        size -= 32;
+    }
+
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32d(crc, word);
+        data += 8;
+        size -= 8;
+    }
+
+    while (size > 0)
+    {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+
+    return crc;
+}
+
+#endif /* CRC32_HARDWARE_X86 */
@@ -0,0 +1,29 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum _CRC32_ENGINE
+{
+    CRC32_ENGINE_AUTO,
+    CRC32_ENGINE_TABLE,
+    CRC32_ENGINE_SLICE_BY_8,
+    CRC32_ENGINE_SLICE_BY_16,
+    CRC32_ENGINE_HARDWARE,
+    CRC32_ENGINE_COUNT,
+} CRC32_ENGINE;
+
+// CRC-32 as used by GPT and zlib. The fastest engine supported by the CPU is picked on first use.
+uint32_t calculate_crc32(const void *buffer, uint64_t size);
+
+// Continues a CRC returned by calculate_crc32() or update_crc32(), so large images can be checksummed in pieces. Start with 0.
+uint32_t update_crc32(uint32_t crc, const void *buffer, uint64_t size);
+
+uint32_t update_crc32_with_engine(CRC32_ENGINE engine, uint32_t crc, const void *buffer, uint64_t size);
+
+bool is_crc32_engine_available(CRC32_ENGINE engine);
+
+const char *get_crc32_engine_name(CRC32_ENGINE engine);
+
+#endif /* _CRC32_H_ */
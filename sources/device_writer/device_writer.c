@@ -0,0 +1,391 @@
+#include "device_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// O_DIRECT needs buffers aligned to the logical block size of the target, a page covers every common device.
+#define BUFFER_ALIGNMENT 4096
+#define DEVICE_INDEX_BITS 16
+
+typedef struct _DEVICE_BLOCK
+{
+    uint8_t *Data;
+    uint64_t Offset;
+    // Targets that did not finish writing the block yet, it can only be refilled at 0.
+    uint32_t Pending;
+} DEVICE_BLOCK;
+
+typedef struct _DEVICE_RING
+{
+    int Descriptor;
+    uint32_t *SubmissionHead;
+    uint32_t *SubmissionTail;
+    uint32_t *SubmissionMask;
+    uint32_t *SubmissionArray;
+    struct io_uring_sqe *SubmissionEntries;
+    uint32_t *CompletionHead;
+    uint32_t *CompletionTail;
+    uint32_t *CompletionMask;
+    struct io_uring_cqe *CompletionEntries;
+    void *SubmissionRing;
+    size_t SubmissionRingSize;
+    void *CompletionRing;
+    size_t CompletionRingSize;
+    size_t SubmissionEntriesSize;
+    uint32_t Unsubmitted;
+} DEVICE_RING;
+
+struct _DEVICE_WRITER
+{
+    const char *const *Paths;
+    int *Descriptors;
+    uint32_t DeviceCount;
+    DEVICE_BLOCK *Blocks;
+    uint32_t BlockCount;
+    DEVICE_BLOCK *CurrentBlock;
+    // Without io_uring every block is written with pwrite before the next one is filled.
+    bool HasRing;
+    DEVICE_RING Ring;
+};
+
+static int _open_target(const char *path);
+static bool _setup_ring(DEVICE_RING *ring, uint32_t entries);
+static void _submit_block(DEVICE_WRITER *writer, DEVICE_BLOCK *block);
+static DEVICE_BLOCK *_get_free_block(DEVICE_WRITER *writer);
+static void _enter_ring(DEVICE_WRITER *writer, uint32_t minimum_completions);
+static void _reap_completions(DEVICE_WRITER *writer);
+static void _write_range(int descriptor, const char *path, const uint8_t *data, uint64_t offset, uint64_t size);
+
+DEVICE_WRITER *open_device_writer(const char *const *paths, uint32_t path_count, uint32_t queue_depth)
+{
+    DEVICE_WRITER *writer = calloc(1, sizeof(*writer));
+    if (NULL == writer)
+    {
+        perror("Error allocating device writer");
+        exit(1);
+    }
+
+    writer->Paths = paths;
+    writer->DeviceCount = path_count;
+    writer->BlockCount = queue_depth;
+    writer->Descriptors = calloc(path_count, sizeof(*writer->Descriptors));
+    writer->Blocks = calloc(queue_depth, sizeof(*writer->Blocks));
+    if (NULL == writer->Descriptors || NULL == writer->Blocks)
+    {
+        perror("Error allocating device writer");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < path_count; ++i)
+    {
+        writer->Descriptors[i] = _open_target(paths[i]);
+    }
+
+    for (uint32_t i = 0; i < queue_depth; ++i)
+    {
+        if (0 != posix_memalign((void **)&writer->Blocks[i].Data, BUFFER_ALIGNMENT, DEVICE_BLOCK_SIZE))
+        {
+            perror("Error allocating device buffers");
+            exit(1);
+        }
+    }
+
+    // Every block in flight needs one entry per target.
+    writer->HasRing = _setup_ring(&writer->Ring, queue_depth * path_count);
+
+    return writer;
+}
+
+void write_device_region(DEVICE_WRITER *writer, uint64_t offset, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+
+    while (size > 0)
+    {
+        uint64_t block_offset = offset / DEVICE_BLOCK_SIZE * DEVICE_BLOCK_SIZE;
+        if (NULL == writer->CurrentBlock || writer->CurrentBlock->Offset != block_offset)
+        {
+            if (NULL != writer->CurrentBlock)
+            {
+                if (writer->CurrentBlock->Offset > block_offset)
+                {
+                    fprintf(stderr, "Device image written out of order at offset %llu\n", (unsigned long long)offset);
+                    exit(1);
+                }
+                _submit_block(writer, writer->CurrentBlock);
+            }
+
+            // Parts of a block the image does not write are zeros, exactly as in a raw image.
+            writer->CurrentBlock = _get_free_block(writer);
+            writer->CurrentBlock->Offset = block_offset;
+            memset(writer->CurrentBlock->Data, 0, DEVICE_BLOCK_SIZE);
+        }
+
+        uint64_t piece = DEVICE_BLOCK_SIZE - (offset - block_offset);
+        piece = piece < size ? piece : size;
+        memcpy(writer->CurrentBlock->Data + (offset - block_offset), data, piece);
+
+        data += piece;
+        offset += piece;
+        size -= piece;
+    }
+}
+
+void close_device_writer(DEVICE_WRITER *writer, uint64_t image_size)
+{
+    if (NULL != writer->CurrentBlock)
+    {
+        _submit_block(writer, writer->CurrentBlock);
+        writer->CurrentBlock = NULL;
+    }
+
+    for (uint32_t i = 0; i < writer->BlockCount; ++i)
+    {
+        while (0 != writer->Blocks[i].Pending)
+        {
+            _enter_ring(writer, 1);
+        }
+    }
+
+    for (uint32_t i = 0; i < writer->DeviceCount; ++i)
+    {
+        struct stat status;
+        if (0 == fstat(writer->Descriptors[i], &status) && S_ISREG(status.st_mode) && 0 != ftruncate(writer->Descriptors[i], image_size))
+        {
+            fprintf(stderr, "Error setting size of %s: %s\n", writer->Paths[i], strerror(errno));
+            exit(1);
+        }
+        if (0 != fsync(writer->Descriptors[i]))
+        {
+            fprintf(stderr, "Error flushing %s: %s\n", writer->Paths[i], strerror(errno));
+            exit(1);
+        }
+        close(writer->Descriptors[i]);
+    }
+
+    if (writer->HasRing)
+    {
+        munmap(writer->Ring.SubmissionEntries, writer->Ring.SubmissionEntriesSize);
+        if (writer->Ring.CompletionRing != writer->Ring.SubmissionRing)
+        {
+            munmap(writer->Ring.CompletionRing, writer->Ring.CompletionRingSize);
+        }
+        munmap(writer->Ring.SubmissionRing, writer->Ring.SubmissionRingSize);
+        close(writer->Ring.Descriptor);
+    }
+
+    for (uint32_t i = 0; i < writer->BlockCount; ++i)
+    {
+        free(writer->Blocks[i].Data);
+    }
+    free(writer->Blocks);
+    free(writer->Descriptors);
+    free(writer);
+}
+
+// Targets are never truncated, a device keeps its size and a file is only cut to the image size at the end.
+static int _open_target(const char *path)
+{
+    int descriptor = open(path, O_WRONLY | O_CREAT | O_DIRECT, 0644);
+    if (descriptor < 0 && EINVAL == errno)
+    {
+        fprintf(stderr, "%s does not support O_DIRECT, writing through the page cache\n", path);
+        descriptor = open(path, O_WRONLY | O_CREAT, 0644);
+    }
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    return descriptor;
+}
+
+// Returns false when the kernel has no io_uring or it is not allowed, the writer then falls back to pwrite.
+static bool _setup_ring(DEVICE_RING *ring, uint32_t entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->Descriptor = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->Descriptor < 0)
+    {
+        return false;
+    }
+
+    ring->SubmissionRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->CompletionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->CompletionRingSize > ring->SubmissionRingSize)
+        {
+            ring->SubmissionRingSize = ring->CompletionRingSize;
+        }
+        ring->CompletionRingSize = ring->SubmissionRingSize;
+    }
+
+    ring->SubmissionRing = mmap(NULL, ring->SubmissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->Descriptor, IORING_OFF_SQ_RING);
+    ring->CompletionRing = ring->SubmissionRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && MAP_FAILED != ring->SubmissionRing)
+    {
+        ring->CompletionRing = mmap(NULL, ring->CompletionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->Descriptor, IORING_OFF_CQ_RING);
+    }
+    ring->SubmissionEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->SubmissionEntries = mmap(NULL, ring->SubmissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->Descriptor, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->SubmissionRing || MAP_FAILED == ring->CompletionRing || MAP_FAILED == ring->SubmissionEntries)
+    {
+        perror("Error mapping io_uring");
+        exit(1);
+    }
+
+    uint8_t *submission = ring->SubmissionRing;
+    uint8_t *completion = ring->CompletionRing;
+    ring->SubmissionHead = (uint32_t *)(submission + params.sq_off.head);
+    ring->SubmissionTail = (uint32_t *)(submission + params.sq_off.tail);
+    ring->SubmissionMask = (uint32_t *)(submission + params.sq_off.ring_mask);
+    ring->SubmissionArray = (uint32_t *)(submission + params.sq_off.array);
+    ring->CompletionHead = (uint32_t *)(completion + params.cq_off.head);
+    ring->CompletionTail = (uint32_t *)(completion + params.cq_off.tail);
+    ring->CompletionMask = (uint32_t *)(completion + params.cq_off.ring_mask);
+    ring->CompletionEntries = (struct io_uring_cqe *)(completion + params.cq_off.cqes);
+    ring->Unsubmitted = 0;
+
+    return true;
+}
+
+// Queues the block once for every target, the user data tells which block and target a completion belongs to.
+static void _submit_block(DEVICE_WRITER *writer, DEVICE_BLOCK *block)
+{
+    if (!writer->HasRing)
+    {
+        for (uint32_t i = 0; i < writer->DeviceCount; ++i)
+        {
+            _write_range(writer->Descriptors[i], writer->Paths[i], block->Data, block->Offset, DEVICE_BLOCK_SIZE);
+        }
+        return;
+    }
+
+    DEVICE_RING *ring = &writer->Ring;
+    uint64_t block_index = block - writer->Blocks;
+
+    for (uint32_t i = 0; i < writer->DeviceCount; ++i)
+    {
+        uint32_t tail = *ring->SubmissionTail;
+        uint32_t index = tail & *ring->SubmissionMask;
+
+        struct io_uring_sqe *entry = &ring->SubmissionEntries[index];
+        memset(entry, 0, sizeof(*entry));
+        entry->opcode = IORING_OP_WRITE;
+        entry->fd = writer->Descriptors[i];
+        entry->addr = (uint64_t)(uintptr_t)block->Data;
+        entry->len = DEVICE_BLOCK_SIZE;
+        entry->off = block->Offset;
+        entry->user_data = block_index << DEVICE_INDEX_BITS | i;
+
+        ring->SubmissionArray[index] = index;
+        __atomic_store_n(ring->SubmissionTail, tail + 1, __ATOMIC_RELEASE);
+        ring->Unsubmitted++;
+    }
+
+    block->Pending = writer->DeviceCount;
+    _enter_ring(writer, 0);
+}
+
+static DEVICE_BLOCK *_get_free_block(DEVICE_WRITER *writer)
+{
+    while (true)
+    {
+        for (uint32_t i = 0; i < writer->BlockCount; ++i)
+        {
+            if (0 == writer->Blocks[i].Pending)
+            {
+                return &writer->Blocks[i];
+            }
+        }
+
+        _enter_ring(writer, 1);
+    }
+}
+
+static void _enter_ring(DEVICE_WRITER *writer, uint32_t minimum_completions)
+{
+    DEVICE_RING *ring = &writer->Ring;
+
+    do
+    {
+        long result = syscall(__NR_io_uring_enter, ring->Descriptor, ring->Unsubmitted, minimum_completions,
+                              minimum_completions ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result < 0)
+        {
+            if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+            {
+                _reap_completions(writer);
+                continue;
+            }
+            perror("Error submitting device writes");
+            exit(1);
+        }
+        ring->Unsubmitted -= (uint32_t)result;
+    } while (0 != ring->Unsubmitted);
+
+    _reap_completions(writer);
+}
+
+static void _reap_completions(DEVICE_WRITER *writer)
+{
+    DEVICE_RING *ring = &writer->Ring;
+    uint32_t head = *ring->CompletionHead;
+
+    while (head != __atomic_load_n(ring->CompletionTail, __ATOMIC_ACQUIRE))
+    {
+        const struct io_uring_cqe *completion = &ring->CompletionEntries[head & *ring->CompletionMask];
+        DEVICE_BLOCK *block = &writer->Blocks[completion->user_data >> DEVICE_INDEX_BITS];
+        uint32_t device = completion->user_data & ((1U << DEVICE_INDEX_BITS) - 1);
+
+        if (completion->res < 0)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", writer->Paths[device], strerror(-completion->res));
+            exit(1);
+        }
+        // The rest of a short write is written synchronously, pwrite reports why it stopped.
+        if (completion->res < DEVICE_BLOCK_SIZE)
+        {
+            _write_range(writer->Descriptors[device], writer->Paths[device], block->Data + completion->res,
+                         block->Offset + completion->res, DEVICE_BLOCK_SIZE - completion->res);
+        }
+
+        block->Pending--;
+        head++;
+    }
+
+    __atomic_store_n(ring->CompletionHead, head, __ATOMIC_RELEASE);
+}
+
+static void _write_range(int descriptor, const char *path, const uint8_t *data, uint64_t offset, uint64_t size)
+{
+    uint64_t written = 0;
+
+    while (written < size)
+    {
+        ssize_t result = pwrite(descriptor, data + written, size - written, offset + written);
+        if (result <= 0)
+        {
+            if (result < 0 && EINTR == errno)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error writing %s: %s\n", path, result < 0 ? strerror(errno) : "device is full");
+            exit(1);
+        }
+        written += result;
+    }
+}
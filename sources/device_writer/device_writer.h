@@ -0,0 +1,20 @@
+#ifndef _DEVICE_WRITER_H_
+#define _DEVICE_WRITER_H_
+
+#include <stdint.h>
+
+// Writes one image to several block devices or files at once. The image has to arrive in ascending offset order, it is collected
+// into aligned blocks that go to every target with O_DIRECT through an io_uring queue. Blocks that get no data are not written at all.
+typedef struct _DEVICE_WRITER DEVICE_WRITER;
+
+// Block size of every write, image offsets and the image size are multiples of it.
+#define DEVICE_BLOCK_SIZE (1024 * 1024)
+
+DEVICE_WRITER *open_device_writer(const char *const *paths, uint32_t path_count, uint32_t queue_depth);
+
+void write_device_region(DEVICE_WRITER *writer, uint64_t offset, const void *buffer, uint64_t size);
+
+// Waits for every write, flushes the targets and closes them. Regular files are cut to image_size.
+void close_device_writer(DEVICE_WRITER *writer, uint64_t image_size);
+
+#endif /* _DEVICE_WRITER_H_ */
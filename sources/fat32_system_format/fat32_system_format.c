@@ -1,13 +1,15 @@
 #include "fat32_system_format.h"
 
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/stat.h>
 
-#define DT_DIRECTORY 4
-#define DT_REGULAR_FILE 8
+#include "build_stats.h"
 
 #define ATTRIBUTE_READ_ONLY 0x01
 #define ATTRIBUTE_HIDDEN 0x02
@@ -15,32 +17,173 @@
 #define ATTRIBUTE_VOLUME_ID 0x08
 #define ATTRIBUTE_DIRECTORY 0x10
 #define ATTRIBUTE_ARCHIVE 0x20
+#define ATTRIBUTE_LONG_NAME 0x0F
+
+#define DELETED_ENTRY 0xE5
+#define END_OF_CHAIN 0x0FFFFFF8
 
 #define FIRST_USABLE_SECTOR 2048
 #define BYTES_PER_SECTOR 512
-#define SECTORS_PER_CLUSTER 8
-#define TOTAL_SECTORS 4ULL * 1024 * 1024 * 1024 / BYTES_PER_SECTOR
-#define FAT_SIZE 8ULL * 1024 * 1024 / BYTES_PER_SECTOR
+// Automatic selection stays between 4 KiB and 32 KiB clusters unless the volume is too small for them, larger ones are not portable.
+#define DEFAULT_SECTORS_PER_CLUSTER 8
+#define MAXIMUM_SECTORS_PER_CLUSTER 64
+#define RESERVED_SECTORS_COUNT 32
+#define NUMBER_OF_FATS 2
+
+// FAT32 needs at least 65525 clusters, fewer would make it a FAT16 volume.
+#define MINIMUM_CLUSTER_COUNT 65525
+#define MAXIMUM_CLUSTER_COUNT 0x0FFFFFF5
 
-#define NUMBER_OF_ENTRIES_IN_A_CLUSTERS 4096 / 32
+#define NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume) ((volume)->ClusterSize / 32)
+#define DATA_CHUNK_SIZE 32ULL * 1024 * 1024
+// Smaller chunks for a stream, each one in flight holds a buffer.
+#define STREAM_CHUNK_SIZE 4ULL * 1024 * 1024
+#define CALLBACK_BUFFER_SIZE 1024 * 1024
+#define BAD_CLUSTER 0x0FFFFFF7
+// Problems past the limit are only counted.
+#define VERIFY_MESSAGE_LIMIT 100
+// Larger files are compared in pieces of this size by several verifiers.
+#define VERIFY_CHUNK_SIZE (32U * 1024 * 1024)
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+#define VERIFY_FAT_RANGE (1024 * 1024)
+// Reproducible updates read files back from the image in pieces of this size, it is a multiple of every cluster size.
+#define COMPARE_BUFFER_SIZE (1024 * 1024)
 
-static void *volume_buffer = NULL;
-static uint32_t FirstDataSector;
-static uint32_t *FATs = NULL;
-static uint32_t *MirrorFATs = NULL;
+// Consecutive FAT entries of a chain, GCC lowers the arithmetic to SSE2/NEON or plain scalar code.
+typedef uint32_t FAT_RUN __attribute__((vector_size(16)));
 
 typedef struct _SECTOR
 {
     uint8_t sector_buffer[BYTES_PER_SECTOR];
 } __attribute__((packed)) SECTOR;
 
-typedef struct _CLUSTER
+typedef struct _DIRECTORY_CLUSTER
+{
+    uint32_t ClusterNumber;
+    uint8_t *Contents;
+    // Only dirty clusters are written back when an existing image is updated.
+    bool Dirty;
+} DIRECTORY_CLUSTER;
+
+typedef struct _FILE_EXTENT
+{
+    const INPUT_NODE *Source;
+    uint64_t SourceOffset;
+    uint64_t Size;
+    uint32_t FirstCluster;
+    uint32_t ClusterCount;
+} FILE_EXTENT;
+
+// A cluster aligned slice of a file extent, the unit of work for the data writers.
+typedef struct _DATA_CHUNK
+{
+    const FILE_EXTENT *Extent;
+    uint64_t Offset;
+    uint64_t Size;
+} DATA_CHUNK;
+
+typedef struct _DATA_WRITER
+{
+    FAT32_VOLUME *Volume;
+    IMAGE_OUTPUT *Output;
+    uint64_t DataOffset;
+    DATA_CHUNK *Chunks;
+    uint32_t ChunkCount;
+    atomic_uint NextChunk;
+} DATA_WRITER;
+
+typedef struct _STREAM_SLOT
+{
+    uint8_t *Buffer;
+    uint64_t DataSize;
+    bool Ready;
+} STREAM_SLOT;
+
+// Reader threads fill a bounded ring of buffers ahead of the stream, the calling thread writes them out in chunk order.
+// Chunk i goes to slot i % SlotCount once chunk i - SlotCount has been written.
+typedef struct _STREAM_PIPELINE
+{
+    DATA_CHUNK *Chunks;
+    uint32_t ChunkCount;
+    STREAM_SLOT *Slots;
+    uint32_t SlotCount;
+    uint32_t NextChunk;
+    uint32_t WrittenChunks;
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+} STREAM_PIPELINE;
+
+typedef enum _VERIFY_TASK_TYPE
+{
+    VERIFY_TASK_DIRECTORY,
+    VERIFY_TASK_FILE,
+    VERIFY_TASK_CONTENTS,
+} VERIFY_TASK_TYPE;
+
+// The clusters of a file that is compared in pieces, the piece that finishes last frees it.
+typedef struct _VERIFY_CHAIN
 {
-    uint8_t cluster_buffer[BYTES_PER_SECTOR * SECTORS_PER_CLUSTER];
-} __attribute__((packed)) CLUSTER;
+    char *Path;
+    const INPUT_NODE *Input;
+    uint32_t *Clusters;
+    atomic_uint References;
+} VERIFY_CHAIN;
 
-static SECTOR *volume_sector_buffer = NULL;
-static CLUSTER *data_cluster_buffer = NULL;
+// A directory, file or piece of a file still to be checked. Input directories whose short names collide are merged into one
+// directory of the volume, so a directory can have several inputs. Without inputs only the chain and the entries are checked.
+typedef struct _VERIFY_TASK
+{
+    VERIFY_TASK_TYPE Type;
+    char *Path;
+    uint32_t FirstCluster;
+    uint32_t ParentCluster;
+    uint32_t Size;
+    const INPUT_NODE **Inputs;
+    uint32_t InputCount;
+    VERIFY_CHAIN *Chain;
+    uint64_t Offset;
+} VERIFY_TASK;
+
+// One entry of a directory, as found in the volume or as expected from the input. Both lists are sorted by short name to pair them up.
+typedef struct _VERIFY_ENTRY
+{
+    char Name[11];
+    bool IsDirectory;
+    uint32_t Order;
+    uint32_t FirstCluster;
+    uint32_t Size;
+    const INPUT_NODE *Input;
+} VERIFY_ENTRY;
+
+// Checks a mapped volume with a pool of threads that take tasks from a shared stack. Owners holds the chain that claimed each cluster:
+// a chain that runs into one of its own clusters loops, one that runs into a cluster of another chain is cross-linked.
+typedef struct _VOLUME_VERIFIER
+{
+    const uint8_t *Data;
+    const uint32_t *FATs;
+    const uint32_t *MirrorFATs;
+    uint32_t FATEntryCount;
+    uint32_t ClusterCount;
+    uint32_t ClusterSize;
+    uint32_t RootCluster;
+    bool CompareInput;
+    atomic_uint *Owners;
+    atomic_uint NextOwner;
+    atomic_uint_fast64_t ProblemCount;
+
+    VERIFY_TASK *Tasks;
+    uint32_t TaskCount;
+    uint32_t TaskCapacity;
+    uint32_t BusyCount;
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+
+    // Totals of the pass over both FATs, which splits them into ranges of VERIFY_FAT_RANGE entries.
+    atomic_uint NextRange;
+    atomic_uint_fast64_t FreeCount;
+    atomic_uint_fast64_t LostCount;
+    atomic_uint_fast64_t MirrorDifferences;
+} VOLUME_VERIFIER;
 
 typedef struct _BIOS_PARAMETER_BLOCK
 {
@@ -86,8 +229,6 @@ typedef struct _FILE_SECTOR_INFO
     uint32_t TrailSignature;
 } __attribute__((packed)) FILE_SECTOR_INFO;
 
-static FILE_SECTOR_INFO *FSInfo = NULL;
-
 typedef struct _DIRECTORY_ENTRY
 {
     char Name[11];
@@ -116,37 +257,292 @@ typedef struct _LONG_DIRECTORY_ENTRY
     char Name3[4];
 } __attribute__((packed)) LONG_DIRECTORY_ENTRY;
 
-static void _copy_input_directory(const char *inputDirectoryPath, uint32_t parent_directory_cluster);
-static uint32_t _make_entry(const char *directory_name, uint32_t first_cluster, uint32_t parent_directory_cluster, bool is_directory, uint32_t file_size);
-static void _copy_file_contents(FILE *inputFile, uint32_t first_cluster);
-static uint32_t _create_directory_entry(DIRECTORY_ENTRY *directory_entry, const char *name, bool is_directory, uint32_t file_size, uint32_t cluster_number);
-static void _create_default_directory_entries(uint32_t cluster, uint32_t parent_directory_cluster);
-static uint32_t _get_next_free_cluster(void);
-static void _get_time_and_date(uint16_t *outputTime, uint16_t *outputDate);
-static void _append_path(const char *currentPath, const char *currentDirectoryName, char *output);
+// One used entry of a directory, Name[0] == 0 marks an empty slot of the table.
+// Entries read from an existing image start with all flags cleared. Kept entries are still in the input, Released ones had their
+// clusters freed because they changed and wait to be filled again. Claimed is set once an input entry took the name.
+typedef struct _DIRECTORY_RECORD
+{
+    char Name[11];
+    bool IsDirectory;
+    bool Kept;
+    bool Released;
+    bool Claimed;
+    uint32_t FirstCluster;
+    uint32_t EntryCluster;
+    DIRECTORY_ENTRY *Entry;
+    struct _DIRECTORY_INDEX *Subdirectory;
+} DIRECTORY_RECORD;
+
+// Lookup state of a directory while it is being filled: an open addressing table of its entry names and the first free entry at the end of its chain.
+typedef struct _DIRECTORY_INDEX
+{
+    uint32_t FirstCluster;
+    DIRECTORY_RECORD *Records;
+    uint32_t RecordCount;
+    uint32_t Capacity;
+    uint32_t LastCluster;
+    DIRECTORY_ENTRY *LastEntries;
+    uint32_t NextEntry;
+} DIRECTORY_INDEX;
+
+// Everything one volume needs while it is laid out and written. Volumes share no state, so several can be built on separate threads.
+struct _FAT32_VOLUME
+{
+    // Only the reserved sectors and both FATs live in this buffer, directory clusters are kept separately and file data is streamed at write time.
+    void *MetadataBuffer;
+    SECTOR *MetadataSectors;
+    uint32_t TotalSectors;
+    uint32_t FirstDataSector;
+    uint32_t FATSize;
+    uint32_t ClusterCount;
+    // Set by select_fat32_cluster_size() for a new volume and read from the boot sector of a loaded one.
+    uint32_t SectorsPerCluster;
+    uint32_t ClusterSize;
+
+    // Converted once per volume, only file modification times are converted per entry.
+    bool Reproducible;
+    // Prints every entry that is added, updated or removed to stdout.
+    bool Verbose;
+    uint16_t BuildTime;
+    uint16_t BuildDate;
+    // Only FATs is kept up to date while building, MirrorFATs is copied from it when the volume is written.
+    uint32_t *FATs;
+    uint32_t *MirrorFATs;
+    FILE_SECTOR_INFO *FSInfo;
+
+    // One bit per cluster, set while the cluster is in use. Clusters freed by an update are found again here.
+    uint64_t *ClusterBitmap;
+    // The FAT as it was read from an existing image, only sectors that differ from it are written back. NULL for a newly formatted volume.
+    uint32_t *LoadedFATs;
+    // The image a loaded volume was read from and the offset of its data area, file contents are compared with it.
+    IMAGE_OUTPUT *LoadedOutput;
+    uint64_t LoadedDataOffset;
+
+    // Kept sorted by cluster number for lookups.
+    DIRECTORY_CLUSTER *DirectoryClusters;
+    uint32_t DirectoryClusterCount;
+    uint32_t DirectoryClusterCapacity;
+
+    FILE_EXTENT *FileExtents;
+    uint32_t FileExtentCount;
+    uint32_t FileExtentCapacity;
+
+    DIRECTORY_INDEX *RootDirectory;
+};
+
+static void _keep_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *inputDirectory, DIRECTORY_INDEX *directory);
+static void _copy_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *inputDirectory, DIRECTORY_INDEX *directory);
+static bool _is_entry_current(FAT32_VOLUME *volume, const DIRECTORY_RECORD *record, const INPUT_NODE *input);
+static bool _is_file_unchanged(FAT32_VOLUME *volume, uint32_t first_cluster, const INPUT_NODE *input);
+static DIRECTORY_INDEX *_make_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, const char *entry_name, const INPUT_NODE *input);
+static DIRECTORY_INDEX *_refill_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, DIRECTORY_RECORD *record, const INPUT_NODE *input);
+static DIRECTORY_INDEX *_fill_entry(FAT32_VOLUME *volume, DIRECTORY_ENTRY *directory_entry, const char *entry_name, const INPUT_NODE *input, uint32_t parent_directory_cluster);
+static void _remove_stale_entries(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, const char *path);
+static void _release_entry(FAT32_VOLUME *volume, DIRECTORY_RECORD *record);
+static DIRECTORY_INDEX *_load_directory(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t first_cluster);
+static void _write_changed_fat_sectors(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset);
+static DIRECTORY_INDEX *_create_directory_index(uint32_t first_cluster, uint8_t *contents);
+static DIRECTORY_RECORD *_find_directory_record(DIRECTORY_INDEX *directory, const char *entry_name);
+static DIRECTORY_RECORD *_probe_directory_records(DIRECTORY_RECORD *records, uint32_t capacity, const char *entry_name);
+static DIRECTORY_RECORD *_add_directory_record(DIRECTORY_INDEX *directory, DIRECTORY_ENTRY *directory_entry, uint32_t entry_cluster, DIRECTORY_INDEX *subdirectory);
+static DIRECTORY_ENTRY *_get_free_directory_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory);
+static void _free_directory_index(DIRECTORY_INDEX *directory);
+static uint32_t _map_file_contents(FAT32_VOLUME *volume, const INPUT_NODE *inputFile);
+static void _write_file_data(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t jobs);
+static void _stream_volume_data(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t jobs);
+static void *_run_stream_reader(void *argument);
+static uint64_t _read_stream_chunk(const DATA_CHUNK *chunk, uint8_t *buffer);
+static int _compare_file_extents(const void *first, const void *second);
+static void *_run_data_writer(void *argument);
+static void _write_file_chunk(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, const DATA_CHUNK *chunk);
+static uint64_t _write_callback_data(IMAGE_OUTPUT *output, uint64_t position, const FILE_EXTENT *extent, uint64_t offset, uint64_t size);
+static uint8_t *_add_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster);
+static void _remove_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster);
+static DIRECTORY_CLUSTER *_find_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster);
+static uint32_t _create_directory_entry(FAT32_VOLUME *volume, DIRECTORY_ENTRY *directory_entry, const char *name, bool is_directory, uint32_t file_size, uint32_t cluster_number, time_t modification_time);
+static void _create_default_directory_entries(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, uint32_t parent_directory_cluster);
+static uint32_t _allocate_clusters(FAT32_VOLUME *volume, uint32_t cluster_count, uint32_t *run_length);
+static uint32_t _find_free_run(FAT32_VOLUME *volume, uint32_t cluster, uint32_t minimum, uint32_t maximum, uint32_t *run_length);
+static void _free_cluster_chain(FAT32_VOLUME *volume, uint32_t first_cluster, bool is_directory);
+static bool _is_cluster_used(FAT32_VOLUME *volume, uint32_t cluster);
+static void _set_cluster_used(FAT32_VOLUME *volume, uint32_t cluster, bool used);
+static void _write_fat_chain(FAT32_VOLUME *volume, uint32_t first_cluster, uint32_t cluster_count);
+static void _set_cluster_size(FAT32_VOLUME *volume, uint32_t sectors_per_cluster);
+static uint64_t _get_file_cluster_count(FAT32_VOLUME *volume, uint64_t file_size);
+static uint64_t _count_directory_clusters(FAT32_VOLUME *volume, const INPUT_NODE *directory, bool is_root);
+static uint32_t _get_fat_size(FAT32_VOLUME *volume, uint32_t total_sectors);
+static uint32_t _get_cluster_count(FAT32_VOLUME *volume, uint32_t total_sectors);
+static void _get_time_and_date(FAT32_VOLUME *volume, time_t timestamp, uint16_t *outputTime, uint16_t *outputDate);
 static void _format_name(const char *entryName, char *output);
+static char *_make_short_path(const char *directory_path, const char *name);
+static void _run_volume_verifiers(VOLUME_VERIFIER *verifier, uint32_t jobs, void *(*routine)(void *));
+static void *_run_tree_verifier(void *argument);
+static void *_run_fat_verifier(void *argument);
+static void _push_verify_tasks(VOLUME_VERIFIER *verifier, const VERIFY_TASK *tasks, uint32_t taskCount);
+static bool _pop_verify_task(VOLUME_VERIFIER *verifier, VERIFY_TASK *task);
+static void _finish_verify_task(VOLUME_VERIFIER *verifier);
+static void _verify_directory(VOLUME_VERIFIER *verifier, const VERIFY_TASK *task);
+static void _verify_file(VOLUME_VERIFIER *verifier, const VERIFY_TASK *task);
+static void _compare_verify_contents(VOLUME_VERIFIER *verifier, const VERIFY_CHAIN *chain, uint64_t offset, uint64_t size);
+static bool _claim_verify_chain(VOLUME_VERIFIER *verifier, const char *path, uint32_t first_cluster, uint32_t **clusters, uint32_t *cluster_count);
+static VERIFY_TASK _make_verify_task(const VERIFY_TASK *directory, const VERIFY_ENTRY *entry, const INPUT_NODE **inputs, uint32_t input_count);
+static int _compare_verify_entries(const void *first, const void *second);
+static void _report_verify_problem(VOLUME_VERIFIER *verifier, const char *format, ...);
 
-void init_fat32_file_system(void)
+FAT32_VOLUME *init_fat32_file_system(time_t build_time, bool reproducible, bool verbose)
 {
-    volume_buffer = calloc(TOTAL_SECTORS * BYTES_PER_SECTOR, 1);
-    if (NULL == volume_buffer)
+    FAT32_VOLUME *volume = calloc(1, sizeof(*volume));
+    if (NULL == volume)
     {
-        perror("Error allocating volume buffer");
+        perror("Error allocating volume");
         exit(1);
     }
 
-    volume_sector_buffer = (SECTOR *)volume_buffer;
+    volume->Reproducible = reproducible;
+    volume->Verbose = verbose;
+    _get_time_and_date(volume, build_time, &volume->BuildTime, &volume->BuildDate);
+    _set_cluster_size(volume, DEFAULT_SECTORS_PER_CLUSTER);
+
+    return volume;
+}
+
+void free_fat32_file_system(FAT32_VOLUME *volume)
+{
+    if (NULL != volume->RootDirectory)
+    {
+        _free_directory_index(volume->RootDirectory);
+    }
+
+    for (uint32_t i = 0; i < volume->DirectoryClusterCount; ++i)
+    {
+        free(volume->DirectoryClusters[i].Contents);
+    }
+
+    free(volume->DirectoryClusters);
+    free(volume->FileExtents);
+    free(volume->ClusterBitmap);
+    free(volume->LoadedFATs);
+    free(volume->MetadataBuffer);
+    free(volume);
+}
+
+// Weighs the bytes the input takes in the data area against the bytes of both FATs: larger clusters waste more slack per file
+// but give a shorter FAT, shorter chains and fewer allocations. A size is only a candidate if FAT32 can still format the volume.
+uint32_t select_fat32_cluster_size(FAT32_VOLUME *volume, const INPUT_NODE *root, uint32_t cluster_size, uint64_t volume_sectors)
+{
+    if (0 != cluster_size)
+    {
+        _set_cluster_size(volume, cluster_size / BYTES_PER_SECTOR);
+        return volume->ClusterSize;
+    }
+
+    uint32_t best_sectors = DEFAULT_SECTORS_PER_CLUSTER;
+    uint64_t best_cost = UINT64_MAX;
+    uint64_t best_count = 0;
+    for (uint32_t sectors = DEFAULT_SECTORS_PER_CLUSTER; sectors <= MAXIMUM_SECTORS_PER_CLUSTER; sectors *= 2)
+    {
+        _set_cluster_size(volume, sectors);
+        uint64_t cluster_count = _count_directory_clusters(volume, root, true);
+        uint64_t fat_entries = cluster_count;
+
+        if (0 != volume_sectors)
+        {
+            if (volume_sectors > UINT32_MAX || _get_cluster_count(volume, volume_sectors) < MINIMUM_CLUSTER_COUNT)
+            {
+                break;
+            }
+            fat_entries = _get_cluster_count(volume, volume_sectors);
+            if (cluster_count > fat_entries)
+            {
+                continue;
+            }
+        }
+        // A volume sized to the input would be padded up to the FAT32 minimum cluster count.
+        else if (cluster_count < MINIMUM_CLUSTER_COUNT && DEFAULT_SECTORS_PER_CLUSTER != sectors)
+        {
+            break;
+        }
+
+        uint64_t cost = cluster_count * volume->ClusterSize + fat_entries * sizeof(uint32_t) * NUMBER_OF_FATS;
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best_sectors = sectors;
+            best_count = cluster_count;
+        }
+    }
+
+    // Smaller clusters are the fallback for a fixed volume that can not hold the minimum cluster count of 4 KiB ones, or that
+    // the input does not fit in, and for an input so small that its volume would be padded. Halving the clusters halves the padding.
+    // A fixed volume that is too small for every size keeps the smallest, so its minimum size is the real one.
+    bool fallback = 0 != volume_sectors ? UINT64_MAX == best_cost : best_count < MINIMUM_CLUSTER_COUNT;
+    for (uint32_t sectors = DEFAULT_SECTORS_PER_CLUSTER / 2; fallback && 0 != sectors; sectors /= 2)
+    {
+        _set_cluster_size(volume, sectors);
+        uint64_t cluster_count = _count_directory_clusters(volume, root, true);
+
+        if (0 == volume_sectors)
+        {
+            best_sectors = sectors;
+            fallback = cluster_count < MINIMUM_CLUSTER_COUNT;
+            continue;
+        }
+
+        uint64_t fat_entries = volume_sectors <= UINT32_MAX ? _get_cluster_count(volume, volume_sectors) : 0;
+        if (fat_entries < MINIMUM_CLUSTER_COUNT)
+        {
+            best_sectors = sectors;
+        }
+        else if (cluster_count <= fat_entries)
+        {
+            best_sectors = sectors;
+            fallback = false;
+        }
+    }
+
+    _set_cluster_size(volume, best_sectors);
+    return volume->ClusterSize;
 }
 
-void format_fat32_file_system(void)
+uint64_t count_fat32_clusters(FAT32_VOLUME *volume, const INPUT_NODE *root)
 {
+    return _count_directory_clusters(volume, root, true);
+}
+
+uint64_t calculate_fat32_volume_sectors(FAT32_VOLUME *volume, uint64_t cluster_count)
+{
+    if (cluster_count < MINIMUM_CLUSTER_COUNT)
+    {
+        cluster_count = MINIMUM_CLUSTER_COUNT;
+    }
+    if (cluster_count > MAXIMUM_CLUSTER_COUNT)
+    {
+        return 0;
+    }
+
+    // Start from the exact FAT size and grow, the FAT size formula used by format rounds up.
+    uint64_t fat_size = ((cluster_count + 2) * sizeof(uint32_t) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+    uint64_t total_sectors = RESERVED_SECTORS_COUNT + NUMBER_OF_FATS * fat_size + cluster_count * volume->SectorsPerCluster;
+
+    while (total_sectors <= UINT32_MAX && _get_cluster_count(volume, total_sectors) < cluster_count)
+    {
+        total_sectors += volume->SectorsPerCluster;
+    }
+
+    return total_sectors <= UINT32_MAX ? total_sectors : 0;
+}
+
+void format_fat32_file_system(FAT32_VOLUME *volume, uint32_t total_sectors)
+{
+    volume->TotalSectors = total_sectors;
+
     BIOS_PARAMETER_BLOCK BiosParamterBlock = {
         .JumpBoot = {0xEB, 0x00, 0x90},
         .OEMName = "MSWIN4.1",
         .BytesPerSector = BYTES_PER_SECTOR,
-        .SectorsPerCluster = SECTORS_PER_CLUSTER,
-        .ReservedSectorsCount = 32,
-        .NumberFATs = 2,
+        .SectorsPerCluster = volume->SectorsPerCluster,
+        .ReservedSectorsCount = RESERVED_SECTORS_COUNT,
+        .NumberFATs = NUMBER_OF_FATS,
         .RootEntryCount = 0,
         .TotalSectors16 = 0,
         .Media = 0xF0,
@@ -154,7 +550,7 @@ void format_fat32_file_system(void)
         .SectorsPerTrack = 0,
         .NumberOfHeads = 0,
         .HidenSectorsCount = FIRST_USABLE_SECTOR,
-        .TotalSectors32 = TOTAL_SECTORS,
+        .TotalSectors32 = total_sectors,
         .FATSize32 = 0,
         .Flags = 0,
         .FSVersion = 0x0000,
@@ -172,254 +568,2159 @@ void format_fat32_file_system(void)
         .BootSignature = 0xAA55,
     };
 
-    uint32_t DiskSizeInSectors = 16777216; // Disks up to 8GB with 4k clusters
-    uint32_t TempVal1 = DiskSizeInSectors - BiosParamterBlock.ReservedSectorsCount;
-    uint32_t TempVal2 = (256 * BiosParamterBlock.SectorsPerCluster + BiosParamterBlock.NumberFATs) / 2;
-    BiosParamterBlock.FATSize32 = (TempVal1 + TempVal2 - 1) / TempVal2; // 8 MiB of FATs => 2 * 1024 * 1024 of addressable clusters.
+    BiosParamterBlock.FATSize32 = _get_fat_size(volume, total_sectors);
+    volume->ClusterCount = _get_cluster_count(volume, total_sectors);
 
-    uint32_t DataSectors = BiosParamterBlock.TotalSectors32 - BiosParamterBlock.ReservedSectorsCount - BiosParamterBlock.FATSize32 * BiosParamterBlock.NumberFATs;
-    uint32_t ClusterCount = DataSectors / SECTORS_PER_CLUSTER;
+    volume->FATSize = BiosParamterBlock.FATSize32;
+    volume->FirstDataSector = BiosParamterBlock.ReservedSectorsCount + BiosParamterBlock.FATSize32 * BiosParamterBlock.NumberFATs;
+
+    volume->MetadataBuffer = calloc(volume->FirstDataSector, BYTES_PER_SECTOR);
+    if (NULL == volume->MetadataBuffer)
+    {
+        perror("Error allocating metadata buffer");
+        exit(1);
+    }
+
+    volume->MetadataSectors = (SECTOR *)volume->MetadataBuffer;
 
     FILE_SECTOR_INFO FileSectorInfo = {
         .LeadSignature = 0x41615252,
         .Reserved1 = {0},
         .StructureSignature = 0x61417272,
-        .FreeCount = ClusterCount - 1,
+        .FreeCount = volume->ClusterCount - 1,
         .NextFreeCluster = 3,
         .Reserved2 = {0},
         .TrailSignature = 0xAA550000,
     };
 
-    memcpy(volume_sector_buffer[0].sector_buffer, &BiosParamterBlock, sizeof(BiosParamterBlock));
-    memcpy(volume_sector_buffer[1].sector_buffer, &FileSectorInfo, sizeof(FileSectorInfo));
+    memcpy(volume->MetadataSectors[0].sector_buffer, &BiosParamterBlock, sizeof(BiosParamterBlock));
+    memcpy(volume->MetadataSectors[1].sector_buffer, &FileSectorInfo, sizeof(FileSectorInfo));
 
     BIOS_PARAMETER_BLOCK BackupBiosParamterBlock = BiosParamterBlock;
     FILE_SECTOR_INFO BackupFileSectorInfo = FileSectorInfo;
 
-    memcpy(volume_sector_buffer[BiosParamterBlock.BackupBootSector].sector_buffer, &BackupBiosParamterBlock, sizeof(BackupBiosParamterBlock));
-    memcpy(volume_sector_buffer[BiosParamterBlock.BackupBootSector + 1].sector_buffer, &BackupFileSectorInfo, sizeof(BackupFileSectorInfo));
-
-    FSInfo = (FILE_SECTOR_INFO *)(volume_sector_buffer + 1);
+    memcpy(volume->MetadataSectors[BiosParamterBlock.BackupBootSector].sector_buffer, &BackupBiosParamterBlock, sizeof(BackupBiosParamterBlock));
+    memcpy(volume->MetadataSectors[BiosParamterBlock.BackupBootSector + 1].sector_buffer, &BackupFileSectorInfo, sizeof(BackupFileSectorInfo));
 
-    FATs = (uint32_t *)(volume_sector_buffer + BiosParamterBlock.ReservedSectorsCount);
-    MirrorFATs = (uint32_t *)(volume_sector_buffer + BiosParamterBlock.ReservedSectorsCount + BiosParamterBlock.FATSize32);
+    volume->FSInfo = (FILE_SECTOR_INFO *)(volume->MetadataSectors + 1);
 
-    FATs[0] = 0x0FFFFFF0;
-    FATs[1] = 0x0FFFFFFF;
-    FATs[2] = 0x0FFFFFFF;
+    volume->FATs = (uint32_t *)(volume->MetadataSectors + BiosParamterBlock.ReservedSectorsCount);
+    volume->MirrorFATs = (uint32_t *)(volume->MetadataSectors + BiosParamterBlock.ReservedSectorsCount + BiosParamterBlock.FATSize32);
 
-    MirrorFATs[0] = 0x0FFFFFF0;
-    MirrorFATs[1] = 0x0FFFFFFF;
-    MirrorFATs[2] = 0x0FFFFFFF;
+    volume->FATs[0] = 0x0FFFFFF0;
+    volume->FATs[1] = 0x0FFFFFFF;
+    volume->FATs[2] = 0x0FFFFFFF;
 
-    FirstDataSector = BiosParamterBlock.ReservedSectorsCount + BiosParamterBlock.FATSize32 * BiosParamterBlock.NumberFATs;
-    data_cluster_buffer = (CLUSTER *)(volume_sector_buffer + FirstDataSector);
-}
+    volume->ClusterBitmap = calloc((volume->ClusterCount + 2 + 63) / 64, sizeof(uint64_t));
+    if (NULL == volume->ClusterBitmap)
+    {
+        perror("Error allocating cluster bitmap");
+        exit(1);
+    }
+    for (uint32_t cluster = 0; cluster <= BiosParamterBlock.RootCluster; ++cluster)
+    {
+        _set_cluster_used(volume, cluster, true);
+    }
+    volume->LoadedFATs = NULL;
 
-void copy_input_directory(const char *inputDirectoryPath)
-{
-    _copy_input_directory(inputDirectoryPath, 2);
+    volume->RootDirectory = _create_directory_index(BiosParamterBlock.RootCluster, _add_directory_cluster(volume, BiosParamterBlock.RootCluster));
 }
 
-void write_fat32_file_system(FILE *outputFile)
+void load_fat32_file_system(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset, uint64_t partition_sectors)
 {
-    fwrite(volume_buffer, BYTES_PER_SECTOR, TOTAL_SECTORS, outputFile);
-}
+    BIOS_PARAMETER_BLOCK BiosParamterBlock;
+    read_output_region(output, offset, &BiosParamterBlock, sizeof(BiosParamterBlock));
 
-static void _copy_input_directory(const char *inputDirectoryPath, uint32_t parent_directory_cluster)
-{
-    DIR *inputDirectory = opendir(inputDirectoryPath);
-    if (NULL == inputDirectory) {
-        fprintf(stderr, "Can not open directory %s", inputDirectoryPath);
+    // The cluster size is taken from the volume, the reserved area is a compile time constant so it has to match.
+    uint8_t sectors_per_cluster = BiosParamterBlock.SectorsPerCluster;
+    if (0 == sectors_per_cluster || 0 != (sectors_per_cluster & (sectors_per_cluster - 1)))
+    {
+        fprintf(stderr, "The output image does not hold a FAT32 volume created by this tool\n");
         exit(1);
     }
-    struct dirent *directory_entry = NULL;
+    _set_cluster_size(volume, sectors_per_cluster);
 
-    while (NULL != (directory_entry = readdir(inputDirectory)))
+    if (BYTES_PER_SECTOR != BiosParamterBlock.BytesPerSector ||
+        RESERVED_SECTORS_COUNT != BiosParamterBlock.ReservedSectorsCount || NUMBER_OF_FATS != BiosParamterBlock.NumberFATs ||
+        0 != BiosParamterBlock.FATSize16 || 2 != BiosParamterBlock.RootCluster || 0xAA55 != BiosParamterBlock.BootSignature ||
+        0 != memcmp(BiosParamterBlock.FileSystemType, "FAT32   ", sizeof(BiosParamterBlock.FileSystemType)) ||
+        BiosParamterBlock.TotalSectors32 > partition_sectors ||
+        BiosParamterBlock.FATSize32 != _get_fat_size(volume, BiosParamterBlock.TotalSectors32))
     {
-        if (0 != strcmp(directory_entry->d_name, ".") && 0 != strcmp(directory_entry->d_name, ".."))
-        {
-            char newPath[1024] = {0};
-            char entryName[1024] = {0};
-            uint32_t cluster_number;
-            _append_path(inputDirectoryPath, directory_entry->d_name, newPath);
-            _format_name(directory_entry->d_name, entryName);
+        fprintf(stderr, "The output image does not hold a FAT32 volume created by this tool\n");
+        exit(1);
+    }
 
-            printf("Adding entry: %s\n", newPath);
+    volume->TotalSectors = BiosParamterBlock.TotalSectors32;
+    volume->FATSize = BiosParamterBlock.FATSize32;
+    volume->FirstDataSector = RESERVED_SECTORS_COUNT + volume->FATSize * NUMBER_OF_FATS;
+    volume->ClusterCount = _get_cluster_count(volume, volume->TotalSectors);
 
-            if (DT_DIRECTORY == directory_entry->d_type)
-            {
-                cluster_number = _make_entry(entryName, parent_directory_cluster, parent_directory_cluster, true, 0);
-                _copy_input_directory(newPath, cluster_number);
-            }
-            else if (DT_REGULAR_FILE == directory_entry->d_type)
-            {
-                FILE *inputFile = fopen(newPath, "rb");
-                fseek(inputFile, 0L, SEEK_END);
-                uint32_t file_size = ftell(inputFile);
-                fseek(inputFile, 0L, SEEK_SET);
+    volume->MetadataBuffer = malloc((size_t)volume->FirstDataSector * BYTES_PER_SECTOR);
+    volume->LoadedFATs = malloc((size_t)volume->FATSize * BYTES_PER_SECTOR);
+    volume->ClusterBitmap = calloc((volume->ClusterCount + 2 + 63) / 64, sizeof(uint64_t));
+    if (NULL == volume->MetadataBuffer || NULL == volume->LoadedFATs || NULL == volume->ClusterBitmap)
+    {
+        perror("Error allocating metadata buffer");
+        exit(1);
+    }
+    read_output_region(output, offset, volume->MetadataBuffer, (uint64_t)volume->FirstDataSector * BYTES_PER_SECTOR);
 
-                cluster_number = _make_entry(entryName, parent_directory_cluster, parent_directory_cluster, false, file_size);
-                _copy_file_contents(inputFile, cluster_number);
-            }
-            else
-            {
-                fprintf(stderr, "Skipped file: %s file type unkown", newPath);
-            }
-        }
+    volume->MetadataSectors = (SECTOR *)volume->MetadataBuffer;
+    volume->FSInfo = (FILE_SECTOR_INFO *)(volume->MetadataSectors + 1);
+    volume->FATs = (uint32_t *)(volume->MetadataSectors + RESERVED_SECTORS_COUNT);
+    volume->MirrorFATs = (uint32_t *)(volume->MetadataSectors + RESERVED_SECTORS_COUNT + volume->FATSize);
+    memcpy(volume->LoadedFATs, volume->FATs, (size_t)volume->FATSize * BYTES_PER_SECTOR);
+
+    // The FAT is the authority on what is in use, FSInfo is only a hint and is rebuilt from it.
+    uint32_t free_count = 0;
+    _set_cluster_used(volume, 0, true);
+    _set_cluster_used(volume, 1, true);
+    for (uint32_t cluster = 2; cluster < volume->ClusterCount + 2; ++cluster)
+    {
+        bool used = 0 != (volume->FATs[cluster] & 0x0FFFFFFF);
+        _set_cluster_used(volume, cluster, used);
+        free_count += !used;
+    }
+    volume->FSInfo->FreeCount = free_count;
+    if (volume->FSInfo->NextFreeCluster < 2 || volume->FSInfo->NextFreeCluster >= volume->ClusterCount + 2)
+    {
+        volume->FSInfo->NextFreeCluster = 2;
     }
 
-    closedir(inputDirectory);
+    volume->LoadedOutput = output;
+    volume->LoadedDataOffset = offset + (uint64_t)volume->FirstDataSector * BYTES_PER_SECTOR;
+    volume->RootDirectory = _load_directory(volume, output, volume->LoadedDataOffset, BiosParamterBlock.RootCluster);
+}
+
+// Entries that go away or changed are freed before anything is allocated, so their clusters can take the new data.
+void copy_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *root)
+{
+    _keep_input_tree(volume, root, volume->RootDirectory);
+    _remove_stale_entries(volume, volume->RootDirectory, "/");
+    _copy_input_tree(volume, root, volume->RootDirectory);
+
+    _free_directory_index(volume->RootDirectory);
+    volume->RootDirectory = NULL;
 }
 
-// Returns the cluster number for the entry that was created/found
-static uint32_t _make_entry(const char *directory_name, uint32_t first_cluster, uint32_t parent_directory_cluster, bool is_directory, uint32_t file_size)
+void write_fat32_file_system(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset, uint32_t jobs)
 {
-    DIRECTORY_ENTRY *DirectoryEntries = (DIRECTORY_ENTRY *)(data_cluster_buffer + first_cluster - 2);
+    uint64_t data_offset = offset + (uint64_t)volume->FirstDataSector * BYTES_PER_SECTOR;
+
+    start_stats_phase(STATS_PHASE_METADATA);
+    memcpy(volume->MirrorFATs, volume->FATs, (size_t)volume->FATSize * BYTES_PER_SECTOR);
 
-    for (uint32_t i = 0; i < NUMBER_OF_ENTRIES_IN_A_CLUSTERS; ++i)
+    // An updated volume only gets back the sectors and clusters that changed, everything else on disk is still valid.
+    if (NULL != volume->LoadedFATs)
     {
-        if (DirectoryEntries[i].Name[0] == 0x00)
-        {
-            // The directory was not found
-            // Creating new directory
-            uint32_t cluster_number = _get_next_free_cluster();
-            FATs[cluster_number] = 0x0FFFFFFF;
-            MirrorFATs[cluster_number] = 0x0FFFFFFF;
+        write_output_region(output, offset, volume->MetadataBuffer, RESERVED_SECTORS_COUNT * BYTES_PER_SECTOR);
+        _write_changed_fat_sectors(volume, output, offset);
+    }
+    else
+    {
+        write_output_region(output, offset, volume->MetadataBuffer, data_offset - offset);
+    }
 
-            _create_directory_entry(&DirectoryEntries[i], directory_name, is_directory, file_size, cluster_number);
-            if (is_directory) {
-                _create_default_directory_entries(cluster_number, parent_directory_cluster);
-            }
-            return cluster_number;
+    for (uint32_t i = 0; i < volume->DirectoryClusterCount && !output->Streaming; ++i)
+    {
+        if (NULL != volume->LoadedFATs && !volume->DirectoryClusters[i].Dirty)
+        {
+            continue;
         }
 
-        if (0 == memcmp(DirectoryEntries[i].Name, directory_name, sizeof(DirectoryEntries[i].Name)))
-        {
-            uint32_t cluster = DirectoryEntries[i].FirstClusterHigh;
-            cluster = cluster << 16;
-            cluster = cluster | DirectoryEntries[i].FirstClusterLow;
+        uint64_t cluster_offset = data_offset + (uint64_t)(volume->DirectoryClusters[i].ClusterNumber - 2) * volume->ClusterSize;
+        write_output_region(output, cluster_offset, volume->DirectoryClusters[i].Contents, volume->ClusterSize);
+    }
 
-            return cluster;
-        }
+    stop_stats_phase(STATS_PHASE_METADATA);
+
+    start_stats_phase(STATS_PHASE_FILE_DATA);
+    if (output->Streaming)
+    {
+        _stream_volume_data(volume, output, data_offset, jobs);
+    }
+    else
+    {
+        _write_file_data(volume, output, data_offset, jobs);
     }
+    stop_stats_phase(STATS_PHASE_FILE_DATA);
 
-    // If this point was reached without return, check if there is a linked cluster if not alocate one and go to that cluster.
-    if (FATs[first_cluster] == 0x0FFFFFFF)
+    if (NULL != volume->LoadedFATs)
     {
-        FATs[first_cluster] = _get_next_free_cluster();
-        MirrorFATs[first_cluster] = FATs[first_cluster];
-        FATs[FATs[first_cluster]] = 0x0FFFFFFF;
-        MirrorFATs[FATs[first_cluster]] = 0x0FFFFFFF;
+        return;
     }
 
-    return _make_entry(directory_name, FATs[first_cluster], parent_directory_cluster, is_directory, file_size);
+    // On a new volume clusters are handed out in ascending order, so everything past NextFreeCluster is unallocated.
+    uint64_t used_bytes = (volume->FirstDataSector + (uint64_t)(volume->FSInfo->NextFreeCluster - 2) * volume->SectorsPerCluster) * BYTES_PER_SECTOR;
+    start_stats_phase(STATS_PHASE_ZERO_FILL);
+    skip_output_region(output, offset + used_bytes, (uint64_t)volume->TotalSectors * BYTES_PER_SECTOR - used_bytes);
+    stop_stats_phase(STATS_PHASE_ZERO_FILL);
 }
 
-static void _copy_file_contents(FILE *inputFile, uint32_t first_cluster)
+// Problems in the boot sector end the check early, everything past it is checked completely.
+uint64_t verify_fat32_file_system(const uint8_t *partition, uint64_t partition_sectors, const INPUT_NODE *root, uint32_t jobs)
 {
-    FATs[first_cluster] = 0x0FFFFFFF;
-    MirrorFATs[first_cluster] = 0x0FFFFFFF;
+    const BIOS_PARAMETER_BLOCK *BiosParamterBlock = (const BIOS_PARAMETER_BLOCK *)partition;
+    uint8_t sectors_per_cluster = BiosParamterBlock->SectorsPerCluster;
+    uint64_t first_data_sector = BiosParamterBlock->ReservedSectorsCount + (uint64_t)BiosParamterBlock->FATSize32 * BiosParamterBlock->NumberFATs;
 
-    if (fread(data_cluster_buffer + first_cluster - 2, 1, sizeof(*data_cluster_buffer), inputFile) == 4096)
+    if (BYTES_PER_SECTOR != BiosParamterBlock->BytesPerSector || 0 == sectors_per_cluster || 0 != (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+        NUMBER_OF_FATS != BiosParamterBlock->NumberFATs || 0 != BiosParamterBlock->FATSize16 || 0 != BiosParamterBlock->TotalSectors16 ||
+        0xAA55 != BiosParamterBlock->BootSignature || BiosParamterBlock->TotalSectors32 > partition_sectors ||
+        first_data_sector >= BiosParamterBlock->TotalSectors32 || BiosParamterBlock->FSInfo >= BiosParamterBlock->ReservedSectorsCount ||
+        BiosParamterBlock->BackupBootSector >= BiosParamterBlock->ReservedSectorsCount)
     {
-        uint32_t next_cluster = _get_next_free_cluster();
+        fprintf(stderr, "The partition does not hold a FAT32 volume\n");
+        return 1;
+    }
 
-        FATs[first_cluster] = next_cluster;
-        MirrorFATs[first_cluster] = next_cluster;
+    uint32_t cluster_count = (BiosParamterBlock->TotalSectors32 - first_data_sector) / sectors_per_cluster;
+    if (cluster_count < MINIMUM_CLUSTER_COUNT || cluster_count > MAXIMUM_CLUSTER_COUNT ||
+        (uint64_t)BiosParamterBlock->FATSize32 * BYTES_PER_SECTOR / sizeof(uint32_t) < cluster_count + 2ULL ||
+        BiosParamterBlock->RootCluster < 2 || BiosParamterBlock->RootCluster >= cluster_count + 2)
+    {
+        fprintf(stderr, "The FAT32 volume has an invalid geometry\n");
+        return 1;
+    }
 
-        _copy_file_contents(inputFile, next_cluster);
+    const uint32_t *fats = (const uint32_t *)(partition + (uint64_t)BiosParamterBlock->ReservedSectorsCount * BYTES_PER_SECTOR);
+    VOLUME_VERIFIER verifier = {
+        .Data = partition + first_data_sector * BYTES_PER_SECTOR,
+        .FATs = fats,
+        .MirrorFATs = fats + (uint64_t)BiosParamterBlock->FATSize32 * BYTES_PER_SECTOR / sizeof(uint32_t),
+        .FATEntryCount = BiosParamterBlock->FATSize32 * (BYTES_PER_SECTOR / sizeof(uint32_t)),
+        .ClusterCount = cluster_count,
+        .ClusterSize = sectors_per_cluster * BYTES_PER_SECTOR,
+        .RootCluster = BiosParamterBlock->RootCluster,
+        .CompareInput = NULL != root,
+        .Owners = calloc(cluster_count + 2, sizeof(atomic_uint)),
+    };
+    if (NULL == verifier.Owners)
+    {
+        perror("Error allocating cluster owners");
+        exit(1);
     }
-}
+    atomic_init(&verifier.NextOwner, 1);
+    atomic_init(&verifier.ProblemCount, 0);
+    atomic_init(&verifier.NextRange, 0);
+    atomic_init(&verifier.FreeCount, 0);
+    atomic_init(&verifier.LostCount, 0);
+    atomic_init(&verifier.MirrorDifferences, 0);
+    pthread_mutex_init(&verifier.Lock, NULL);
+    pthread_cond_init(&verifier.Changed, NULL);
 
-static uint32_t _create_directory_entry(DIRECTORY_ENTRY *directory_entry, const char *name, bool is_directory, uint32_t file_size, uint32_t cluster_number)
-{
-    uint16_t directory_time = 0;
-    uint16_t directory_date = 0;
-    _get_time_and_date(&directory_time, &directory_date);
+    if (0 != memcmp(partition, partition + (uint64_t)BiosParamterBlock->BackupBootSector * BYTES_PER_SECTOR, BYTES_PER_SECTOR))
+    {
+        _report_verify_problem(&verifier, "The backup boot sector differs from the boot sector");
+    }
 
-    memcpy(directory_entry->Name, name, sizeof(directory_entry->Name));
-    directory_entry->Attribute = 0;
-    if (is_directory)
+    const FILE_SECTOR_INFO *FSInfo = (const FILE_SECTOR_INFO *)(partition + (uint64_t)BiosParamterBlock->FSInfo * BYTES_PER_SECTOR);
+    if (0x41615252 != FSInfo->LeadSignature || 0x61417272 != FSInfo->StructureSignature || 0xAA550000 != FSInfo->TrailSignature)
     {
-        directory_entry->Attribute |= ATTRIBUTE_DIRECTORY;
+        _report_verify_problem(&verifier, "The FSInfo sector has invalid signatures");
+    }
+    if ((fats[0] & 0x0FFFFFFF) != (0x0FFFFF00 | BiosParamterBlock->Media))
+    {
+        _report_verify_problem(&verifier, "The first FAT entry does not hold the media type");
     }
-    directory_entry->NTReserved = 0;
-    directory_entry->CreationTimeTenth = 0;
-    directory_entry->CreationTime = directory_time;
-    directory_entry->CreationDate = directory_date;
-    directory_entry->LastAccessDate = directory_date;
-    directory_entry->FirstClusterHigh = (cluster_number >> 16) & 0xFFFF;
-    directory_entry->WriteDate = directory_time;
-    directory_entry->WriteDate = directory_date;
-    directory_entry->FirstClusterLow = cluster_number & 0xFFFF;
-    directory_entry->FileSize = file_size;
 
-    return cluster_number;
-}
+    VERIFY_TASK root_task = {
+        .Type = VERIFY_TASK_DIRECTORY,
+        .Path = strdup("/"),
+        .FirstCluster = verifier.RootCluster,
+        .Inputs = malloc(sizeof(*root_task.Inputs)),
+        .InputCount = NULL != root,
+    };
+    if (NULL == root_task.Path || NULL == root_task.Inputs)
+    {
+        perror("Error allocating verify tasks");
+        exit(1);
+    }
+    root_task.Inputs[0] = root;
+    _push_verify_tasks(&verifier, &root_task, 1);
+    _run_volume_verifiers(&verifier, jobs, _run_tree_verifier);
 
-static void _create_default_directory_entries(uint32_t cluster, uint32_t parent_directory_cluster)
-{
-    DIRECTORY_ENTRY *DirectoryEntries = (DIRECTORY_ENTRY *)(data_cluster_buffer + cluster - 2);
+    // Every chain is claimed by now, so the FAT pass can tell allocated clusters that no entry reaches.
+    _run_volume_verifiers(&verifier, jobs, _run_fat_verifier);
 
-    if (2 == parent_directory_cluster) {
-        parent_directory_cluster = 0;
+    uint64_t mirror_differences = atomic_load(&verifier.MirrorDifferences);
+    if (0 != mirror_differences)
+    {
+        _report_verify_problem(&verifier, "%llu entries of the mirror FAT differ from the FAT", (unsigned long long)mirror_differences);
+    }
+    uint64_t lost_count = atomic_load(&verifier.LostCount);
+    if (0 != lost_count)
+    {
+        _report_verify_problem(&verifier, "%llu clusters are allocated but belong to no entry", (unsigned long long)lost_count);
+    }
+
+    // Both FSInfo fields are hints, 0xFFFFFFFF means unknown. NextFreeCluster may point one past the last cluster of a full volume.
+    uint64_t free_count = atomic_load(&verifier.FreeCount);
+    if (0xFFFFFFFF != FSInfo->FreeCount && FSInfo->FreeCount != free_count)
+    {
+        _report_verify_problem(&verifier, "FSInfo counts %u free clusters, the FAT has %llu", FSInfo->FreeCount, (unsigned long long)free_count);
+    }
+    if (0xFFFFFFFF != FSInfo->NextFreeCluster && (FSInfo->NextFreeCluster < 2 || FSInfo->NextFreeCluster > cluster_count + 2))
+    {
+        _report_verify_problem(&verifier, "The FSInfo next free cluster %u is outside the volume", FSInfo->NextFreeCluster);
     }
 
-    _create_directory_entry(&DirectoryEntries[0], ".          ", true, 0, cluster);
-    _create_directory_entry(&DirectoryEntries[1], "..         ", true, 0, parent_directory_cluster);
+    pthread_cond_destroy(&verifier.Changed);
+    pthread_mutex_destroy(&verifier.Lock);
+    free(verifier.Tasks);
+    free(verifier.Owners);
+
+    return atomic_load(&verifier.ProblemCount);
 }
 
-// Since there is no remove file option this is always true.
-static uint32_t _get_next_free_cluster(void)
+// Marks the entries of a loaded volume that the input still has, releasing the ones whose contents changed.
+static void _keep_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *inputDirectory, DIRECTORY_INDEX *directory)
 {
-    FSInfo->FreeCount--;
-    FSInfo->NextFreeCluster++;
+    for (uint32_t i = 0; i < inputDirectory->ChildCount && 0 != directory->RecordCount; ++i)
+    {
+        const INPUT_NODE *child = &inputDirectory->Children[i];
+        char entryName[1024] = {0};
+        _format_name(child->Name, entryName);
+
+        if (!child->IsDirectory && child->Size > UINT32_MAX)
+        {
+            continue;
+        }
 
-    return FSInfo->NextFreeCluster - 1;
+        DIRECTORY_RECORD *record = _find_directory_record(directory, entryName);
+        if (NULL == record)
+        {
+            continue;
+        }
+
+        if (child->IsDirectory && record->IsDirectory && NULL != record->Subdirectory)
+        {
+            record->Kept = true;
+            _keep_input_tree(volume, child, record->Subdirectory);
+        }
+        else if (!record->Kept)
+        {
+            record->Kept = true;
+            if (!_is_entry_current(volume, record, child))
+            {
+                _release_entry(volume, record);
+                record->Released = true;
+            }
+        }
+    }
 }
 
-static void _get_time_and_date(uint16_t *outputTime, uint16_t *outputDate)
+static void _copy_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *inputDirectory, DIRECTORY_INDEX *directory)
 {
-    time_t current_timestamp = time(NULL);
-    struct tm tm = *localtime(&current_timestamp);
+    for (uint32_t i = 0; i < inputDirectory->ChildCount; ++i)
+    {
+        const INPUT_NODE *child = &inputDirectory->Children[i];
+        char entryName[1024] = {0};
+        DIRECTORY_INDEX *subdirectory = NULL;
+        _format_name(child->Name, entryName);
 
-    *outputDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+        if (!child->IsDirectory && child->Size > UINT32_MAX)
+        {
+            fprintf(stderr, "Skipped file: %s is too large for FAT32\n", child->Path);
+            continue;
+        }
 
-    if (tm.tm_sec == 60)
-    {
-        tm.tm_sec = 59;
-    }
+        DIRECTORY_RECORD *record = _find_directory_record(directory, entryName);
+        if (NULL == record)
+        {
+            if (volume->Verbose)
+            {
+                printf("Adding entry: %s\n", child->Path);
+            }
+            subdirectory = _make_entry(volume, directory, entryName, child);
+        }
+        else if (record->Claimed)
+        {
+            // Another input entry already has this short name, only directories can be merged.
+            if (!child->IsDirectory)
+            {
+                fprintf(stderr, "Skipped file: %s name already used\n", child->Path);
+                continue;
+            }
+            if (!record->IsDirectory)
+            {
+                fprintf(stderr, "Skipped directory: %s name already used by a file\n", child->Path);
+                continue;
+            }
+            subdirectory = record->Subdirectory;
+        }
+        else if (record->Released)
+        {
+            if (volume->Verbose)
+            {
+                printf("Updating entry: %s\n", child->Path);
+            }
+            subdirectory = _refill_entry(volume, directory, record, child);
+        }
+        else
+        {
+            record->Claimed = true;
+            subdirectory = record->Subdirectory;
+        }
 
-    *outputTime = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
+        if (child->IsDirectory)
+        {
+            _copy_input_tree(volume, child, subdirectory);
+        }
+    }
 }
 
-static void _append_path(const char *currentPath, const char *currentDirectoryName, char *output)
+// Files are compared by size and modification time, FAT keeps the time with a two second resolution. Reproducible volumes compare contents.
+static bool _is_entry_current(FAT32_VOLUME *volume, const DIRECTORY_RECORD *record, const INPUT_NODE *input)
 {
-    strcpy(output, currentPath);
-    strcat(output, "/");
-    strcat(output, currentDirectoryName);
+    if (record->IsDirectory != input->IsDirectory)
+    {
+        return false;
+    }
+    if (input->IsDirectory)
+    {
+        return true;
+    }
+    if (record->Entry->FileSize != input->Size)
+    {
+        return false;
+    }
+    // Reproducible entries carry the build time instead of the modification time, so only the contents tell a change apart.
+    if (volume->Reproducible)
+    {
+        return _is_file_unchanged(volume, record->FirstCluster, input);
+    }
+
+    uint16_t write_time = 0;
+    uint16_t write_date = 0;
+    _get_time_and_date(volume, input->ModificationTime, &write_time, &write_date);
+
+    return record->Entry->WriteTime == write_time && record->Entry->WriteDate == write_date;
 }
-static void _format_name(const char *entryName, char *output)
+
+// Reads the chain from the loaded image a run of consecutive clusters at a time and compares it with the input.
+static bool _is_file_unchanged(FAT32_VOLUME *volume, uint32_t first_cluster, const INPUT_NODE *input)
 {
-    for (uint8_t i = 0; i <= 11; ++i)
+    if (0 == input->Size)
     {
-        output[i] = ' ';
+        return true;
     }
 
-    for (uint8_t i = 0; i < strlen(entryName); ++i)
+    uint8_t *image_data = malloc(COMPARE_BUFFER_SIZE);
+    uint8_t *input_data = malloc(COMPARE_BUFFER_SIZE);
+    if (NULL == image_data || NULL == input_data)
     {
-        if (entryName[i] == '.')
+        perror("Error allocating compare buffer");
+        exit(1);
+    }
+    int descriptor = open_input_file(input);
+
+    bool unchanged = true;
+    uint32_t cluster = first_cluster;
+    for (uint64_t done = 0; unchanged && done < input->Size; )
+    {
+        uint32_t run_start = cluster;
+        uint64_t length = 0;
+        bool contiguous = true;
+        while (contiguous && length < COMPARE_BUFFER_SIZE && done + length < input->Size)
         {
-            uint8_t offset = 11;
-            for (uint8_t j = strlen(entryName); j > i; j--)
+            // A chain that ends early or leaves the volume can not hold the input.
+            if (cluster < 2 || cluster >= volume->ClusterCount + 2)
             {
-                output[offset] = entryName[j];
-                offset--;
+                unchanged = false;
+                break;
             }
-
-            return;
+            uint32_t next = volume->FATs[cluster] & 0x0FFFFFFF;
+            contiguous = next == cluster + 1;
+            cluster = next;
+            length += volume->ClusterSize;
+        }
+        if (!unchanged)
+        {
+            break;
+        }
+
+        length = length < input->Size - done ? length : input->Size - done;
+        read_output_region(volume->LoadedOutput, volume->LoadedDataOffset + (uint64_t)(run_start - 2) * volume->ClusterSize, image_data, length);
+        unchanged = read_input_file(input, descriptor, done, input_data, length) == length && 0 == memcmp(image_data, input_data, length);
+        done += length;
+    }
+
+    close_input_file(input, descriptor);
+    free(input_data);
+    free(image_data);
+
+    return unchanged;
+}
+
+// Returns the index of the new directory, or NULL for a file.
+static DIRECTORY_INDEX *_make_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, const char *entry_name, const INPUT_NODE *input)
+{
+    DIRECTORY_ENTRY *directory_entry = _get_free_directory_entry(volume, directory);
+    uint32_t entry_cluster = directory->LastCluster;
+
+    DIRECTORY_INDEX *subdirectory = _fill_entry(volume, directory_entry, entry_name, input, directory->FirstCluster);
+    _add_directory_record(directory, directory_entry, entry_cluster, subdirectory);
+
+    return subdirectory;
+}
+
+// Reuses the slot of an entry released by _keep_input_tree().
+static DIRECTORY_INDEX *_refill_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, DIRECTORY_RECORD *record, const INPUT_NODE *input)
+{
+    _find_directory_cluster(volume, record->EntryCluster)->Dirty = true;
+
+    DIRECTORY_INDEX *subdirectory = _fill_entry(volume, record->Entry, record->Name, input, directory->FirstCluster);
+
+    record->IsDirectory = input->IsDirectory;
+    record->Released = false;
+    record->Claimed = true;
+    record->FirstCluster = (uint32_t)record->Entry->FirstClusterHigh << 16 | record->Entry->FirstClusterLow;
+    record->Subdirectory = subdirectory;
+
+    return subdirectory;
+}
+
+// A file gets all of its clusters up front, directories grow one cluster at a time as entries are added.
+static DIRECTORY_INDEX *_fill_entry(FAT32_VOLUME *volume, DIRECTORY_ENTRY *directory_entry, const char *entry_name, const INPUT_NODE *input, uint32_t parent_directory_cluster)
+{
+    if (!input->IsDirectory)
+    {
+        add_stats_counter(STATS_COUNTER_FILES, 1);
+        uint32_t first_cluster = _map_file_contents(volume, input);
+        _create_directory_entry(volume, directory_entry, entry_name, false, input->Size, first_cluster, input->ModificationTime);
+        return NULL;
+    }
+
+    add_stats_counter(STATS_COUNTER_DIRECTORIES, 1);
+    uint32_t run_length = 0;
+    uint32_t cluster_number = _allocate_clusters(volume, 1, &run_length);
+    _write_fat_chain(volume, cluster_number, 1);
+
+    _create_directory_entry(volume, directory_entry, entry_name, true, 0, cluster_number, 0);
+
+    DIRECTORY_INDEX *subdirectory = _create_directory_index(cluster_number, _add_directory_cluster(volume, cluster_number));
+    _create_default_directory_entries(volume, subdirectory, parent_directory_cluster);
+
+    return subdirectory;
+}
+
+// Entries of a loaded volume that are not in the input any more are deleted along with everything below them.
+// Entries of the image have no input path, path is the directory in the volume with short names.
+static void _remove_stale_entries(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, const char *path)
+{
+    for (uint32_t i = 0; i < directory->Capacity; ++i)
+    {
+        DIRECTORY_RECORD *record = &directory->Records[i];
+        if (0 == record->Name[0] || '.' == record->Name[0])
+        {
+            continue;
+        }
+
+        if (!record->Kept)
+        {
+            if (volume->Verbose)
+            {
+                char *entry_path = _make_short_path(path, record->Name);
+                printf("Removing entry: %s\n", entry_path);
+                free(entry_path);
+            }
+            _release_entry(volume, record);
+            record->Entry->Name[0] = (char)DELETED_ENTRY;
+            _find_directory_cluster(volume, record->EntryCluster)->Dirty = true;
+        }
+        else if (record->IsDirectory && NULL != record->Subdirectory)
+        {
+            char *subdirectory_path = _make_short_path(path, record->Name);
+            _remove_stale_entries(volume, record->Subdirectory, subdirectory_path);
+            free(subdirectory_path);
+        }
+    }
+}
+
+// Frees the clusters behind an entry, the entry itself is left for the caller to reuse or delete.
+static void _release_entry(FAT32_VOLUME *volume, DIRECTORY_RECORD *record)
+{
+    if (!record->IsDirectory)
+    {
+        _free_cluster_chain(volume, record->FirstCluster, false);
+        return;
+    }
+
+    DIRECTORY_INDEX *directory = record->Subdirectory;
+    for (uint32_t i = 0; i < directory->Capacity; ++i)
+    {
+        if (0 != directory->Records[i].Name[0] && '.' != directory->Records[i].Name[0])
+        {
+            _release_entry(volume, &directory->Records[i]);
+        }
+    }
+
+    _free_cluster_chain(volume, directory->FirstCluster, true);
+    _free_directory_index(directory);
+    record->Subdirectory = NULL;
+}
+
+// Reads a directory chain and everything below it into directory clusters and indexes.
+static DIRECTORY_INDEX *_load_directory(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t first_cluster)
+{
+    DIRECTORY_INDEX *directory = NULL;
+    uint32_t cluster = first_cluster;
+
+    for (uint32_t chain_length = 0; cluster >= 2 && cluster < volume->ClusterCount + 2; ++chain_length)
+    {
+        if (chain_length == volume->ClusterCount || NULL != _find_directory_cluster(volume, cluster))
+        {
+            fprintf(stderr, "Directory chain at cluster %u is corrupted\n", first_cluster);
+            exit(1);
+        }
+
+        uint8_t *contents = _add_directory_cluster(volume, cluster);
+        read_output_region(output, data_offset + (uint64_t)(cluster - 2) * volume->ClusterSize, contents, volume->ClusterSize);
+        _find_directory_cluster(volume, cluster)->Dirty = false;
+
+        if (NULL == directory)
+        {
+            directory = _create_directory_index(cluster, contents);
+        }
+        directory->LastCluster = cluster;
+        directory->LastEntries = (DIRECTORY_ENTRY *)contents;
+        directory->NextEntry = NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume);
+
+        for (uint32_t i = 0; i < NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume); ++i)
+        {
+            DIRECTORY_ENTRY *directory_entry = &directory->LastEntries[i];
+            if (0 == directory_entry->Name[0])
+            {
+                directory->NextEntry = i;
+                break;
+            }
+            if (DELETED_ENTRY == (uint8_t)directory_entry->Name[0] || ATTRIBUTE_LONG_NAME == (directory_entry->Attribute & ATTRIBUTE_LONG_NAME) ||
+                (directory_entry->Attribute & ATTRIBUTE_VOLUME_ID))
+            {
+                continue;
+            }
+
+            DIRECTORY_INDEX *subdirectory = NULL;
+            if ((directory_entry->Attribute & ATTRIBUTE_DIRECTORY) && '.' != directory_entry->Name[0])
+            {
+                uint32_t subdirectory_cluster = (uint32_t)directory_entry->FirstClusterHigh << 16 | directory_entry->FirstClusterLow;
+                subdirectory = _load_directory(volume, output, data_offset, subdirectory_cluster);
+            }
+            DIRECTORY_RECORD *record = _add_directory_record(directory, directory_entry, cluster, subdirectory);
+            record->Kept = false;
+            record->Claimed = false;
+        }
+
+        cluster = volume->FATs[cluster] & 0x0FFFFFFF;
+    }
+
+    if (NULL == directory)
+    {
+        fprintf(stderr, "Directory chain at cluster %u is corrupted\n", first_cluster);
+        exit(1);
+    }
+
+    return directory;
+}
+
+// Both FAT copies get the same runs of changed sectors.
+static void _write_changed_fat_sectors(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset)
+{
+    const SECTOR *fat_sectors = (const SECTOR *)volume->FATs;
+    const SECTOR *loaded_sectors = (const SECTOR *)volume->LoadedFATs;
+    uint32_t sector = 0;
+
+    while (sector < volume->FATSize)
+    {
+        if (0 == memcmp(&fat_sectors[sector], &loaded_sectors[sector], sizeof(SECTOR)))
+        {
+            sector++;
+            continue;
+        }
+
+        uint32_t run_end = sector + 1;
+        while (run_end < volume->FATSize && 0 != memcmp(&fat_sectors[run_end], &loaded_sectors[run_end], sizeof(SECTOR)))
+        {
+            run_end++;
+        }
+
+        for (uint32_t fat = 0; fat < NUMBER_OF_FATS; ++fat)
+        {
+            uint64_t fat_offset = offset + ((uint64_t)RESERVED_SECTORS_COUNT + (uint64_t)fat * volume->FATSize + sector) * BYTES_PER_SECTOR;
+            write_output_region(output, fat_offset, &fat_sectors[sector], (uint64_t)(run_end - sector) * BYTES_PER_SECTOR);
+        }
+        sector = run_end;
+    }
+}
+
+// Allocates the clusters of a file and records where its data goes, the data itself is only read by write_fat32_file_system().
+// Every free run the file is spread over becomes its own extent, on a new volume that is always a single run.
+static uint32_t _map_file_contents(FAT32_VOLUME *volume, const INPUT_NODE *inputFile)
+{
+    uint64_t remaining_clusters = _get_file_cluster_count(volume, inputFile->Size);
+    uint64_t source_offset = 0;
+    uint32_t first_cluster = 0;
+    uint32_t last_cluster = 0;
+
+    while (remaining_clusters > 0)
+    {
+        uint32_t run_length = 0;
+        uint32_t cluster = _allocate_clusters(volume, remaining_clusters, &run_length);
+        _write_fat_chain(volume, cluster, run_length);
+
+        if (0 == first_cluster)
+        {
+            first_cluster = cluster;
+        }
+        else
+        {
+            volume->FATs[last_cluster] = cluster;
+        }
+        last_cluster = cluster + run_length - 1;
+
+        if (volume->FileExtentCount == volume->FileExtentCapacity)
+        {
+            volume->FileExtentCapacity = volume->FileExtentCapacity ? volume->FileExtentCapacity * 2 : 64;
+            volume->FileExtents = realloc(volume->FileExtents, volume->FileExtentCapacity * sizeof(*volume->FileExtents));
+            if (NULL == volume->FileExtents)
+            {
+                perror("Error allocating file extents");
+                exit(1);
+            }
+        }
+
+        uint64_t run_size = (uint64_t)run_length * volume->ClusterSize;
+        FILE_EXTENT *extent = &volume->FileExtents[volume->FileExtentCount++];
+        extent->Source = inputFile;
+        extent->SourceOffset = source_offset;
+        extent->Size = inputFile->Size - source_offset < run_size ? inputFile->Size - source_offset : run_size;
+        extent->FirstCluster = cluster;
+        extent->ClusterCount = run_length;
+
+        source_offset += extent->Size;
+        remaining_clusters -= run_length;
+    }
+
+    return first_cluster;
+}
+
+// The whole layout is fixed before any data is read, so every chunk has a known destination and the chunks can be copied in any order.
+static void _write_file_data(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t jobs)
+{
+    uint32_t chunk_count = 0;
+    for (uint32_t i = 0; i < volume->FileExtentCount; ++i)
+    {
+        chunk_count += ((uint64_t)volume->FileExtents[i].ClusterCount * volume->ClusterSize + DATA_CHUNK_SIZE - 1) / (DATA_CHUNK_SIZE);
+    }
+
+    DATA_WRITER writer = {
+        .Volume = volume,
+        .Output = output,
+        .DataOffset = data_offset,
+        .Chunks = malloc((chunk_count ? chunk_count : 1) * sizeof(DATA_CHUNK)),
+        .ChunkCount = chunk_count,
+    };
+    if (NULL == writer.Chunks)
+    {
+        perror("Error allocating data chunks");
+        exit(1);
+    }
+    atomic_init(&writer.NextChunk, 0);
+
+    uint32_t chunk_index = 0;
+    for (uint32_t i = 0; i < volume->FileExtentCount; ++i)
+    {
+        uint64_t extent_size = (uint64_t)volume->FileExtents[i].ClusterCount * volume->ClusterSize;
+        for (uint64_t chunk_offset = 0; chunk_offset < extent_size; chunk_offset += DATA_CHUNK_SIZE)
+        {
+            writer.Chunks[chunk_index].Extent = &volume->FileExtents[i];
+            writer.Chunks[chunk_index].Offset = chunk_offset;
+            writer.Chunks[chunk_index].Size = extent_size - chunk_offset < DATA_CHUNK_SIZE ? extent_size - chunk_offset : DATA_CHUNK_SIZE;
+            chunk_index++;
+        }
+    }
+
+    if (jobs > chunk_count)
+    {
+        jobs = chunk_count ? chunk_count : 1;
+    }
+
+    // The calling thread is one of the writers.
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    if (NULL == threads)
+    {
+        perror("Error allocating data writers");
+        exit(1);
+    }
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        if (0 != pthread_create(&threads[i], NULL, _run_data_writer, &writer))
+        {
+            perror("Error creating data writer");
+            exit(1);
+        }
+    }
+
+    _run_data_writer(&writer);
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(writer.Chunks);
+}
+
+// A stream takes the data area strictly in cluster order, so directory clusters and file extents are merged by the calling thread.
+// jobs reader threads keep the next chunks in flight while the calling thread writes.
+static void _stream_volume_data(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, uint32_t jobs)
+{
+    // The calling thread never reads, so there is always at least one reader.
+    if (0 == jobs)
+    {
+        jobs = 1;
+    }
+
+    qsort(volume->FileExtents, volume->FileExtentCount, sizeof(*volume->FileExtents), _compare_file_extents);
+
+    uint32_t chunk_count = 0;
+    for (uint32_t i = 0; i < volume->FileExtentCount; ++i)
+    {
+        chunk_count += ((uint64_t)volume->FileExtents[i].ClusterCount * volume->ClusterSize + STREAM_CHUNK_SIZE - 1) / (STREAM_CHUNK_SIZE);
+    }
+
+    STREAM_PIPELINE pipeline = {
+        .Chunks = malloc((chunk_count ? chunk_count : 1) * sizeof(DATA_CHUNK)),
+        .ChunkCount = chunk_count,
+        .SlotCount = 2 * jobs + 2,
+    };
+    pipeline.Slots = calloc(pipeline.SlotCount, sizeof(STREAM_SLOT));
+    if (NULL == pipeline.Chunks || NULL == pipeline.Slots)
+    {
+        perror("Error allocating stream pipeline");
+        exit(1);
+    }
+
+    uint32_t chunk_index = 0;
+    for (uint32_t i = 0; i < volume->FileExtentCount; ++i)
+    {
+        uint64_t extent_size = (uint64_t)volume->FileExtents[i].ClusterCount * volume->ClusterSize;
+        for (uint64_t chunk_offset = 0; chunk_offset < extent_size; chunk_offset += STREAM_CHUNK_SIZE)
+        {
+            pipeline.Chunks[chunk_index].Extent = &volume->FileExtents[i];
+            pipeline.Chunks[chunk_index].Offset = chunk_offset;
+            pipeline.Chunks[chunk_index].Size = extent_size - chunk_offset < STREAM_CHUNK_SIZE ? extent_size - chunk_offset : STREAM_CHUNK_SIZE;
+            chunk_index++;
+        }
+    }
+
+    for (uint32_t i = 0; i < pipeline.SlotCount; ++i)
+    {
+        pipeline.Slots[i].Buffer = malloc(STREAM_CHUNK_SIZE);
+        if (NULL == pipeline.Slots[i].Buffer)
+        {
+            perror("Error allocating stream buffers");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_init(&pipeline.Lock, NULL);
+    pthread_cond_init(&pipeline.Changed, NULL);
+
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    if (NULL == threads)
+    {
+        perror("Error allocating stream readers");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        if (0 != pthread_create(&threads[i], NULL, _run_stream_reader, &pipeline))
+        {
+            perror("Error creating stream reader");
+            exit(1);
+        }
+    }
+
+    uint32_t directory_index = 0;
+    for (uint32_t i = 0; i <= chunk_count; ++i)
+    {
+        const DATA_CHUNK *chunk = i < chunk_count ? &pipeline.Chunks[i] : NULL;
+        uint32_t next_cluster = NULL != chunk ? chunk->Extent->FirstCluster : UINT32_MAX;
+        for (; directory_index < volume->DirectoryClusterCount && volume->DirectoryClusters[directory_index].ClusterNumber < next_cluster; ++directory_index)
+        {
+            uint64_t cluster_offset = data_offset + (uint64_t)(volume->DirectoryClusters[directory_index].ClusterNumber - 2) * volume->ClusterSize;
+            write_output_region(output, cluster_offset, volume->DirectoryClusters[directory_index].Contents, volume->ClusterSize);
+        }
+
+        if (NULL == chunk)
+        {
+            break;
+        }
+
+        STREAM_SLOT *slot = &pipeline.Slots[i % pipeline.SlotCount];
+        pthread_mutex_lock(&pipeline.Lock);
+        while (!slot->Ready)
+        {
+            pthread_cond_wait(&pipeline.Changed, &pipeline.Lock);
+        }
+        pthread_mutex_unlock(&pipeline.Lock);
+
+        uint64_t position = data_offset + (uint64_t)(chunk->Extent->FirstCluster - 2) * volume->ClusterSize + chunk->Offset;
+        write_output_region(output, position, slot->Buffer, slot->DataSize);
+        skip_output_region(output, position + slot->DataSize, chunk->Size - slot->DataSize);
+
+        pthread_mutex_lock(&pipeline.Lock);
+        slot->Ready = false;
+        pipeline.WrittenChunks++;
+        pthread_cond_broadcast(&pipeline.Changed);
+        pthread_mutex_unlock(&pipeline.Lock);
+    }
+
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < pipeline.SlotCount; ++i)
+    {
+        free(pipeline.Slots[i].Buffer);
+    }
+
+    pthread_cond_destroy(&pipeline.Changed);
+    pthread_mutex_destroy(&pipeline.Lock);
+    free(threads);
+    free(pipeline.Slots);
+    free(pipeline.Chunks);
+}
+
+static void *_run_stream_reader(void *argument)
+{
+    STREAM_PIPELINE *pipeline = argument;
+
+    pthread_mutex_lock(&pipeline->Lock);
+    while (pipeline->NextChunk < pipeline->ChunkCount)
+    {
+        uint32_t index = pipeline->NextChunk++;
+        while (index >= pipeline->WrittenChunks + pipeline->SlotCount)
+        {
+            pthread_cond_wait(&pipeline->Changed, &pipeline->Lock);
+        }
+        pthread_mutex_unlock(&pipeline->Lock);
+
+        STREAM_SLOT *slot = &pipeline->Slots[index % pipeline->SlotCount];
+        uint64_t data_size = _read_stream_chunk(&pipeline->Chunks[index], slot->Buffer);
+
+        pthread_mutex_lock(&pipeline->Lock);
+        slot->DataSize = data_size;
+        slot->Ready = true;
+        pthread_cond_broadcast(&pipeline->Changed);
+    }
+    pthread_mutex_unlock(&pipeline->Lock);
+
+    return NULL;
+}
+
+// Returns the number of bytes read, the rest of the chunk is slack or the file shrank.
+static uint64_t _read_stream_chunk(const DATA_CHUNK *chunk, uint8_t *buffer)
+{
+    const FILE_EXTENT *extent = chunk->Extent;
+    uint64_t data_size = 0;
+
+    if (extent->Size > chunk->Offset)
+    {
+        data_size = extent->Size - chunk->Offset < chunk->Size ? extent->Size - chunk->Offset : chunk->Size;
+    }
+
+    if (0 == data_size)
+    {
+        return 0;
+    }
+
+    int input_descriptor = open_input_file(extent->Source);
+    uint64_t copied = read_input_file(extent->Source, input_descriptor, extent->SourceOffset + chunk->Offset, buffer, data_size);
+    close_input_file(extent->Source, input_descriptor);
+
+    add_stats_counter(STATS_COUNTER_BYTES_READ, copied);
+    if (copied < data_size)
+    {
+        fprintf(stderr, "File %s shrank while building the image\n", extent->Source->Path);
+    }
+
+    return copied;
+}
+
+static int _compare_file_extents(const void *first, const void *second)
+{
+    uint32_t first_cluster = ((const FILE_EXTENT *)first)->FirstCluster;
+    uint32_t second_cluster = ((const FILE_EXTENT *)second)->FirstCluster;
+
+    return (first_cluster > second_cluster) - (first_cluster < second_cluster);
+}
+
+static void *_run_data_writer(void *argument)
+{
+    DATA_WRITER *writer = argument;
+    uint32_t index;
+
+    while ((index = atomic_fetch_add(&writer->NextChunk, 1)) < writer->ChunkCount)
+    {
+        _write_file_chunk(writer->Volume, writer->Output, writer->DataOffset, &writer->Chunks[index]);
+    }
+
+    return NULL;
+}
+
+static void _write_file_chunk(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t data_offset, const DATA_CHUNK *chunk)
+{
+    const FILE_EXTENT *extent = chunk->Extent;
+    uint64_t position = data_offset + (uint64_t)(extent->FirstCluster - 2) * volume->ClusterSize + chunk->Offset;
+    uint64_t data_size = 0;
+    uint64_t copied = 0;
+
+    if (extent->Size > chunk->Offset)
+    {
+        data_size = extent->Size - chunk->Offset < chunk->Size ? extent->Size - chunk->Offset : chunk->Size;
+    }
+
+    int input_descriptor = data_size > 0 ? open_input_file(extent->Source) : -1;
+    if (input_descriptor >= 0)
+    {
+        copied = copy_output_region(output, position, input_descriptor, extent->Source->SourceOffset + extent->SourceOffset + chunk->Offset, data_size);
+        close_input_file(extent->Source, input_descriptor);
+    }
+    else if (data_size > 0 && INPUT_SOURCE_MEMORY == extent->Source->Source)
+    {
+        copied = data_size;
+        write_output_region(output, position, (const uint8_t *)extent->Source->Buffer + extent->SourceOffset + chunk->Offset, data_size);
+    }
+    else if (data_size > 0)
+    {
+        copied = _write_callback_data(output, position, extent, chunk->Offset, data_size);
+    }
+
+    add_stats_counter(STATS_COUNTER_BYTES_READ, copied);
+    if (copied < data_size)
+    {
+        fprintf(stderr, "File %s shrank while building the image\n", extent->Source->Path);
+    }
+
+    // Only the file size is meaningful, the slack at the end of the last cluster reads back as zeros.
+    skip_output_region(output, position + copied, chunk->Size - copied);
+}
+
+// Callback files have no descriptor to copy from, their data goes through a bounce buffer.
+static uint64_t _write_callback_data(IMAGE_OUTPUT *output, uint64_t position, const FILE_EXTENT *extent, uint64_t offset, uint64_t size)
+{
+    uint64_t buffer_size = size < CALLBACK_BUFFER_SIZE ? size : CALLBACK_BUFFER_SIZE;
+    uint8_t *buffer = malloc(buffer_size);
+    if (NULL == buffer)
+    {
+        perror("Error allocating read buffer");
+        exit(1);
+    }
+
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        uint64_t request = size - copied < buffer_size ? size - copied : buffer_size;
+        uint64_t read = read_input_file(extent->Source, -1, extent->SourceOffset + offset + copied, buffer, request);
+        write_output_region(output, position + copied, buffer, read);
+        copied += read;
+        if (read < request)
+        {
+            break;
+        }
+    }
+
+    free(buffer);
+    return copied;
+}
+
+static DIRECTORY_INDEX *_create_directory_index(uint32_t first_cluster, uint8_t *contents)
+{
+    DIRECTORY_INDEX *directory = calloc(1, sizeof(*directory));
+    if (NULL == directory)
+    {
+        perror("Error allocating directory index");
+        exit(1);
+    }
+
+    directory->FirstCluster = first_cluster;
+    directory->LastCluster = first_cluster;
+    directory->LastEntries = (DIRECTORY_ENTRY *)contents;
+    directory->NextEntry = 0;
+
+    return directory;
+}
+
+static DIRECTORY_RECORD *_find_directory_record(DIRECTORY_INDEX *directory, const char *entry_name)
+{
+    if (0 == directory->RecordCount)
+    {
+        return NULL;
+    }
+
+    DIRECTORY_RECORD *record = _probe_directory_records(directory->Records, directory->Capacity, entry_name);
+
+    return 0 == record->Name[0] ? NULL : record;
+}
+
+// FNV-1a over the 8.3 name, the table size is a power of two and collisions are probed linearly.
+static DIRECTORY_RECORD *_probe_directory_records(DIRECTORY_RECORD *records, uint32_t capacity, const char *entry_name)
+{
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < sizeof(records->Name); ++i)
+    {
+        hash = (hash ^ (uint8_t)entry_name[i]) * 16777619u;
+    }
+
+    uint32_t slot = hash & (capacity - 1);
+    while (0 != records[slot].Name[0] && 0 != memcmp(records[slot].Name, entry_name, sizeof(records->Name)))
+    {
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return &records[slot];
+}
+
+static DIRECTORY_RECORD *_add_directory_record(DIRECTORY_INDEX *directory, DIRECTORY_ENTRY *directory_entry, uint32_t entry_cluster, DIRECTORY_INDEX *subdirectory)
+{
+    // Keep the table at most 3/4 full so probe sequences stay short.
+    if ((directory->RecordCount + 1) * 4 > directory->Capacity * 3)
+    {
+        uint32_t capacity = directory->Capacity ? directory->Capacity * 2 : 64;
+        DIRECTORY_RECORD *records = calloc(capacity, sizeof(*records));
+        if (NULL == records)
+        {
+            perror("Error allocating directory index");
+            exit(1);
+        }
+
+        for (uint32_t i = 0; i < directory->Capacity; ++i)
+        {
+            if (0 != directory->Records[i].Name[0])
+            {
+                *_probe_directory_records(records, capacity, directory->Records[i].Name) = directory->Records[i];
+            }
+        }
+
+        free(directory->Records);
+        directory->Records = records;
+        directory->Capacity = capacity;
+    }
+
+    DIRECTORY_RECORD *record = _probe_directory_records(directory->Records, directory->Capacity, directory_entry->Name);
+    memcpy(record->Name, directory_entry->Name, sizeof(record->Name));
+    record->IsDirectory = directory_entry->Attribute & ATTRIBUTE_DIRECTORY;
+    record->Kept = true;
+    record->Released = false;
+    record->Claimed = true;
+    record->FirstCluster = (uint32_t)directory_entry->FirstClusterHigh << 16 | directory_entry->FirstClusterLow;
+    record->EntryCluster = entry_cluster;
+    record->Entry = directory_entry;
+    record->Subdirectory = subdirectory;
+    directory->RecordCount++;
+
+    return record;
+}
+
+// New entries always go after the last used one, slots of deleted entries are not reused.
+static DIRECTORY_ENTRY *_get_free_directory_entry(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory)
+{
+    if (NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume) == directory->NextEntry)
+    {
+        uint32_t run_length = 0;
+        uint32_t cluster_number = _allocate_clusters(volume, 1, &run_length);
+        add_stats_counter(STATS_COUNTER_DIRECTORY_EXTENSIONS, 1);
+
+        volume->FATs[directory->LastCluster] = cluster_number;
+        volume->FATs[cluster_number] = 0x0FFFFFFF;
+
+        directory->LastCluster = cluster_number;
+        directory->LastEntries = (DIRECTORY_ENTRY *)_add_directory_cluster(volume, cluster_number);
+        directory->NextEntry = 0;
+    }
+    else
+    {
+        _find_directory_cluster(volume, directory->LastCluster)->Dirty = true;
+    }
+
+    return &directory->LastEntries[directory->NextEntry++];
+}
+
+static void _free_directory_index(DIRECTORY_INDEX *directory)
+{
+    for (uint32_t i = 0; i < directory->Capacity; ++i)
+    {
+        if (NULL != directory->Records[i].Subdirectory)
+        {
+            _free_directory_index(directory->Records[i].Subdirectory);
+        }
+    }
+
+    free(directory->Records);
+    free(directory);
+}
+
+// Files keep their modification time as write time so a later update can tell whether they changed, 0 stamps the build time.
+static uint32_t _create_directory_entry(FAT32_VOLUME *volume, DIRECTORY_ENTRY *directory_entry, const char *name, bool is_directory, uint32_t file_size, uint32_t cluster_number, time_t modification_time)
+{
+    uint16_t write_time = volume->BuildTime;
+    uint16_t write_date = volume->BuildDate;
+    if (!volume->Reproducible && 0 != modification_time)
+    {
+        _get_time_and_date(volume, modification_time, &write_time, &write_date);
+    }
+
+    memcpy(directory_entry->Name, name, sizeof(directory_entry->Name));
+    directory_entry->Attribute = 0;
+    if (is_directory)
+    {
+        directory_entry->Attribute |= ATTRIBUTE_DIRECTORY;
+    }
+    directory_entry->NTReserved = 0;
+    directory_entry->CreationTimeTenth = 0;
+    directory_entry->CreationTime = volume->BuildTime;
+    directory_entry->CreationDate = volume->BuildDate;
+    directory_entry->LastAccessDate = volume->BuildDate;
+    directory_entry->FirstClusterHigh = (cluster_number >> 16) & 0xFFFF;
+    directory_entry->WriteTime = write_time;
+    directory_entry->WriteDate = write_date;
+    directory_entry->FirstClusterLow = cluster_number & 0xFFFF;
+    directory_entry->FileSize = file_size;
+
+    return cluster_number;
+}
+
+static void _create_default_directory_entries(FAT32_VOLUME *volume, DIRECTORY_INDEX *directory, uint32_t parent_directory_cluster)
+{
+    if (2 == parent_directory_cluster) {
+        parent_directory_cluster = 0;
+    }
+
+    DIRECTORY_ENTRY *dot_entry = _get_free_directory_entry(volume, directory);
+    _create_directory_entry(volume, dot_entry, ".          ", true, 0, directory->FirstCluster, 0);
+    _add_directory_record(directory, dot_entry, directory->LastCluster, NULL);
+
+    DIRECTORY_ENTRY *dot_dot_entry = _get_free_directory_entry(volume, directory);
+    _create_directory_entry(volume, dot_dot_entry, "..         ", true, 0, parent_directory_cluster, 0);
+    _add_directory_record(directory, dot_dot_entry, directory->LastCluster, NULL);
+}
+
+// Clusters of a new volume come in ascending order and are appended, an update may have to insert in the middle.
+static uint8_t *_add_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster)
+{
+    if (volume->DirectoryClusterCount == volume->DirectoryClusterCapacity)
+    {
+        volume->DirectoryClusterCapacity = volume->DirectoryClusterCapacity ? volume->DirectoryClusterCapacity * 2 : 64;
+        volume->DirectoryClusters = realloc(volume->DirectoryClusters, volume->DirectoryClusterCapacity * sizeof(*volume->DirectoryClusters));
+        if (NULL == volume->DirectoryClusters)
+        {
+            perror("Error allocating directory clusters");
+            exit(1);
+        }
+    }
+
+    uint8_t *contents = calloc(1, volume->ClusterSize);
+    if (NULL == contents)
+    {
+        perror("Error allocating directory cluster");
+        exit(1);
+    }
+
+    uint32_t position = volume->DirectoryClusterCount;
+    while (position > 0 && volume->DirectoryClusters[position - 1].ClusterNumber > cluster)
+    {
+        position--;
+    }
+    memmove(&volume->DirectoryClusters[position + 1], &volume->DirectoryClusters[position], (volume->DirectoryClusterCount - position) * sizeof(*volume->DirectoryClusters));
+
+    volume->DirectoryClusters[position].ClusterNumber = cluster;
+    volume->DirectoryClusters[position].Contents = contents;
+    volume->DirectoryClusters[position].Dirty = true;
+    volume->DirectoryClusterCount++;
+
+    return contents;
+}
+
+static void _remove_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster)
+{
+    DIRECTORY_CLUSTER *directory_cluster = _find_directory_cluster(volume, cluster);
+    if (NULL == directory_cluster)
+    {
+        return;
+    }
+
+    free(directory_cluster->Contents);
+    volume->DirectoryClusterCount--;
+    memmove(directory_cluster, directory_cluster + 1, (&volume->DirectoryClusters[volume->DirectoryClusterCount] - directory_cluster) * sizeof(*directory_cluster));
+}
+
+// Returns NULL if the cluster does not hold a directory.
+static DIRECTORY_CLUSTER *_find_directory_cluster(FAT32_VOLUME *volume, uint32_t cluster)
+{
+    uint32_t low = 0;
+    uint32_t high = volume->DirectoryClusterCount;
+
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (volume->DirectoryClusters[middle].ClusterNumber < cluster)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (low == volume->DirectoryClusterCount || volume->DirectoryClusters[low].ClusterNumber != cluster)
+    {
+        return NULL;
+    }
+
+    return &volume->DirectoryClusters[low];
+}
+
+// Returns the first cluster of a free run of at most cluster_count clusters and stores its length in run_length.
+// A run that holds everything is preferred, searching from the NextFreeCluster hint first. Only when none is left is the request split.
+static uint32_t _allocate_clusters(FAT32_VOLUME *volume, uint32_t cluster_count, uint32_t *run_length)
+{
+    if (0 == volume->FSInfo->FreeCount)
+    {
+        fprintf(stderr, "The image is too small for the input directory\n");
+        exit(1);
+    }
+
+    uint32_t first_cluster = _find_free_run(volume, volume->FSInfo->NextFreeCluster, cluster_count, cluster_count, run_length);
+    if (0 == first_cluster)
+    {
+        first_cluster = _find_free_run(volume, 2, cluster_count, cluster_count, run_length);
+    }
+    if (0 == first_cluster)
+    {
+        first_cluster = _find_free_run(volume, 2, 1, cluster_count, run_length);
+    }
+    if (0 == first_cluster)
+    {
+        fprintf(stderr, "The image is too small for the input directory\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < *run_length; ++i)
+    {
+        _set_cluster_used(volume, first_cluster + i, true);
+    }
+    volume->FSInfo->FreeCount -= *run_length;
+    volume->FSInfo->NextFreeCluster = first_cluster + *run_length;
+    add_stats_counter(STATS_COUNTER_CLUSTERS_ALLOCATED, *run_length);
+
+    return first_cluster;
+}
+
+// Finds the first free run at or after cluster that is at least minimum long, its length is measured up to maximum. Returns 0 if there is none.
+static uint32_t _find_free_run(FAT32_VOLUME *volume, uint32_t cluster, uint32_t minimum, uint32_t maximum, uint32_t *run_length)
+{
+    uint32_t end = volume->ClusterCount + 2;
+
+    while (cluster < end)
+    {
+        if (UINT64_MAX == volume->ClusterBitmap[cluster / 64])
+        {
+            cluster = (cluster / 64 + 1) * 64;
+            continue;
+        }
+        if (_is_cluster_used(volume, cluster))
+        {
+            cluster++;
+            continue;
+        }
+
+        uint32_t length = 0;
+        while (length < maximum && cluster + length < end && !_is_cluster_used(volume, cluster + length))
+        {
+            uint32_t next = cluster + length;
+            length += 0 == next % 64 && 0 == volume->ClusterBitmap[next / 64] && maximum - length >= 64 && end - next >= 64 ? 64 : 1;
+        }
+
+        if (length >= minimum)
+        {
+            *run_length = length;
+            return cluster;
+        }
+        cluster += length;
+    }
+
+    return 0;
+}
+
+// Returns the clusters of a chain to the free pool, directory chains also drop their cached contents.
+static void _free_cluster_chain(FAT32_VOLUME *volume, uint32_t first_cluster, bool is_directory)
+{
+    uint32_t cluster = first_cluster;
+
+    while (cluster >= 2 && cluster < volume->ClusterCount + 2 && _is_cluster_used(volume, cluster))
+    {
+        uint32_t next_cluster = volume->FATs[cluster] & 0x0FFFFFFF;
+
+        volume->FATs[cluster] = 0;
+        _set_cluster_used(volume, cluster, false);
+        volume->FSInfo->FreeCount++;
+        if (is_directory)
+        {
+            _remove_directory_cluster(volume, cluster);
+        }
+
+        if (next_cluster >= END_OF_CHAIN)
+        {
+            break;
+        }
+        cluster = next_cluster;
+    }
+}
+
+static bool _is_cluster_used(FAT32_VOLUME *volume, uint32_t cluster)
+{
+    return volume->ClusterBitmap[cluster / 64] >> (cluster % 64) & 1;
+}
+
+static void _set_cluster_used(FAT32_VOLUME *volume, uint32_t cluster, bool used)
+{
+    if (used)
+    {
+        volume->ClusterBitmap[cluster / 64] |= 1ULL << (cluster % 64);
+    }
+    else
+    {
+        volume->ClusterBitmap[cluster / 64] &= ~(1ULL << (cluster % 64));
+    }
+}
+
+// Each entry of a contiguous chain points to the next cluster, so the run is filled four ascending entries per store.
+static void _write_fat_chain(FAT32_VOLUME *volume, uint32_t first_cluster, uint32_t cluster_count)
+{
+    uint32_t *entries = &volume->FATs[first_cluster];
+    uint32_t last = cluster_count - 1;
+    uint32_t i = 0;
+
+    FAT_RUN run = {first_cluster + 1, first_cluster + 2, first_cluster + 3, first_cluster + 4};
+    const FAT_RUN step = {4, 4, 4, 4};
+
+    for (; i + 4 <= last; i += 4)
+    {
+        memcpy(&entries[i], &run, sizeof(run));
+        run += step;
+    }
+    for (; i < last; ++i)
+    {
+        entries[i] = first_cluster + i + 1;
+    }
+
+    entries[last] = 0x0FFFFFFF;
+}
+
+static void _set_cluster_size(FAT32_VOLUME *volume, uint32_t sectors_per_cluster)
+{
+    volume->SectorsPerCluster = sectors_per_cluster;
+    volume->ClusterSize = sectors_per_cluster * BYTES_PER_SECTOR;
+}
+
+// Empty files still get a cluster.
+static uint64_t _get_file_cluster_count(FAT32_VOLUME *volume, uint64_t file_size)
+{
+    uint64_t cluster_count = (file_size + volume->ClusterSize - 1) / volume->ClusterSize;
+
+    return cluster_count ? cluster_count : 1;
+}
+
+static uint64_t _count_directory_clusters(FAT32_VOLUME *volume, const INPUT_NODE *directory, bool is_root)
+{
+    // Every directory except the root starts with the "." and ".." entries.
+    uint64_t entry_count = directory->ChildCount + (is_root ? 0 : 2);
+    uint64_t cluster_count = entry_count ? (entry_count + NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume) - 1) / NUMBER_OF_ENTRIES_IN_A_CLUSTERS(volume) : 1;
+
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        const INPUT_NODE *child = &directory->Children[i];
+        if (child->IsDirectory)
+        {
+            cluster_count += _count_directory_clusters(volume, child, false);
+        }
+        else
+        {
+            cluster_count += _get_file_cluster_count(volume, child->Size);
+        }
+    }
+
+    return cluster_count;
+}
+
+// Microsoft's FAT32 sizing formula, it may round the FAT up by a sector but never down.
+static uint32_t _get_fat_size(FAT32_VOLUME *volume, uint32_t total_sectors)
+{
+    uint32_t TempVal1 = total_sectors - RESERVED_SECTORS_COUNT;
+    uint32_t TempVal2 = (256 * volume->SectorsPerCluster + NUMBER_OF_FATS) / 2;
+
+    return (TempVal1 + TempVal2 - 1) / TempVal2;
+}
+
+static uint32_t _get_cluster_count(FAT32_VOLUME *volume, uint32_t total_sectors)
+{
+    uint32_t DataSectors = total_sectors - RESERVED_SECTORS_COUNT - _get_fat_size(volume, total_sectors) * NUMBER_OF_FATS;
+
+    return DataSectors / volume->SectorsPerCluster;
+}
+
+// FAT can only store 1980 to 2107, times outside are clamped.
+static void _get_time_and_date(FAT32_VOLUME *volume, time_t timestamp, uint16_t *outputTime, uint16_t *outputDate)
+{
+    struct tm tm;
+    if (volume->Reproducible)
+    {
+        gmtime_r(&timestamp, &tm);
+    }
+    else
+    {
+        localtime_r(&timestamp, &tm);
+    }
+
+    if (tm.tm_year < 80)
+    {
+        tm = (struct tm){.tm_year = 80, .tm_mon = 0, .tm_mday = 1};
+    }
+    else if (tm.tm_year > 207)
+    {
+        tm = (struct tm){.tm_year = 207, .tm_mon = 11, .tm_mday = 31, .tm_hour = 23, .tm_min = 59, .tm_sec = 59};
+    }
+
+    *outputDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+
+    if (tm.tm_sec == 60)
+    {
+        tm.tm_sec = 59;
+    }
+
+    *outputTime = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
+}
+
+static void _format_name(const char *entryName, char *output)
+{
+    for (uint8_t i = 0; i <= 11; ++i)
+    {
+        output[i] = ' ';
+    }
+
+    for (uint8_t i = 0; i < strlen(entryName); ++i)
+    {
+        if (entryName[i] == '.')
+        {
+            uint8_t offset = 11;
+            for (uint8_t j = strlen(entryName); j > i; j--)
+            {
+                output[offset] = entryName[j];
+                offset--;
+            }
+
+            return;
         }
         output[i] = entryName[i];
     }
 }
+
+// Joins a directory path of the volume and a padded 11 character short name, shown as 8.3.
+static char *_make_short_path(const char *directory_path, const char *name)
+{
+    int base_length = 8;
+    int extension_length = 3;
+    while (base_length > 0 && ' ' == name[base_length - 1])
+    {
+        base_length--;
+    }
+    while (extension_length > 0 && ' ' == name[8 + extension_length - 1])
+    {
+        extension_length--;
+    }
+
+    bool is_root = 0 == strcmp(directory_path, "/");
+    size_t path_size = strlen(directory_path) + 14;
+    char *path = malloc(path_size);
+    if (NULL == path)
+    {
+        perror("Error allocating path");
+        exit(1);
+    }
+    snprintf(path, path_size, "%s%s%.*s%s%.*s", directory_path, is_root ? "" : "/", base_length, name,
+             extension_length ? "." : "", extension_length, name + 8);
+
+    return path;
+}
+
+// The calling thread is one of the verifiers.
+static void _run_volume_verifiers(VOLUME_VERIFIER *verifier, uint32_t jobs, void *(*routine)(void *))
+{
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    if (NULL == threads)
+    {
+        perror("Error allocating verifiers");
+        exit(1);
+    }
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        if (0 != pthread_create(&threads[i], NULL, routine, verifier))
+        {
+            perror("Error creating verifier");
+            exit(1);
+        }
+    }
+
+    routine(verifier);
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+static void *_run_tree_verifier(void *argument)
+{
+    VOLUME_VERIFIER *verifier = argument;
+    VERIFY_TASK task;
+
+    while (_pop_verify_task(verifier, &task))
+    {
+        if (VERIFY_TASK_DIRECTORY == task.Type)
+        {
+            _verify_directory(verifier, &task);
+        }
+        else if (VERIFY_TASK_FILE == task.Type)
+        {
+            _verify_file(verifier, &task);
+        }
+        else
+        {
+            _compare_verify_contents(verifier, task.Chain, task.Offset, task.Size);
+            if (1 == atomic_fetch_sub(&task.Chain->References, 1))
+            {
+                free(task.Chain->Path);
+                free(task.Chain->Clusters);
+                free(task.Chain);
+            }
+        }
+
+        free(task.Inputs);
+        free(task.Path);
+        _finish_verify_task(verifier);
+    }
+
+    return NULL;
+}
+
+// Compares both FATs and counts free clusters and allocated clusters that no chain claimed.
+static void *_run_fat_verifier(void *argument)
+{
+    VOLUME_VERIFIER *verifier = argument;
+    uint32_t range_count = (verifier->FATEntryCount + VERIFY_FAT_RANGE - 1) / VERIFY_FAT_RANGE;
+    uint32_t range;
+
+    while ((range = atomic_fetch_add(&verifier->NextRange, 1)) < range_count)
+    {
+        uint32_t first = range * VERIFY_FAT_RANGE;
+        uint32_t end = verifier->FATEntryCount - first < VERIFY_FAT_RANGE ? verifier->FATEntryCount : first + VERIFY_FAT_RANGE;
+
+        uint64_t mirror_differences = 0;
+        if (0 != memcmp(&verifier->FATs[first], &verifier->MirrorFATs[first], (size_t)(end - first) * sizeof(uint32_t)))
+        {
+            for (uint32_t i = first; i < end; ++i)
+            {
+                mirror_differences += verifier->FATs[i] != verifier->MirrorFATs[i];
+            }
+        }
+
+        uint64_t free_count = 0;
+        uint64_t lost_count = 0;
+        uint32_t last = end < verifier->ClusterCount + 2 ? end : verifier->ClusterCount + 2;
+        for (uint32_t cluster = first > 2 ? first : 2; cluster < last; ++cluster)
+        {
+            uint32_t next = verifier->FATs[cluster] & 0x0FFFFFFF;
+            free_count += 0 == next;
+            lost_count += 0 != next && BAD_CLUSTER != next && 0 == atomic_load_explicit(&verifier->Owners[cluster], memory_order_relaxed);
+        }
+
+        atomic_fetch_add(&verifier->MirrorDifferences, mirror_differences);
+        atomic_fetch_add(&verifier->FreeCount, free_count);
+        atomic_fetch_add(&verifier->LostCount, lost_count);
+    }
+
+    return NULL;
+}
+
+static void _push_verify_tasks(VOLUME_VERIFIER *verifier, const VERIFY_TASK *tasks, uint32_t taskCount)
+{
+    if (0 == taskCount)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&verifier->Lock);
+    if (verifier->TaskCount + taskCount > verifier->TaskCapacity)
+    {
+        while (verifier->TaskCount + taskCount > verifier->TaskCapacity)
+        {
+            verifier->TaskCapacity = verifier->TaskCapacity ? verifier->TaskCapacity * 2 : 64;
+        }
+        verifier->Tasks = realloc(verifier->Tasks, verifier->TaskCapacity * sizeof(*verifier->Tasks));
+        if (NULL == verifier->Tasks)
+        {
+            perror("Error allocating verify tasks");
+            exit(1);
+        }
+    }
+
+    memcpy(&verifier->Tasks[verifier->TaskCount], tasks, taskCount * sizeof(*tasks));
+    verifier->TaskCount += taskCount;
+    pthread_cond_broadcast(&verifier->Changed);
+    pthread_mutex_unlock(&verifier->Lock);
+}
+
+// Waits while other verifiers may still add tasks. Returns false once the stack is empty and nobody is busy.
+static bool _pop_verify_task(VOLUME_VERIFIER *verifier, VERIFY_TASK *task)
+{
+    pthread_mutex_lock(&verifier->Lock);
+    while (0 == verifier->TaskCount && 0 != verifier->BusyCount)
+    {
+        pthread_cond_wait(&verifier->Changed, &verifier->Lock);
+    }
+
+    bool found = 0 != verifier->TaskCount;
+    if (found)
+    {
+        *task = verifier->Tasks[--verifier->TaskCount];
+        verifier->BusyCount++;
+    }
+    pthread_mutex_unlock(&verifier->Lock);
+
+    return found;
+}
+
+static void _finish_verify_task(VOLUME_VERIFIER *verifier)
+{
+    pthread_mutex_lock(&verifier->Lock);
+    verifier->BusyCount--;
+    if (0 == verifier->BusyCount && 0 == verifier->TaskCount)
+    {
+        pthread_cond_broadcast(&verifier->Changed);
+    }
+    pthread_mutex_unlock(&verifier->Lock);
+}
+
+// Reads the entries of a directory and pairs them with the children of its inputs, the same way _copy_input_tree() names
+// and skips them. Every entry found becomes a task, so its chain is claimed even when it does not match the input.
+static void _verify_directory(VOLUME_VERIFIER *verifier, const VERIFY_TASK *task)
+{
+    uint32_t *clusters = NULL;
+    uint32_t cluster_count = 0;
+    _claim_verify_chain(verifier, task->Path, task->FirstCluster, &clusters, &cluster_count);
+
+    bool is_root = 0 == strcmp(task->Path, "/");
+    bool has_dot = false;
+    bool has_dot_dot = false;
+    VERIFY_ENTRY *found = NULL;
+    uint32_t found_count = 0;
+    uint32_t found_capacity = 0;
+
+    bool is_end = false;
+    for (uint32_t i = 0; i < cluster_count && !is_end; ++i)
+    {
+        const DIRECTORY_ENTRY *entries = (const DIRECTORY_ENTRY *)(verifier->Data + (uint64_t)(clusters[i] - 2) * verifier->ClusterSize);
+        for (uint32_t j = 0; j < verifier->ClusterSize / sizeof(DIRECTORY_ENTRY) && !is_end; ++j)
+        {
+            const DIRECTORY_ENTRY *entry = &entries[j];
+            uint32_t first_cluster = (uint32_t)entry->FirstClusterHigh << 16 | entry->FirstClusterLow;
+
+            is_end = 0 == (uint8_t)entry->Name[0];
+            if (is_end || DELETED_ENTRY == (uint8_t)entry->Name[0] || ATTRIBUTE_LONG_NAME == (entry->Attribute & 0x3F) ||
+                0 != (entry->Attribute & ATTRIBUTE_VOLUME_ID))
+            {
+                continue;
+            }
+
+            if (0 == memcmp(entry->Name, ".          ", sizeof(entry->Name)))
+            {
+                has_dot = true;
+                if (first_cluster != task->FirstCluster)
+                {
+                    _report_verify_problem(verifier, "%s: the . entry does not point to the directory", task->Path);
+                }
+                continue;
+            }
+            if (0 == memcmp(entry->Name, "..         ", sizeof(entry->Name)))
+            {
+                has_dot_dot = true;
+                if (first_cluster != (verifier->RootCluster == task->ParentCluster ? 0 : task->ParentCluster))
+                {
+                    _report_verify_problem(verifier, "%s: the .. entry does not point to the parent directory", task->Path);
+                }
+                continue;
+            }
+
+            if (found_count == found_capacity)
+            {
+                found_capacity = found_capacity ? found_capacity * 2 : 64;
+                found = realloc(found, found_capacity * sizeof(*found));
+                if (NULL == found)
+                {
+                    perror("Error allocating directory entries");
+                    exit(1);
+                }
+            }
+            found[found_count] = (VERIFY_ENTRY){
+                .IsDirectory = 0 != (entry->Attribute & ATTRIBUTE_DIRECTORY),
+                .Order = found_count,
+                .FirstCluster = first_cluster,
+                .Size = entry->FileSize,
+            };
+            memcpy(found[found_count].Name, entry->Name, sizeof(found[found_count].Name));
+            found_count++;
+        }
+    }
+    free(clusters);
+
+    if (!is_root && (!has_dot || !has_dot_dot))
+    {
+        _report_verify_problem(verifier, "%s: the . or .. entry is missing", task->Path);
+    }
+
+    if (0 != found_count)
+    {
+        qsort(found, found_count, sizeof(*found), _compare_verify_entries);
+    }
+    for (uint32_t i = 1; i < found_count; ++i)
+    {
+        if (0 == memcmp(found[i - 1].Name, found[i].Name, sizeof(found[i].Name)))
+        {
+            _report_verify_problem(verifier, "%s: %.11s is in the directory twice", task->Path, found[i].Name);
+        }
+    }
+
+    uint32_t expected_count = 0;
+    for (uint32_t i = 0; i < task->InputCount; ++i)
+    {
+        expected_count += task->Inputs[i]->ChildCount;
+    }
+    VERIFY_ENTRY *expected = malloc((expected_count ? expected_count : 1) * sizeof(*expected));
+    VERIFY_TASK *children = malloc((found_count ? found_count : 1) * sizeof(*children));
+    if (NULL == expected || NULL == children)
+    {
+        perror("Error allocating directory entries");
+        exit(1);
+    }
+
+    expected_count = 0;
+    for (uint32_t i = 0; i < task->InputCount; ++i)
+    {
+        for (uint32_t j = 0; j < task->Inputs[i]->ChildCount; ++j)
+        {
+            const INPUT_NODE *child = &task->Inputs[i]->Children[j];
+            if (!child->IsDirectory && child->Size > UINT32_MAX)
+            {
+                continue;
+            }
+
+            char entry_name[1024] = {0};
+            _format_name(child->Name, entry_name);
+            expected[expected_count] = (VERIFY_ENTRY){
+                .IsDirectory = child->IsDirectory,
+                .Order = expected_count,
+                .Input = child,
+            };
+            memcpy(expected[expected_count].Name, entry_name, sizeof(expected[expected_count].Name));
+            expected_count++;
+        }
+    }
+    qsort(expected, expected_count, sizeof(*expected), _compare_verify_entries);
+
+    // The first input with a name takes it. Later directories with the same name are merged into it, later files are skipped.
+    uint32_t child_count = 0;
+    uint32_t f = 0;
+    uint32_t e = 0;
+    while (f < found_count || (task->InputCount > 0 && e < expected_count))
+    {
+        int order = f == found_count ? 1 : e == expected_count || 0 == task->InputCount ? -1 : memcmp(found[f].Name, expected[e].Name, sizeof(found[f].Name));
+        uint32_t group_end = e;
+        while (order >= 0 && group_end < expected_count && 0 == memcmp(expected[group_end].Name, expected[e].Name, sizeof(expected[e].Name)))
+        {
+            group_end++;
+        }
+
+        if (order > 0)
+        {
+            _report_verify_problem(verifier, "%s is missing from the image", expected[e].Input->Path);
+            e = group_end;
+            continue;
+        }
+
+        const INPUT_NODE **inputs = NULL;
+        uint32_t input_count = 0;
+        if (0 == order && expected[e].IsDirectory != found[f].IsDirectory)
+        {
+            _report_verify_problem(verifier, "%s is a %s in the input but a %s in the image", expected[e].Input->Path,
+                                   expected[e].IsDirectory ? "directory" : "file", found[f].IsDirectory ? "directory" : "file");
+        }
+        else if (0 == order && !found[f].IsDirectory && found[f].Size != expected[e].Input->Size)
+        {
+            _report_verify_problem(verifier, "%s has %llu bytes, the image has %u", expected[e].Input->Path, (unsigned long long)expected[e].Input->Size, found[f].Size);
+        }
+        else if (0 == order)
+        {
+            inputs = malloc((group_end - e) * sizeof(*inputs));
+            if (NULL == inputs)
+            {
+                perror("Error allocating directory entries");
+                exit(1);
+            }
+            for (uint32_t i = e; i < group_end && (found[f].IsDirectory || i == e); ++i)
+            {
+                if (expected[i].IsDirectory == found[f].IsDirectory)
+                {
+                    inputs[input_count++] = expected[i].Input;
+                }
+            }
+        }
+
+        children[child_count] = _make_verify_task(task, &found[f], inputs, input_count);
+        if (order < 0 && task->InputCount > 0)
+        {
+            _report_verify_problem(verifier, "%s is not in the input", children[child_count].Path);
+        }
+        child_count++;
+        f++;
+        if (0 == order)
+        {
+            e = group_end;
+        }
+    }
+
+    _push_verify_tasks(verifier, children, child_count);
+    free(children);
+    free(expected);
+    free(found);
+}
+
+// FAT32 keeps at least one cluster for every file this tool writes, other tools give empty files none.
+static void _verify_file(VOLUME_VERIFIER *verifier, const VERIFY_TASK *task)
+{
+    if (0 == task->FirstCluster && 0 == task->Size)
+    {
+        return;
+    }
+
+    uint32_t *clusters = NULL;
+    uint32_t cluster_count = 0;
+    bool is_complete = _claim_verify_chain(verifier, task->Path, task->FirstCluster, &clusters, &cluster_count);
+
+    uint64_t needed_clusters = ((uint64_t)task->Size + verifier->ClusterSize - 1) / verifier->ClusterSize;
+    needed_clusters = needed_clusters ? needed_clusters : 1;
+    if (is_complete && cluster_count != needed_clusters)
+    {
+        _report_verify_problem(verifier, "%s: the chain has %u clusters, its %u bytes need %llu", task->Path, cluster_count, task->Size, (unsigned long long)needed_clusters);
+    }
+
+    if (0 == task->InputCount || cluster_count < needed_clusters)
+    {
+        free(clusters);
+        return;
+    }
+
+    if (task->Size <= VERIFY_CHUNK_SIZE)
+    {
+        VERIFY_CHAIN chain = {
+            .Path = task->Path,
+            .Input = task->Inputs[0],
+            .Clusters = clusters,
+        };
+        _compare_verify_contents(verifier, &chain, 0, task->Size);
+        free(clusters);
+        return;
+    }
+
+    // Large files are split so their pieces are compared by all verifiers.
+    uint32_t piece_count = (task->Size + (uint64_t)VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+    VERIFY_CHAIN *chain = malloc(sizeof(*chain));
+    VERIFY_TASK *pieces = malloc(piece_count * sizeof(*pieces));
+    if (NULL == chain || NULL == pieces)
+    {
+        perror("Error allocating verify tasks");
+        exit(1);
+    }
+    chain->Path = strdup(task->Path);
+    chain->Input = task->Inputs[0];
+    chain->Clusters = clusters;
+    atomic_init(&chain->References, piece_count);
+
+    for (uint32_t i = 0; i < piece_count; ++i)
+    {
+        uint64_t offset = (uint64_t)i * VERIFY_CHUNK_SIZE;
+        pieces[i] = (VERIFY_TASK){
+            .Type = VERIFY_TASK_CONTENTS,
+            .Size = task->Size - offset < VERIFY_CHUNK_SIZE ? task->Size - offset : VERIFY_CHUNK_SIZE,
+            .Chain = chain,
+            .Offset = offset,
+        };
+    }
+
+    _push_verify_tasks(verifier, pieces, piece_count);
+    free(pieces);
+}
+
+// Reads the input in buffer sized steps and compares them with the mapped clusters. Only the first difference is reported.
+static void _compare_verify_contents(VOLUME_VERIFIER *verifier, const VERIFY_CHAIN *chain, uint64_t offset, uint64_t size)
+{
+    if (0 == size)
+    {
+        return;
+    }
+
+    uint8_t *buffer = malloc(size < VERIFY_BUFFER_SIZE ? size : VERIFY_BUFFER_SIZE);
+    if (NULL == buffer)
+    {
+        perror("Error allocating verify buffer");
+        exit(1);
+    }
+    int descriptor = open_input_file(chain->Input);
+
+    bool differs = false;
+    for (uint64_t done = 0; done < size && !differs; )
+    {
+        uint64_t length = size - done < VERIFY_BUFFER_SIZE ? size - done : VERIFY_BUFFER_SIZE;
+        if (read_input_file(chain->Input, descriptor, offset + done, buffer, length) != length)
+        {
+            _report_verify_problem(verifier, "%s is shorter than %s in the image", chain->Input->Path, chain->Path);
+            break;
+        }
+
+        for (uint64_t compared = 0; compared < length && !differs; )
+        {
+            uint64_t position = offset + done + compared;
+            uint32_t cluster_offset = position % verifier->ClusterSize;
+            uint64_t piece = verifier->ClusterSize - cluster_offset < length - compared ? verifier->ClusterSize - cluster_offset : length - compared;
+            const uint8_t *data = verifier->Data + (uint64_t)(chain->Clusters[position / verifier->ClusterSize] - 2) * verifier->ClusterSize + cluster_offset;
+
+            differs = 0 != memcmp(data, buffer + compared, piece);
+            if (differs)
+            {
+                _report_verify_problem(verifier, "%s differs from %s in the image near offset %llu", chain->Input->Path, chain->Path, (unsigned long long)position);
+            }
+            compared += piece;
+        }
+        done += length;
+    }
+
+    close_input_file(chain->Input, descriptor);
+    free(buffer);
+}
+
+// Claims the clusters of a chain in order and returns them, stopping at the first problem. Returns false if there was one.
+static bool _claim_verify_chain(VOLUME_VERIFIER *verifier, const char *path, uint32_t first_cluster, uint32_t **clusters, uint32_t *cluster_count)
+{
+    unsigned int owner = atomic_fetch_add(&verifier->NextOwner, 1);
+    uint32_t capacity = 0;
+    uint32_t cluster = first_cluster;
+
+    *clusters = NULL;
+    *cluster_count = 0;
+    while (true)
+    {
+        if (cluster < 2 || cluster >= verifier->ClusterCount + 2)
+        {
+            _report_verify_problem(verifier, "%s: the chain leaves the volume at cluster %u", path, cluster);
+            return false;
+        }
+
+        unsigned int previous = 0;
+        if (!atomic_compare_exchange_strong(&verifier->Owners[cluster], &previous, owner))
+        {
+            _report_verify_problem(verifier, previous == owner ? "%s: the chain loops back to cluster %u" : "%s: cluster %u is cross-linked with another chain", path, cluster);
+            return false;
+        }
+
+        if (*cluster_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            *clusters = realloc(*clusters, capacity * sizeof(**clusters));
+            if (NULL == *clusters)
+            {
+                perror("Error allocating chain");
+                exit(1);
+            }
+        }
+        (*clusters)[(*cluster_count)++] = cluster;
+
+        uint32_t next = verifier->FATs[cluster] & 0x0FFFFFFF;
+        if (next >= END_OF_CHAIN)
+        {
+            return true;
+        }
+        if (0 == next || BAD_CLUSTER == next)
+        {
+            _report_verify_problem(verifier, "%s: cluster %u of the chain is marked %s", path, cluster, 0 == next ? "free" : "bad");
+            return false;
+        }
+        cluster = next;
+    }
+}
+
+static VERIFY_TASK _make_verify_task(const VERIFY_TASK *directory, const VERIFY_ENTRY *entry, const INPUT_NODE **inputs, uint32_t input_count)
+{
+    return (VERIFY_TASK){
+        .Type = entry->IsDirectory ? VERIFY_TASK_DIRECTORY : VERIFY_TASK_FILE,
+        .Path = _make_short_path(directory->Path, entry->Name),
+        .FirstCluster = entry->FirstCluster,
+        .ParentCluster = directory->FirstCluster,
+        .Size = entry->Size,
+        .Inputs = inputs,
+        .InputCount = input_count,
+    };
+}
+
+static int _compare_verify_entries(const void *first, const void *second)
+{
+    const VERIFY_ENTRY *first_entry = first;
+    const VERIFY_ENTRY *second_entry = second;
+    int order = memcmp(first_entry->Name, second_entry->Name, sizeof(first_entry->Name));
+
+    return order ? order : (first_entry->Order > second_entry->Order) - (first_entry->Order < second_entry->Order);
+}
+
+static void _report_verify_problem(VOLUME_VERIFIER *verifier, const char *format, ...)
+{
+    uint64_t problem_count = atomic_fetch_add(&verifier->ProblemCount, 1);
+    if (problem_count > VERIFY_MESSAGE_LIMIT)
+    {
+        return;
+    }
+
+    flockfile(stderr);
+    if (VERIFY_MESSAGE_LIMIT == problem_count)
+    {
+        fprintf(stderr, "Further problems are only counted\n");
+    }
+    else
+    {
+        va_list arguments;
+        va_start(arguments, format);
+        vfprintf(stderr, format, arguments);
+        va_end(arguments);
+        fputc('\n', stderr);
+    }
+    funlockfile(stderr);
+}
@@ -3,14 +3,46 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 #include <dirent.h>
 
-void init_fat32_file_system(void);
+#include "image_output.h"
+#include "input_scan.h"
 
-void format_fat32_file_system(void);
+// All state of one volume. Separate volumes can be built on separate threads.
+typedef struct _FAT32_VOLUME FAT32_VOLUME;
 
-void copy_input_directory(const char* inputDirectoryPath);
+// Every entry is stamped with build_time. Reproducible volumes also use it instead of file modification times and do not depend on the time zone.
+FAT32_VOLUME *init_fat32_file_system(time_t build_time, bool reproducible, bool verbose);
 
-void write_fat32_file_system(FILE *outputFile);
+void free_fat32_file_system(FAT32_VOLUME *volume);
+
+// Sets the cluster size of a new volume to cluster_size bytes, or picks one from the input file sizes when it is 0.
+// Picked sizes are 4 KiB to 32 KiB, smaller ones only when the volume is too small for those.
+// volume_sectors is the size of the volume, 0 if it is sized to the input. Returns the cluster size in bytes.
+uint32_t select_fat32_cluster_size(FAT32_VOLUME *volume, const INPUT_NODE *root, uint32_t cluster_size, uint64_t volume_sectors);
+
+// Data clusters of the selected size needed to hold the input tree, directory clusters included.
+uint64_t count_fat32_clusters(FAT32_VOLUME *volume, const INPUT_NODE *root);
+
+// Smallest volume, in sectors, with at least cluster_count data clusters. Returns 0 if FAT32 can not address that many.
+uint64_t calculate_fat32_volume_sectors(FAT32_VOLUME *volume, uint64_t cluster_count);
+
+void format_fat32_file_system(FAT32_VOLUME *volume, uint32_t total_sectors);
+
+// Reads the volume of an existing image at offset so copy_input_tree() only changes what differs from the input.
+// output must stay open until copy_input_tree() returns, reproducible volumes read file contents back from it.
+void load_fat32_file_system(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset, uint64_t partition_sectors);
+
+// The tree must stay alive until write_fat32_file_system() returns, file data is read from its paths.
+// On a loaded volume entries that are not in the input tree are removed.
+void copy_input_tree(FAT32_VOLUME *volume, const INPUT_NODE *root);
+
+// File data is copied by jobs threads writing at their final offsets. A stream is written in order while jobs threads read ahead.
+void write_fat32_file_system(FAT32_VOLUME *volume, IMAGE_OUTPUT *output, uint64_t offset, uint32_t jobs);
+
+// Checks the volume at the start of a mapped partition with jobs threads: boot sectors, FSInfo, both FATs and every chain reached from
+// the directory tree. With a root the tree and the file contents are also compared with the input. Prints each problem and returns how many were found.
+uint64_t verify_fat32_file_system(const uint8_t *partition, uint64_t partition_sectors, const INPUT_NODE *root, uint32_t jobs);
 
 #endif /* _FAT32_SYSTEM_FORMAT_H_ */
@@ -1,7 +1,10 @@
 #include "guid_provider.h"
 
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+static uint64_t _split_mix(uint64_t *state);
 
 void get_guid(uint8_t guid[16])
 {
@@ -12,3 +15,67 @@ void get_guid(uint8_t guid[16])
         fclose(Urandom);
     }
 }
+
+void get_seeded_guid(uint8_t guid[16], const void *seed, size_t seed_size, uint32_t index)
+{
+    // FNV-1a over the seed and the index, expanded to 128 bits with SplitMix64.
+    const uint8_t *bytes = seed;
+    uint64_t state = 14695981039346656037ULL;
+    for (size_t i = 0; i < seed_size; ++i)
+    {
+        state = (state ^ bytes[i]) * 1099511628211ULL;
+    }
+    for (uint8_t i = 0; i < sizeof(index); ++i)
+    {
+        state = (state ^ (uint8_t)(index >> (8 * i))) * 1099511628211ULL;
+    }
+
+    for (uint8_t i = 0; i < 16; i += 8)
+    {
+        uint64_t value = _split_mix(&state);
+        for (uint8_t j = 0; j < 8; ++j)
+        {
+            guid[i + j] = (uint8_t)(value >> (8 * j));
+        }
+    }
+
+    // Data3 is stored little endian, so the version nibble is the high half of byte 7.
+    guid[7] = (guid[7] & 0x0F) | 0x40;
+    guid[8] = (guid[8] & 0x3F) | 0x80;
+}
+
+bool parse_guid(uint8_t guid[16], const char *text)
+{
+    // Byte i of the text goes to guid[order[i]].
+    static const uint8_t order[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    for (uint8_t i = 0; i < 16; ++i)
+    {
+        if (4 == i || 6 == i || 8 == i || 10 == i)
+        {
+            if ('-' != *text++)
+            {
+                return false;
+            }
+        }
+        if (!isxdigit((unsigned char)text[0]) || !isxdigit((unsigned char)text[1]))
+        {
+            return false;
+        }
+
+        char digits[3] = {text[0], text[1], '\0'};
+        guid[order[i]] = (uint8_t)strtoul(digits, NULL, 16);
+        text += 2;
+    }
+
+    return '\0' == *text;
+}
+
+static uint64_t _split_mix(uint64_t *state)
+{
+    uint64_t value = (*state += 0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+
+    return value ^ (value >> 31);
+}
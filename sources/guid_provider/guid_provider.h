@@ -1,8 +1,16 @@
 #ifndef _GUID_PROVIDER_H_
 #define _GUID_PROVIDER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 void get_guid(uint8_t guid[16]);
 
+// Derives a version 4 style GUID from seed bytes, every index gives a different GUID for the same seed.
+void get_seeded_guid(uint8_t guid[16], const void *seed, size_t seed_size, uint32_t index);
+
+// Parses the text form XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX into the on disk layout, the first three groups little endian.
+bool parse_guid(uint8_t guid[16], const char *text);
+
 #endif /* _GUID_PROVIDER_H_ */
@@ -0,0 +1,163 @@
+#include "image_builder.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "build_stats.h"
+
+struct _IMAGE_BUILDER
+{
+    IMAGE_OPTIONS Options;
+    // One tree per partition, Partitions is only filled once add_builder_partition() was called.
+    INPUT_NODE **Trees;
+    PARTITION_SPEC *Partitions;
+    uint32_t TreeCount;
+    uint32_t PartitionCount;
+};
+
+static INPUT_NODE *_add_builder_file(IMAGE_BUILDER *builder, const char *imagePath, uint64_t size, time_t modificationTime);
+
+IMAGE_BUILDER *create_image_builder(const IMAGE_OPTIONS *options)
+{
+    IMAGE_BUILDER *builder = calloc(1, sizeof(*builder));
+    if (NULL == builder)
+    {
+        perror("Error allocating image builder");
+        exit(1);
+    }
+
+    builder->Options = *options;
+    builder->Options.Partitions = NULL;
+    builder->Options.PartitionCount = 0;
+    if (0 == builder->Options.Jobs)
+    {
+        builder->Options.Jobs = 1;
+    }
+
+    builder->Trees = malloc(sizeof(*builder->Trees));
+    if (NULL == builder->Trees)
+    {
+        perror("Error allocating image builder");
+        exit(1);
+    }
+    builder->Trees[0] = create_input_tree();
+    builder->TreeCount = 1;
+
+    return builder;
+}
+
+void add_builder_partition(IMAGE_BUILDER *builder, const PARTITION_SPEC *spec)
+{
+    builder->Partitions = realloc(builder->Partitions, (builder->PartitionCount + 1) * sizeof(*builder->Partitions));
+    if (NULL == builder->Partitions)
+    {
+        perror("Error allocating partitions");
+        exit(1);
+    }
+    builder->Partitions[builder->PartitionCount++] = *spec;
+
+    // The first partition takes over the tree that was there from the start.
+    if (builder->PartitionCount > builder->TreeCount)
+    {
+        builder->Trees = realloc(builder->Trees, builder->PartitionCount * sizeof(*builder->Trees));
+        if (NULL == builder->Trees)
+        {
+            perror("Error allocating partitions");
+            exit(1);
+        }
+        builder->Trees[builder->TreeCount++] = create_input_tree();
+    }
+
+    if (NULL != spec->InputPath)
+    {
+        add_builder_input_directory(builder, "", spec->InputPath);
+    }
+}
+
+void add_builder_directory(IMAGE_BUILDER *builder, const char *imagePath)
+{
+    add_input_node(builder->Trees[builder->TreeCount - 1], imagePath, true);
+}
+
+void add_builder_input_directory(IMAGE_BUILDER *builder, const char *imagePath, const char *inputDirectoryPath)
+{
+    start_stats_phase(STATS_PHASE_SCAN);
+    INPUT_NODE *tree = scan_input_directory(inputDirectoryPath, builder->Options.Jobs);
+    stop_stats_phase(STATS_PHASE_SCAN);
+
+    graft_input_tree(add_input_node(builder->Trees[builder->TreeCount - 1], imagePath, true), tree);
+}
+
+void add_builder_memory_file(IMAGE_BUILDER *builder, const char *imagePath, const void *buffer, uint64_t size, time_t modificationTime)
+{
+    INPUT_NODE *file = _add_builder_file(builder, imagePath, size, modificationTime);
+    file->Source = INPUT_SOURCE_MEMORY;
+    file->Buffer = buffer;
+}
+
+void add_builder_descriptor_file(IMAGE_BUILDER *builder, const char *imagePath, int descriptor)
+{
+    struct stat file_status;
+    if (0 != fstat(descriptor, &file_status) || !S_ISREG(file_status.st_mode))
+    {
+        fprintf(stderr, "Can not add %s, the descriptor is not a regular file\n", imagePath);
+        exit(1);
+    }
+
+    INPUT_NODE *file = _add_builder_file(builder, imagePath, file_status.st_size, file_status.st_mtime);
+    file->Source = INPUT_SOURCE_DESCRIPTOR;
+    file->Descriptor = descriptor;
+}
+
+void add_builder_callback_file(IMAGE_BUILDER *builder, const char *imagePath, uint64_t size, time_t modificationTime, INPUT_READ_CALLBACK read, void *context)
+{
+    INPUT_NODE *file = _add_builder_file(builder, imagePath, size, modificationTime);
+    file->Source = INPUT_SOURCE_CALLBACK;
+    file->Read = read;
+    file->ReadContext = context;
+}
+
+void build_image_file(IMAGE_BUILDER *builder, FILE *outputFile)
+{
+    IMAGE_OPTIONS options = builder->Options;
+    options.Partitions = builder->Partitions;
+    options.PartitionCount = builder->PartitionCount;
+
+    write_image_trees(builder->Trees, outputFile, NULL, &options);
+}
+
+void build_image_sink(IMAGE_BUILDER *builder, IMAGE_SINK_WRITE write, void *context)
+{
+    IMAGE_OPTIONS options = builder->Options;
+    options.Partitions = builder->Partitions;
+    options.PartitionCount = builder->PartitionCount;
+
+    IMAGE_SINK sink = {
+        .Write = write,
+        .Context = context,
+    };
+    write_image_trees(builder->Trees, NULL, &sink, &options);
+}
+
+void free_image_builder(IMAGE_BUILDER *builder)
+{
+    for (uint32_t i = 0; i < builder->TreeCount; ++i)
+    {
+        free_input_tree(builder->Trees[i]);
+    }
+
+    free(builder->Trees);
+    free(builder->Partitions);
+    free(builder);
+}
+
+// Adding a file again replaces its contents.
+static INPUT_NODE *_add_builder_file(IMAGE_BUILDER *builder, const char *imagePath, uint64_t size, time_t modificationTime)
+{
+    INPUT_NODE *file = add_input_node(builder->Trees[builder->TreeCount - 1], imagePath, false);
+    file->Size = size;
+    file->ModificationTime = modificationTime;
+
+    return file;
+}
@@ -0,0 +1,47 @@
+#ifndef _IMAGE_BUILDER_H_
+#define _IMAGE_BUILDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "image_output.h"
+#include "input_scan.h"
+#include "write_image.h"
+
+// Collects the contents of an image from directories on disk, memory buffers, descriptors and read callbacks, then writes it
+// without staging anything on disk. Builders share no state, several can be filled and built on separate threads.
+// Paths inside the image are / separated and missing parent directories are created.
+typedef struct _IMAGE_BUILDER IMAGE_BUILDER;
+
+// The options are copied, the strings and arrays they point to must outlive the builder. Their partitions are ignored,
+// add_builder_partition() adds partitions instead. Without it the image has a single partition sized by the options.
+IMAGE_BUILDER *create_image_builder(const IMAGE_OPTIONS *options);
+
+// Everything added afterwards goes to this partition, anything added before the first call goes to the first partition.
+// The input directory of the spec is scanned right away when it is set.
+void add_builder_partition(IMAGE_BUILDER *builder, const PARTITION_SPEC *spec);
+
+void add_builder_directory(IMAGE_BUILDER *builder, const char *imagePath);
+
+// Scans inputDirectoryPath and adds its contents below imagePath.
+void add_builder_input_directory(IMAGE_BUILDER *builder, const char *imagePath, const char *inputDirectoryPath);
+
+// The buffer is not copied and must stay valid until the image is built.
+void add_builder_memory_file(IMAGE_BUILDER *builder, const char *imagePath, const void *buffer, uint64_t size, time_t modificationTime);
+
+// Size and time come from fstat. The descriptor is read at explicit offsets, stays open and must stay valid until the image is built.
+void add_builder_descriptor_file(IMAGE_BUILDER *builder, const char *imagePath, int descriptor);
+
+// read is called from several threads at once while the image is built.
+void add_builder_callback_file(IMAGE_BUILDER *builder, const char *imagePath, uint64_t size, time_t modificationTime, INPUT_READ_CALLBACK read, void *context);
+
+// outputFile stays open. A builder can be built more than once.
+void build_image_file(IMAGE_BUILDER *builder, FILE *outputFile);
+
+// Streams a raw image to write in ascending order.
+void build_image_sink(IMAGE_BUILDER *builder, IMAGE_SINK_WRITE write, void *context);
+
+void free_image_builder(IMAGE_BUILDER *builder);
+
+#endif /* _IMAGE_BUILDER_H_ */
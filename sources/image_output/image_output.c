@@ -0,0 +1,476 @@
+#include "image_output.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "build_stats.h"
+
+#define SPARSE_BLOCK_SIZE 4096
+#define ZERO_BUFFER_SIZE 1024 * 1024
+#define COPY_BUFFER_SIZE 1024 * 1024
+
+static const uint8_t zero_buffer[ZERO_BUFFER_SIZE];
+
+static void _write_all(IMAGE_OUTPUT *output, uint64_t offset, const void *buffer, uint64_t size);
+static void _write_at(IMAGE_OUTPUT *output, uint64_t position, const void *buffer, uint64_t size);
+static uint64_t _copy_at(IMAGE_OUTPUT *output, uint64_t position, int input_descriptor, uint64_t input_offset, uint64_t size);
+static void _seek_stream(IMAGE_OUTPUT *output, uint64_t offset);
+static uint64_t _send_file(IMAGE_OUTPUT *output, int input_descriptor, uint64_t input_offset, uint64_t size);
+static bool _is_zero(const uint8_t *buffer, uint64_t size);
+static bool _is_copy_unsupported(int error);
+
+void init_image_output(IMAGE_OUTPUT *output, FILE *outputFile, bool sparse, IMAGE_FORMAT format)
+{
+    fflush(outputFile);
+
+    output->Descriptor = fileno(outputFile);
+    output->Format = format;
+    output->Streaming = (off_t)-1 == lseek(output->Descriptor, 0, SEEK_CUR) && ESPIPE == errno;
+    // Holes need a seekable file. Unallocated qcow2 clusters read as zeros, so zeros are never written there.
+    output->Sparse = (sparse && !output->Streaming) || IMAGE_FORMAT_QCOW2 == format;
+    output->Position = 0;
+    output->Devices = NULL;
+    output->Zstd = NULL;
+    output->Sink = NULL;
+    pthread_mutex_init(&output->PositionLock, NULL);
+
+    if (IMAGE_FORMAT_QCOW2 == format)
+    {
+        if (output->Streaming)
+        {
+            fprintf(stderr, "A qcow2 image can not be streamed, it needs a seekable output file\n");
+            exit(1);
+        }
+        init_qcow2_image(&output->Qcow2, output->Descriptor);
+    }
+}
+
+void init_device_image_output(IMAGE_OUTPUT *output, DEVICE_WRITER *devices)
+{
+    output->Descriptor = -1;
+    output->Format = IMAGE_FORMAT_RAW;
+    output->Sparse = false;
+    output->Streaming = true;
+    output->Position = 0;
+    output->Devices = devices;
+    output->Zstd = NULL;
+    output->Sink = NULL;
+    pthread_mutex_init(&output->PositionLock, NULL);
+}
+
+// Frames are written in order, so the compressed image is a stream even when the output file is seekable.
+void init_zstd_image_output(IMAGE_OUTPUT *output, FILE *outputFile, uint32_t jobs)
+{
+    fflush(outputFile);
+
+    output->Descriptor = fileno(outputFile);
+    output->Format = IMAGE_FORMAT_ZSTD;
+    output->Sparse = false;
+    output->Streaming = true;
+    output->Position = 0;
+    output->Devices = NULL;
+    output->Zstd = open_zstd_image(output->Descriptor, jobs);
+    output->Sink = NULL;
+    pthread_mutex_init(&output->PositionLock, NULL);
+}
+
+void init_sink_image_output(IMAGE_OUTPUT *output, const IMAGE_SINK *sink)
+{
+    output->Descriptor = -1;
+    output->Format = IMAGE_FORMAT_RAW;
+    output->Sparse = false;
+    output->Streaming = true;
+    output->Position = 0;
+    output->Devices = NULL;
+    output->Zstd = NULL;
+    output->Sink = sink;
+    pthread_mutex_init(&output->PositionLock, NULL);
+}
+
+void write_output_region(IMAGE_OUTPUT *output, uint64_t offset, const void *buffer, uint64_t size)
+{
+    if (!output->Sparse)
+    {
+        _write_all(output, offset, buffer, size);
+        return;
+    }
+
+    // Coalesce runs of non-zero blocks into a single write. Blocks follow the file system block grid so that skipped ones become real holes.
+    const uint8_t *data = buffer;
+    uint64_t run_start = 0;
+    uint64_t position = 0;
+
+    while (position < size)
+    {
+        uint64_t block_size = SPARSE_BLOCK_SIZE - (offset + position) % SPARSE_BLOCK_SIZE;
+        if (block_size > size - position)
+        {
+            block_size = size - position;
+        }
+
+        if (_is_zero(data + position, block_size))
+        {
+            if (run_start < position)
+            {
+                _write_all(output, offset + run_start, data + run_start, position - run_start);
+            }
+            run_start = position + block_size;
+        }
+
+        position += block_size;
+    }
+
+    if (run_start < size)
+    {
+        _write_all(output, offset + run_start, data + run_start, size - run_start);
+    }
+}
+
+void skip_output_region(IMAGE_OUTPUT *output, uint64_t offset, uint64_t size)
+{
+    // Devices keep what they held and zstd frames zero fill every gap themselves.
+    if (output->Sparse || NULL != output->Devices || NULL != output->Zstd)
+    {
+        return;
+    }
+
+    while (size > 0)
+    {
+        uint64_t chunk = size < sizeof(zero_buffer) ? size : sizeof(zero_buffer);
+        _write_all(output, offset, zero_buffer, chunk);
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+uint64_t copy_output_region(IMAGE_OUTPUT *output, uint64_t offset, int input_descriptor, uint64_t input_offset, uint64_t size)
+{
+    if (IMAGE_FORMAT_QCOW2 != output->Format)
+    {
+        if (output->Streaming)
+        {
+            _seek_stream(output, offset);
+        }
+        return _copy_at(output, offset, input_descriptor, input_offset, size);
+    }
+
+    // Every run of clusters that is contiguous in the qcow2 file is copied like a raw region.
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        uint64_t position = 0;
+        uint64_t run_size = map_qcow2_region(&output->Qcow2, offset + copied, size - copied, &position);
+        uint64_t run_copied = _copy_at(output, position, input_descriptor, input_offset + copied, run_size);
+
+        copied += run_copied;
+        if (run_copied < run_size)
+        {
+            break;
+        }
+    }
+
+    return copied;
+}
+
+void read_output_region(IMAGE_OUTPUT *output, uint64_t offset, void *buffer, uint64_t size)
+{
+    uint8_t *data = buffer;
+
+    if (output->Streaming || IMAGE_FORMAT_RAW != output->Format)
+    {
+        fprintf(stderr, "Only a raw image file can be read back\n");
+        exit(1);
+    }
+
+    while (size > 0)
+    {
+        ssize_t result = pread(output->Descriptor, data, size, offset);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("Error reading output image");
+            exit(1);
+        }
+        if (0 == result)
+        {
+            fprintf(stderr, "Output image is truncated\n");
+            exit(1);
+        }
+
+        add_stats_counter(STATS_COUNTER_BYTES_READ, result);
+        data += result;
+        offset += result;
+        size -= result;
+    }
+}
+
+void finish_image_output(IMAGE_OUTPUT *output, uint64_t image_size)
+{
+    if (output->Streaming && output->Position < image_size)
+    {
+        skip_output_region(output, output->Position, image_size - output->Position);
+    }
+
+    if (NULL != output->Devices)
+    {
+        close_device_writer(output->Devices, image_size);
+    }
+    else if (NULL != output->Zstd)
+    {
+        close_zstd_image(output->Zstd, image_size);
+    }
+    else if (IMAGE_FORMAT_QCOW2 == output->Format)
+    {
+        finish_qcow2_image(&output->Qcow2, image_size);
+    }
+    // Trailing holes are not materialized by pwrite, so the size is set explicitly.
+    else if (output->Sparse && 0 != ftruncate(output->Descriptor, image_size))
+    {
+        perror("Error setting output image size");
+        exit(1);
+    }
+
+    pthread_mutex_destroy(&output->PositionLock);
+}
+
+// Copies to a position in the output file, a stream must already be at that position.
+static uint64_t _copy_at(IMAGE_OUTPUT *output, uint64_t position, int input_descriptor, uint64_t input_offset, uint64_t size)
+{
+    uint64_t copied = 0;
+
+    if (output->Streaming && NULL == output->Devices && NULL == output->Zstd && NULL == output->Sink)
+    {
+        copied = _send_file(output, input_descriptor, input_offset, size);
+    }
+
+    // copy_file_range keeps the data in the kernel and lets file systems that support it share extents instead of copying.
+    while (!output->Streaming && copied < size)
+    {
+        loff_t input_position = input_offset + copied;
+        loff_t output_position = position + copied;
+        ssize_t result = copy_file_range(input_descriptor, &input_position, output->Descriptor, &output_position, size - copied, 0);
+        if (result > 0)
+        {
+            add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, result);
+            copied += result;
+            continue;
+        }
+        if (0 == result)
+        {
+            return copied;
+        }
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        if (!_is_copy_unsupported(errno))
+        {
+            perror("Error copying file data");
+            exit(1);
+        }
+        break;
+    }
+
+    // sendfile works across file systems but writes at the shared output file position.
+    pthread_mutex_lock(&output->PositionLock);
+    if (!output->Streaming && copied < size && (off_t)-1 != lseek(output->Descriptor, position + copied, SEEK_SET))
+    {
+        copied += _send_file(output, input_descriptor, input_offset + copied, size - copied);
+    }
+    pthread_mutex_unlock(&output->PositionLock);
+
+    if (copied == size)
+    {
+        return copied;
+    }
+
+    uint8_t *copy_buffer = malloc(COPY_BUFFER_SIZE);
+    if (NULL == copy_buffer)
+    {
+        perror("Error allocating copy buffer");
+        exit(1);
+    }
+
+    while (copied < size)
+    {
+        uint64_t chunk = size - copied < COPY_BUFFER_SIZE ? size - copied : COPY_BUFFER_SIZE;
+        ssize_t result = pread(input_descriptor, copy_buffer, chunk, input_offset + copied);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("Error reading file data");
+            exit(1);
+        }
+        if (0 == result)
+        {
+            break;
+        }
+
+        _write_at(output, position + copied, copy_buffer, result);
+        copied += result;
+    }
+
+    free(copy_buffer);
+    return copied;
+}
+
+static void _write_all(IMAGE_OUTPUT *output, uint64_t offset, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+
+    if (IMAGE_FORMAT_QCOW2 != output->Format)
+    {
+        if (output->Streaming)
+        {
+            _seek_stream(output, offset);
+        }
+        _write_at(output, offset, buffer, size);
+        return;
+    }
+
+    while (size > 0)
+    {
+        uint64_t position = 0;
+        uint64_t run_size = map_qcow2_region(&output->Qcow2, offset, size, &position);
+        _write_at(output, position, data, run_size);
+
+        data += run_size;
+        offset += run_size;
+        size -= run_size;
+    }
+}
+
+static void _write_at(IMAGE_OUTPUT *output, uint64_t position, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+
+    if (NULL != output->Devices)
+    {
+        write_device_region(output->Devices, position, data, size);
+        add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, size);
+        output->Position += size;
+        return;
+    }
+
+    if (NULL != output->Zstd)
+    {
+        write_zstd_region(output->Zstd, position, data, size);
+        add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, size);
+        output->Position += size;
+        return;
+    }
+
+    if (NULL != output->Sink)
+    {
+        if (!output->Sink->Write(output->Sink->Context, data, size))
+        {
+            fprintf(stderr, "Error writing image to the sink\n");
+            exit(1);
+        }
+        add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, size);
+        output->Position += size;
+        return;
+    }
+
+    while (size > 0)
+    {
+        ssize_t written = output->Streaming ? write(output->Descriptor, data, size) : pwrite(output->Descriptor, data, size, position);
+        if (written < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("Error writing output image");
+            exit(1);
+        }
+
+        add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, written);
+        if (output->Streaming)
+        {
+            output->Position += written;
+        }
+        data += written;
+        position += written;
+        size -= written;
+    }
+}
+
+// Streams can only move forward, skipped bytes are sent as zeros. Devices simply leave them out and zstd frames fill them in.
+static void _seek_stream(IMAGE_OUTPUT *output, uint64_t offset)
+{
+    if (offset < output->Position)
+    {
+        fprintf(stderr, "Streamed image written out of order at offset %llu\n", (unsigned long long)offset);
+        exit(1);
+    }
+
+    if (NULL != output->Devices || NULL != output->Zstd)
+    {
+        output->Position = offset;
+        return;
+    }
+
+    while (output->Position < offset)
+    {
+        uint64_t chunk = offset - output->Position < sizeof(zero_buffer) ? offset - output->Position : sizeof(zero_buffer);
+        _write_at(output, output->Position, zero_buffer, chunk);
+    }
+}
+
+// sendfile writes at the current output position, which also makes it work for pipes. Returns the bytes sent, the caller copies whatever is left.
+static uint64_t _send_file(IMAGE_OUTPUT *output, int input_descriptor, uint64_t input_offset, uint64_t size)
+{
+    uint64_t copied = 0;
+
+    while (copied < size)
+    {
+        off_t input_position = input_offset + copied;
+        ssize_t result = sendfile(output->Descriptor, input_descriptor, &input_position, size - copied);
+        if (result > 0)
+        {
+            add_stats_counter(STATS_COUNTER_BYTES_WRITTEN, result);
+            if (output->Streaming)
+            {
+                output->Position += result;
+            }
+            copied += result;
+            continue;
+        }
+        if (0 == result)
+        {
+            break;
+        }
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        if (!_is_copy_unsupported(errno))
+        {
+            perror("Error copying file data");
+            exit(1);
+        }
+        break;
+    }
+
+    return copied;
+}
+
+static bool _is_zero(const uint8_t *buffer, uint64_t size)
+{
+    return 0 == size || (0 == buffer[0] && 0 == memcmp(buffer, buffer + 1, size - 1));
+}
+
+static bool _is_copy_unsupported(int error)
+{
+    return EXDEV == error || EINVAL == error || ENOSYS == error || EOPNOTSUPP == error || EBADF == error;
+}
@@ -0,0 +1,75 @@
+#ifndef _IMAGE_OUTPUT_H_
+#define _IMAGE_OUTPUT_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "device_writer.h"
+#include "qcow2_image.h"
+#include "zstd_image.h"
+
+typedef enum _IMAGE_FORMAT
+{
+    IMAGE_FORMAT_RAW,
+    IMAGE_FORMAT_QCOW2,
+    IMAGE_FORMAT_ZSTD,
+} IMAGE_FORMAT;
+
+// Receives a raw image in ascending offset order with the gaps as zeros. Returning false fails the build.
+typedef bool (*IMAGE_SINK_WRITE)(void *context, const void *buffer, uint64_t size);
+
+typedef struct _IMAGE_SINK
+{
+    IMAGE_SINK_WRITE Write;
+    void *Context;
+} IMAGE_SINK;
+
+// Writes are positioned, so several threads may write to one output at the same time.
+// A pipe or other unseekable output is streamed instead: every region has to be written by one thread in ascending offset order,
+// gaps in between are zero filled. Offsets are always raw image offsets, a qcow2 output maps them to its clusters.
+typedef struct _IMAGE_OUTPUT
+{
+    int Descriptor;
+    IMAGE_FORMAT Format;
+    QCOW2_IMAGE Qcow2;
+    bool Sparse;
+    bool Streaming;
+    uint64_t Position;
+    // Set for device output, the stream goes to the device writer instead of the descriptor.
+    DEVICE_WRITER *Devices;
+    // Set for zstd output, the stream is compressed into frames before it reaches the descriptor.
+    ZSTD_IMAGE *Zstd;
+    // Set for a caller supplied sink, the stream goes to its callback.
+    const IMAGE_SINK *Sink;
+    pthread_mutex_t PositionLock;
+} IMAGE_OUTPUT;
+
+// qcow2 output is always sparse and needs a seekable file.
+void init_image_output(IMAGE_OUTPUT *output, FILE *outputFile, bool sparse, IMAGE_FORMAT format);
+
+// Streams a raw image to the devices. Regions that are skipped are not written, whatever the devices held there stays.
+void init_device_image_output(IMAGE_OUTPUT *output, DEVICE_WRITER *devices);
+
+// Streams a raw image compressed as seekable zstd, jobs threads compress frames while the image is written.
+void init_zstd_image_output(IMAGE_OUTPUT *output, FILE *outputFile, uint32_t jobs);
+
+// Streams a raw image to the sink, which must stay valid until finish_image_output() returns.
+void init_sink_image_output(IMAGE_OUTPUT *output, const IMAGE_SINK *sink);
+
+// Writes data that must read back exactly. In sparse mode all-zero blocks are left as holes.
+void write_output_region(IMAGE_OUTPUT *output, uint64_t offset, const void *buffer, uint64_t size);
+
+// Marks a region that holds no data. In sparse mode it is seeked over, otherwise it is zero filled.
+void skip_output_region(IMAGE_OUTPUT *output, uint64_t offset, uint64_t size);
+
+// Copies file data straight from the input descriptor, returns the number of bytes copied which is short only at end of file.
+uint64_t copy_output_region(IMAGE_OUTPUT *output, uint64_t offset, int input_descriptor, uint64_t input_offset, uint64_t size);
+
+// Reads back part of an existing raw image, a short read means the image is truncated and is fatal. Not available when streaming.
+void read_output_region(IMAGE_OUTPUT *output, uint64_t offset, void *buffer, uint64_t size);
+
+void finish_image_output(IMAGE_OUTPUT *output, uint64_t image_size);
+
+#endif /* _IMAGE_OUTPUT_H_ */
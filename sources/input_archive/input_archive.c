@@ -0,0 +1,673 @@
+#include "input_archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ARCHIVE_BUFFER_SIZE (1024 * 1024)
+#define TAR_BLOCK_SIZE 512
+#define CPIO_HEADER_SIZE 110
+#define CPIO_ALIGNMENT 4
+#define CPIO_TRAILER "TRAILER!!!"
+
+typedef struct _TAR_HEADER
+{
+    char Name[100];
+    char Mode[8];
+    char Uid[8];
+    char Gid[8];
+    char Size[12];
+    char ModificationTime[12];
+    char Checksum[8];
+    char TypeFlag;
+    char LinkName[100];
+    char Magic[6];
+    char Version[2];
+    char UserName[32];
+    char GroupName[32];
+    char DeviceMajor[8];
+    char DeviceMinor[8];
+    char Prefix[155];
+    char Padding[12];
+} __attribute__((packed)) TAR_HEADER;
+
+// GNU long names and pax headers apply to the member that follows them.
+typedef struct _TAR_OVERRIDES
+{
+    char *Path;
+    char *LinkPath;
+    bool HasSize;
+    uint64_t Size;
+    bool HasModificationTime;
+    time_t ModificationTime;
+} TAR_OVERRIDES;
+
+// Member data of a seekable archive is skipped and read later at its offset, a pipe is copied into Spool instead.
+typedef struct _ARCHIVE_READER
+{
+    const char *Path;
+    int Descriptor;
+    int Spool;
+    uint64_t SpoolSize;
+    // Archive offset of Buffer[0].
+    uint64_t Position;
+    uint8_t *Buffer;
+    uint32_t BufferStart;
+    uint32_t BufferEnd;
+} ARCHIVE_READER;
+
+// Hard links of a cpio archive share an inode and only the last one carries the data.
+typedef struct _CPIO_LINK
+{
+    uint32_t Inode;
+    char *Path;
+} CPIO_LINK;
+
+static void _scan_tar(ARCHIVE_READER *reader, INPUT_NODE *root);
+static bool _read_tar_header(ARCHIVE_READER *reader, TAR_HEADER *header);
+static bool _is_tar_header(const TAR_HEADER *header);
+static bool _is_zero_block(const uint8_t *block);
+static uint64_t _parse_tar_number(const char *field, size_t size);
+static char *_read_tar_string(ARCHIVE_READER *reader, uint64_t size);
+static void _read_pax_header(ARCHIVE_READER *reader, uint64_t size, TAR_OVERRIDES *overrides);
+static char *_get_tar_name(const TAR_HEADER *header, TAR_OVERRIDES *overrides);
+static void _scan_cpio(ARCHIVE_READER *reader, INPUT_NODE *root);
+static void _link_file(INPUT_NODE *root, const char *path, const INPUT_NODE *target);
+static void _add_archive_file(ARCHIVE_READER *reader, INPUT_NODE *root, const char *path, uint64_t size, time_t modificationTime);
+static const uint8_t *_peek_archive(ARCHIVE_READER *reader, uint32_t size);
+static void _read_archive(ARCHIVE_READER *reader, void *buffer, uint64_t size);
+static void _skip_archive(ARCHIVE_READER *reader, uint64_t size);
+static uint64_t _take_archive_data(ARCHIVE_READER *reader, uint64_t size);
+static uint32_t _fill_archive(ARCHIVE_READER *reader);
+
+bool is_input_archive(const char *inputPath)
+{
+    struct stat input_status;
+
+    return 0 == strcmp(inputPath, "-") || (0 == stat(inputPath, &input_status) && !S_ISDIR(input_status.st_mode));
+}
+
+INPUT_NODE *scan_input_archive(const char *inputPath)
+{
+    bool is_standard_input = 0 == strcmp(inputPath, "-");
+    ARCHIVE_READER reader = {
+        .Path = is_standard_input ? "standard input" : inputPath,
+        .Descriptor = is_standard_input ? STDIN_FILENO : open(inputPath, O_RDONLY),
+        .Spool = -1,
+        .Buffer = malloc(ARCHIVE_BUFFER_SIZE),
+    };
+    if (reader.Descriptor < 0)
+    {
+        fprintf(stderr, "Can not open archive %s\n", reader.Path);
+        exit(1);
+    }
+    if (NULL == reader.Buffer)
+    {
+        perror("Error allocating archive buffer");
+        exit(1);
+    }
+
+    // Standard input redirected from a file is seekable too, its archive starts wherever the file position is.
+    off_t start = lseek(reader.Descriptor, 0, SEEK_CUR);
+    if ((off_t)-1 == start)
+    {
+        reader.Spool = memfd_create("image_creator_archive", MFD_CLOEXEC);
+        if (reader.Spool < 0)
+        {
+            perror("Error creating archive spool");
+            exit(1);
+        }
+    }
+    reader.Position = (off_t)-1 == start ? 0 : start;
+
+    INPUT_NODE *root = create_input_tree();
+    free(root->Path);
+    root->Path = strdup(reader.Path);
+
+    const uint8_t *magic = _peek_archive(&reader, CPIO_HEADER_SIZE);
+    if (NULL != magic && (0 == memcmp(magic, "070701", 6) || 0 == memcmp(magic, "070702", 6)))
+    {
+        _scan_cpio(&reader, root);
+    }
+    else
+    {
+        // An empty tar archive is only its end of archive blocks.
+        magic = _peek_archive(&reader, TAR_BLOCK_SIZE);
+        if (NULL == magic || (!_is_zero_block(magic) && !_is_tar_header((const TAR_HEADER *)magic)))
+        {
+            fprintf(stderr, "%s is not a tar or cpio archive\n", reader.Path);
+            exit(1);
+        }
+        _scan_tar(&reader, root);
+    }
+
+    // The root holds the descriptor the files are read from, free_input_tree() closes it.
+    root->Source = INPUT_SOURCE_DESCRIPTOR;
+    root->Descriptor = reader.Descriptor;
+    if (reader.Spool >= 0)
+    {
+        root->Descriptor = reader.Spool;
+        if (!is_standard_input)
+        {
+            close(reader.Descriptor);
+        }
+    }
+
+    free(reader.Buffer);
+    return root;
+}
+
+static void _scan_tar(ARCHIVE_READER *reader, INPUT_NODE *root)
+{
+    TAR_OVERRIDES overrides = {0};
+    TAR_HEADER header;
+
+    while (_read_tar_header(reader, &header))
+    {
+        uint64_t size = _parse_tar_number(header.Size, sizeof(header.Size));
+        uint64_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+        if ('L' == header.TypeFlag || 'K' == header.TypeFlag)
+        {
+            char **name = 'L' == header.TypeFlag ? &overrides.Path : &overrides.LinkPath;
+            free(*name);
+            *name = _read_tar_string(reader, size);
+            _skip_archive(reader, padding);
+            continue;
+        }
+        if ('x' == header.TypeFlag)
+        {
+            _read_pax_header(reader, size, &overrides);
+            _skip_archive(reader, padding);
+            continue;
+        }
+        if ('g' == header.TypeFlag)
+        {
+            _skip_archive(reader, size + padding);
+            continue;
+        }
+
+        char *name = _get_tar_name(&header, &overrides);
+        time_t modification_time = (time_t)_parse_tar_number(header.ModificationTime, sizeof(header.ModificationTime));
+        if (overrides.HasSize)
+        {
+            size = overrides.Size;
+            padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        }
+        if (overrides.HasModificationTime)
+        {
+            modification_time = overrides.ModificationTime;
+        }
+
+        // Old archives mark directories with a trailing slash only.
+        size_t name_length = strlen(name);
+        bool is_directory = '5' == header.TypeFlag || (('0' == header.TypeFlag || '\0' == header.TypeFlag) && name_length > 0 && '/' == name[name_length - 1]);
+
+        if (is_directory)
+        {
+            add_input_node(root, name, true);
+            _skip_archive(reader, size);
+        }
+        else if ('0' == header.TypeFlag || '\0' == header.TypeFlag || '7' == header.TypeFlag)
+        {
+            _add_archive_file(reader, root, name, size, modification_time);
+        }
+        else if ('1' == header.TypeFlag)
+        {
+            char *target = NULL != overrides.LinkPath ? strdup(overrides.LinkPath) : strndup(header.LinkName, sizeof(header.LinkName));
+            const INPUT_NODE *target_node = find_input_node(root, target);
+            if (NULL == target_node || target_node->IsDirectory)
+            {
+                fprintf(stderr, "Skipped file: %s links to %s which is not in the archive\n", name, target);
+            }
+            else
+            {
+                _link_file(root, name, target_node);
+            }
+            free(target);
+            _skip_archive(reader, size);
+        }
+        else
+        {
+            fprintf(stderr, "Skipped file: %s file type unkown\n", name);
+            _skip_archive(reader, size);
+        }
+
+        _skip_archive(reader, padding);
+        free(name);
+        free(overrides.Path);
+        free(overrides.LinkPath);
+        memset(&overrides, 0, sizeof(overrides));
+    }
+
+    free(overrides.Path);
+    free(overrides.LinkPath);
+}
+
+// The archive ends at the first zero block, or at the end of the input when an archiver left the zero blocks out.
+static bool _read_tar_header(ARCHIVE_READER *reader, TAR_HEADER *header)
+{
+    const uint8_t *block = _peek_archive(reader, TAR_BLOCK_SIZE);
+    if (NULL == block || _is_zero_block(block))
+    {
+        return false;
+    }
+
+    memcpy(header, block, sizeof(*header));
+    _skip_archive(reader, TAR_BLOCK_SIZE);
+
+    if (!_is_tar_header(header))
+    {
+        fprintf(stderr, "Invalid tar header in %s\n", reader->Path);
+        exit(1);
+    }
+
+    return true;
+}
+
+// The checksum adds up the header bytes with the checksum field taken as spaces. Some old archivers summed signed bytes.
+static bool _is_tar_header(const TAR_HEADER *header)
+{
+    const uint8_t *bytes = (const uint8_t *)header;
+    uint64_t unsigned_sum = 0;
+    int64_t signed_sum = 0;
+
+    for (size_t i = 0; i < sizeof(*header); ++i)
+    {
+        bool is_checksum = i >= offsetof(TAR_HEADER, Checksum) && i < offsetof(TAR_HEADER, Checksum) + sizeof(header->Checksum);
+        unsigned_sum += is_checksum ? ' ' : bytes[i];
+        signed_sum += is_checksum ? ' ' : (int8_t)bytes[i];
+    }
+
+    uint64_t checksum = _parse_tar_number(header->Checksum, sizeof(header->Checksum));
+    return checksum == unsigned_sum || (int64_t)checksum == signed_sum;
+}
+
+// Marks the end of a tar archive.
+static bool _is_zero_block(const uint8_t *block)
+{
+    return 0 == block[0] && 0 == memcmp(block, block + 1, TAR_BLOCK_SIZE - 1);
+}
+
+// Octal, or big endian binary with the high bit of the first byte set for values that do not fit.
+static uint64_t _parse_tar_number(const char *field, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)field;
+    uint64_t value = 0;
+
+    if (bytes[0] & 0x80)
+    {
+        value = bytes[0] & 0x7F;
+        for (size_t i = 1; i < size; ++i)
+        {
+            value = value << 8 | bytes[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < size && (' ' == field[i] || '\0' == field[i]))
+    {
+        i++;
+    }
+    while (i < size && field[i] >= '0' && field[i] <= '7')
+    {
+        value = value << 3 | (uint64_t)(field[i++] - '0');
+    }
+
+    return value;
+}
+
+static char *_read_tar_string(ARCHIVE_READER *reader, uint64_t size)
+{
+    char *string = malloc(size + 1);
+    if (NULL == string)
+    {
+        perror("Error allocating archive name");
+        exit(1);
+    }
+
+    _read_archive(reader, string, size);
+    string[size] = '\0';
+
+    return string;
+}
+
+// Records are "length key=value\n", only the keys that change how a member is added are used.
+static void _read_pax_header(ARCHIVE_READER *reader, uint64_t size, TAR_OVERRIDES *overrides)
+{
+    char *records = _read_tar_string(reader, size);
+    char *record = records;
+
+    while (record < records + size)
+    {
+        char *end = NULL;
+        unsigned long long length = strtoull(record, &end, 10);
+        char *key = end + 1;
+        // The length is untrusted, the record has to fit in what is left before it is searched.
+        bool is_valid = ' ' == *end && 0 != length && length <= (uint64_t)(records + size - record) && key < record + length;
+        char *separator = is_valid ? memchr(key, '=', record + length - key) : NULL;
+        if (NULL == separator)
+        {
+            fprintf(stderr, "Invalid pax header in %s\n", reader->Path);
+            exit(1);
+        }
+
+        *separator = '\0';
+        record[length - 1] = '\0';
+        char *value = separator + 1;
+
+        if (0 == strcmp(key, "path"))
+        {
+            free(overrides->Path);
+            overrides->Path = strdup(value);
+        }
+        else if (0 == strcmp(key, "linkpath"))
+        {
+            free(overrides->LinkPath);
+            overrides->LinkPath = strdup(value);
+        }
+        else if (0 == strcmp(key, "size"))
+        {
+            overrides->HasSize = true;
+            overrides->Size = strtoull(value, NULL, 10);
+        }
+        else if (0 == strcmp(key, "mtime"))
+        {
+            overrides->HasModificationTime = true;
+            overrides->ModificationTime = (time_t)strtoll(value, NULL, 10);
+        }
+
+        record += length;
+    }
+
+    free(records);
+}
+
+static char *_get_tar_name(const TAR_HEADER *header, TAR_OVERRIDES *overrides)
+{
+    if (NULL != overrides->Path)
+    {
+        return strdup(overrides->Path);
+    }
+
+    char *name = malloc(sizeof(header->Prefix) + sizeof(header->Name) + 2);
+    if (NULL == name)
+    {
+        perror("Error allocating archive name");
+        exit(1);
+    }
+
+    size_t length = 0;
+    if (0 == memcmp(header->Magic, "ustar", 5) && '\0' != header->Prefix[0])
+    {
+        length = strnlen(header->Prefix, sizeof(header->Prefix));
+        memcpy(name, header->Prefix, length);
+        name[length++] = '/';
+    }
+    size_t name_length = strnlen(header->Name, sizeof(header->Name));
+    memcpy(name + length, header->Name, name_length);
+    name[length + name_length] = '\0';
+
+    return name;
+}
+
+static void _scan_cpio(ARCHIVE_READER *reader, INPUT_NODE *root)
+{
+    CPIO_LINK *links = NULL;
+    uint32_t link_count = 0;
+
+    while (true)
+    {
+        char header[CPIO_HEADER_SIZE + 1] = {0};
+        _read_archive(reader, header, CPIO_HEADER_SIZE);
+        if (0 != memcmp(header, "070701", 6) && 0 != memcmp(header, "070702", 6))
+        {
+            fprintf(stderr, "Invalid cpio header in %s\n", reader->Path);
+            exit(1);
+        }
+
+        // Inode, mode, uid, gid, link count, mtime, file size, 4 device numbers, name size and checksum as 8 hex digits each.
+        uint32_t fields[13];
+        for (uint32_t i = 0; i < 13; ++i)
+        {
+            char digits[9] = {0};
+            memcpy(digits, header + 6 + 8 * i, 8);
+            fields[i] = (uint32_t)strtoul(digits, NULL, 16);
+        }
+        uint32_t inode = fields[0];
+        uint32_t mode = fields[1];
+        uint32_t link_total = fields[4];
+        time_t modification_time = fields[5];
+        uint64_t size = fields[6];
+        uint32_t name_size = fields[11];
+
+        char *name = _read_tar_string(reader, name_size);
+        _skip_archive(reader, (CPIO_ALIGNMENT - (CPIO_HEADER_SIZE + name_size) % CPIO_ALIGNMENT) % CPIO_ALIGNMENT);
+        uint64_t padding = (CPIO_ALIGNMENT - size % CPIO_ALIGNMENT) % CPIO_ALIGNMENT;
+
+        if (0 == strcmp(name, CPIO_TRAILER))
+        {
+            free(name);
+            break;
+        }
+
+        if (S_ISDIR(mode))
+        {
+            add_input_node(root, name, true);
+            _skip_archive(reader, size);
+        }
+        else if (S_ISREG(mode) && link_total > 1 && 0 == size)
+        {
+            // Takes the data once the last link arrives, stays empty if none of them has any.
+            _add_archive_file(reader, root, name, 0, modification_time);
+            links = realloc(links, (link_count + 1) * sizeof(*links));
+            if (NULL == links)
+            {
+                perror("Error allocating hard links");
+                exit(1);
+            }
+            links[link_count++] = (CPIO_LINK){.Inode = inode, .Path = strdup(name)};
+        }
+        else if (S_ISREG(mode))
+        {
+            _add_archive_file(reader, root, name, size, modification_time);
+
+            INPUT_NODE *file = find_input_node(root, name);
+            for (uint32_t i = 0; i < link_count && link_total > 1; ++i)
+            {
+                if (links[i].Inode == inode)
+                {
+                    _link_file(root, links[i].Path, file);
+                }
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Skipped file: %s file type unkown\n", name);
+            _skip_archive(reader, size);
+        }
+
+        _skip_archive(reader, padding);
+        free(name);
+    }
+
+    for (uint32_t i = 0; i < link_count; ++i)
+    {
+        free(links[i].Path);
+    }
+    free(links);
+}
+
+// The link shares the data of its target inside the archive.
+static void _link_file(INPUT_NODE *root, const char *path, const INPUT_NODE *target)
+{
+    // Adding a node may move the target, so it is copied first.
+    INPUT_NODE source = *target;
+    INPUT_NODE *file = add_input_node(root, path, false);
+
+    file->Size = source.Size;
+    file->ModificationTime = source.ModificationTime;
+    file->Source = source.Source;
+    file->Descriptor = source.Descriptor;
+    file->SourceOffset = source.SourceOffset;
+}
+
+static void _add_archive_file(ARCHIVE_READER *reader, INPUT_NODE *root, const char *path, uint64_t size, time_t modificationTime)
+{
+    uint64_t offset = _take_archive_data(reader, size);
+
+    INPUT_NODE *file = add_input_node(root, path, false);
+    file->Size = size;
+    file->ModificationTime = modificationTime;
+    file->Source = INPUT_SOURCE_DESCRIPTOR;
+    file->Descriptor = reader->Spool >= 0 ? reader->Spool : reader->Descriptor;
+    file->SourceOffset = offset;
+}
+
+// Returns the next size bytes without consuming them, NULL if the archive ends before.
+static const uint8_t *_peek_archive(ARCHIVE_READER *reader, uint32_t size)
+{
+    while (reader->BufferEnd - reader->BufferStart < size)
+    {
+        if (0 == _fill_archive(reader))
+        {
+            return NULL;
+        }
+    }
+
+    return reader->Buffer + reader->BufferStart;
+}
+
+static void _read_archive(ARCHIVE_READER *reader, void *buffer, uint64_t size)
+{
+    uint8_t *data = buffer;
+
+    while (size > 0)
+    {
+        if (reader->BufferStart == reader->BufferEnd && 0 == _fill_archive(reader))
+        {
+            fprintf(stderr, "Archive %s is truncated\n", reader->Path);
+            exit(1);
+        }
+
+        uint32_t available = reader->BufferEnd - reader->BufferStart;
+        uint32_t chunk = size < available ? size : available;
+        memcpy(data, reader->Buffer + reader->BufferStart, chunk);
+        reader->BufferStart += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+// A seekable archive seeks over everything that is not buffered yet.
+static void _skip_archive(ARCHIVE_READER *reader, uint64_t size)
+{
+    uint32_t available = reader->BufferEnd - reader->BufferStart;
+    if (size <= available)
+    {
+        reader->BufferStart += size;
+        return;
+    }
+
+    if (reader->Spool < 0)
+    {
+        size -= available;
+        if ((off_t)-1 == lseek(reader->Descriptor, size, SEEK_CUR))
+        {
+            perror("Error seeking archive");
+            exit(1);
+        }
+        reader->Position += reader->BufferEnd + size;
+        reader->BufferStart = 0;
+        reader->BufferEnd = 0;
+        return;
+    }
+
+    while (size > 0)
+    {
+        if (reader->BufferStart == reader->BufferEnd && 0 == _fill_archive(reader))
+        {
+            fprintf(stderr, "Archive %s is truncated\n", reader->Path);
+            exit(1);
+        }
+
+        available = reader->BufferEnd - reader->BufferStart;
+        uint32_t chunk = size < available ? size : available;
+        reader->BufferStart += chunk;
+        size -= chunk;
+    }
+}
+
+// Returns the offset the member data can be read at later, in the archive itself or in the spool.
+static uint64_t _take_archive_data(ARCHIVE_READER *reader, uint64_t size)
+{
+    if (reader->Spool < 0)
+    {
+        uint64_t offset = reader->Position + reader->BufferStart;
+        _skip_archive(reader, size);
+        return offset;
+    }
+
+    uint64_t offset = reader->SpoolSize;
+    while (size > 0)
+    {
+        if (reader->BufferStart == reader->BufferEnd && 0 == _fill_archive(reader))
+        {
+            fprintf(stderr, "Archive %s is truncated\n", reader->Path);
+            exit(1);
+        }
+
+        uint32_t available = reader->BufferEnd - reader->BufferStart;
+        uint32_t chunk = size < available ? size : available;
+        ssize_t written = write(reader->Spool, reader->Buffer + reader->BufferStart, chunk);
+        if (written < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            perror("Error spooling archive");
+            exit(1);
+        }
+
+        reader->BufferStart += written;
+        reader->SpoolSize += written;
+        size -= written;
+    }
+
+    return offset;
+}
+
+// Moves what is left to the front of the buffer and reads more behind it. Returns the bytes read, 0 at the end of the archive.
+static uint32_t _fill_archive(ARCHIVE_READER *reader)
+{
+    reader->Position += reader->BufferStart;
+    memmove(reader->Buffer, reader->Buffer + reader->BufferStart, reader->BufferEnd - reader->BufferStart);
+    reader->BufferEnd -= reader->BufferStart;
+    reader->BufferStart = 0;
+
+    while (true)
+    {
+        ssize_t result = read(reader->Descriptor, reader->Buffer + reader->BufferEnd, ARCHIVE_BUFFER_SIZE - reader->BufferEnd);
+        if (result < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            fprintf(stderr, "Error reading archive %s\n", reader->Path);
+            exit(1);
+        }
+
+        reader->BufferEnd += result;
+        return (uint32_t)result;
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef _INPUT_ARCHIVE_H_
+#define _INPUT_ARCHIVE_H_
+
+#include <stdbool.h>
+
+#include "input_scan.h"
+
+// Anything that is not a directory is taken as an archive, - is standard input.
+bool is_input_archive(const char *inputPath);
+
+// Reads a tar (ustar, GNU or pax) or cpio (newc) archive in a single pass and returns its tree. Nothing is extracted: the files
+// point at their data inside the archive, a pipe is copied into an anonymous memory file on the way since it can not be read twice.
+// Links other than hard links and special files are skipped.
+INPUT_NODE *scan_input_archive(const char *inputPath);
+
+#endif /* _INPUT_ARCHIVE_H_ */
@@ -0,0 +1,377 @@
+#include "input_cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SLOT_COUNT 1024
+
+typedef struct _CACHE_ENTRY
+{
+    uint64_t Device;
+    uint64_t Inode;
+    // The first node seen for the file, the file is read through it.
+    const INPUT_NODE *File;
+    uint32_t Uses;
+    // Uses that are not released yet, Data is freed when they drop to 0.
+    atomic_uint References;
+    uint8_t *Data;
+} CACHE_ENTRY;
+
+struct _INPUT_CACHE
+{
+    uint64_t Capacity;
+    CACHE_ENTRY *Entries;
+    uint32_t EntryCount;
+    uint32_t EntryCapacity;
+    // Open addressing, a slot holds an entry index plus one or 0 when it is empty.
+    uint32_t *Slots;
+    uint32_t SlotCount;
+    INPUT_NODE **Trees;
+    uint32_t TreeCount;
+};
+
+typedef struct _CACHE_LOADER
+{
+    CACHE_ENTRY **Entries;
+    uint32_t EntryCount;
+    atomic_uint NextEntry;
+} CACHE_LOADER;
+
+static void _count_files(INPUT_CACHE *cache, const INPUT_NODE *directory);
+static void _point_at_cache(INPUT_CACHE *cache, INPUT_NODE *directory);
+static void _release_files(INPUT_CACHE *cache, const INPUT_NODE *directory);
+static CACHE_ENTRY *_find_entry(INPUT_CACHE *cache, const INPUT_NODE *file, bool create);
+static void _grow_slots(INPUT_CACHE *cache);
+static uint32_t _hash_file(uint64_t device, uint64_t inode);
+static void *_run_cache_loader(void *argument);
+static int _compare_entries(const void *first, const void *second);
+
+INPUT_CACHE *create_input_cache(uint64_t capacity)
+{
+    INPUT_CACHE *cache = calloc(1, sizeof(*cache));
+    uint32_t *slots = calloc(INITIAL_SLOT_COUNT, sizeof(*slots));
+    if (NULL == cache || NULL == slots)
+    {
+        perror("Error allocating input cache");
+        exit(1);
+    }
+
+    cache->Capacity = capacity;
+    cache->Slots = slots;
+    cache->SlotCount = INITIAL_SLOT_COUNT;
+
+    return cache;
+}
+
+void add_input_cache_tree(INPUT_CACHE *cache, INPUT_NODE *root)
+{
+    bool known = false;
+    for (uint32_t i = 0; i < cache->TreeCount && !known; ++i)
+    {
+        known = cache->Trees[i] == root;
+    }
+
+    if (!known)
+    {
+        INPUT_NODE **trees = realloc(cache->Trees, (cache->TreeCount + 1) * sizeof(*trees));
+        if (NULL == trees)
+        {
+            perror("Error allocating input cache");
+            exit(1);
+        }
+        trees[cache->TreeCount++] = root;
+        cache->Trees = trees;
+    }
+
+    _count_files(cache, root);
+}
+
+uint64_t load_input_cache(INPUT_CACHE *cache, uint32_t jobs)
+{
+    CACHE_LOADER loader = {
+        .Entries = calloc(cache->EntryCount + 1, sizeof(CACHE_ENTRY *)),
+        .EntryCount = 0,
+    };
+    if (NULL == loader.Entries)
+    {
+        perror("Error allocating input cache");
+        exit(1);
+    }
+    atomic_init(&loader.NextEntry, 0);
+
+    for (uint32_t i = 0; i < cache->EntryCount; ++i)
+    {
+        atomic_init(&cache->Entries[i].References, cache->Entries[i].Uses);
+        if (cache->Entries[i].Uses > 1 && 0 != cache->Entries[i].File->Size)
+        {
+            loader.Entries[loader.EntryCount++] = &cache->Entries[i];
+        }
+    }
+
+    // Every further use of a cached byte saves one read, so the files with the most uses get the space first.
+    if (0 != loader.EntryCount)
+    {
+        qsort(loader.Entries, loader.EntryCount, sizeof(*loader.Entries), _compare_entries);
+    }
+
+    uint64_t cached_size = 0;
+    uint32_t selected_count = 0;
+    for (uint32_t i = 0; i < loader.EntryCount; ++i)
+    {
+        uint64_t size = loader.Entries[i]->File->Size;
+        if (size <= cache->Capacity - cached_size)
+        {
+            cached_size += size;
+            loader.Entries[selected_count++] = loader.Entries[i];
+        }
+    }
+    loader.EntryCount = selected_count;
+
+    if (0 == jobs)
+    {
+        jobs = 1;
+    }
+
+    // The calling thread is loader 0.
+    pthread_t *threads = calloc(jobs, sizeof(*threads));
+    if (NULL == threads)
+    {
+        perror("Error allocating cache loaders");
+        exit(1);
+    }
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        if (0 != pthread_create(&threads[i], NULL, _run_cache_loader, &loader))
+        {
+            perror("Error creating cache loader");
+            exit(1);
+        }
+    }
+
+    _run_cache_loader(&loader);
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(loader.Entries);
+
+    for (uint32_t i = 0; i < cache->TreeCount; ++i)
+    {
+        _point_at_cache(cache, cache->Trees[i]);
+    }
+
+    return cached_size;
+}
+
+void release_input_cache_tree(INPUT_CACHE *cache, const INPUT_NODE *root)
+{
+    _release_files(cache, root);
+}
+
+void free_input_cache(INPUT_CACHE *cache)
+{
+    for (uint32_t i = 0; i < cache->EntryCount; ++i)
+    {
+        if (0 != atomic_load(&cache->Entries[i].References))
+        {
+            free(cache->Entries[i].Data);
+        }
+    }
+
+    free(cache->Trees);
+    free(cache->Slots);
+    free(cache->Entries);
+    free(cache);
+}
+
+// Only scanned files know their inode, every other node is left alone.
+static void _count_files(INPUT_CACHE *cache, const INPUT_NODE *directory)
+{
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        const INPUT_NODE *child = &directory->Children[i];
+        if (child->IsDirectory)
+        {
+            _count_files(cache, child);
+        }
+        else if (0 != child->Inode)
+        {
+            _find_entry(cache, child, true)->Uses++;
+        }
+    }
+}
+
+// A file that changed size between two scans is not the file that was read, it keeps its path.
+static void _point_at_cache(INPUT_CACHE *cache, INPUT_NODE *directory)
+{
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        INPUT_NODE *child = &directory->Children[i];
+        if (child->IsDirectory)
+        {
+            _point_at_cache(cache, child);
+            continue;
+        }
+
+        CACHE_ENTRY *entry = 0 != child->Inode ? _find_entry(cache, child, false) : NULL;
+        if (NULL != entry && NULL != entry->Data && INPUT_SOURCE_PATH == child->Source && entry->File->Size == child->Size)
+        {
+            child->Source = INPUT_SOURCE_MEMORY;
+            child->Buffer = entry->Data;
+        }
+    }
+}
+
+static void _release_files(INPUT_CACHE *cache, const INPUT_NODE *directory)
+{
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        const INPUT_NODE *child = &directory->Children[i];
+        if (child->IsDirectory)
+        {
+            _release_files(cache, child);
+            continue;
+        }
+
+        CACHE_ENTRY *entry = 0 != child->Inode ? _find_entry(cache, child, false) : NULL;
+        if (NULL != entry && NULL != entry->Data && 1 == atomic_fetch_sub(&entry->References, 1))
+        {
+            free(entry->Data);
+        }
+    }
+}
+
+// Lookups without create only read the table, so they can run on any number of threads once the trees are added.
+static CACHE_ENTRY *_find_entry(INPUT_CACHE *cache, const INPUT_NODE *file, bool create)
+{
+    uint32_t slot = _hash_file(file->Device, file->Inode) & (cache->SlotCount - 1);
+    while (0 != cache->Slots[slot])
+    {
+        CACHE_ENTRY *entry = &cache->Entries[cache->Slots[slot] - 1];
+        if (entry->Device == file->Device && entry->Inode == file->Inode)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (cache->SlotCount - 1);
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    if (cache->EntryCount == cache->EntryCapacity)
+    {
+        cache->EntryCapacity = cache->EntryCapacity ? cache->EntryCapacity * 2 : 256;
+        cache->Entries = realloc(cache->Entries, cache->EntryCapacity * sizeof(*cache->Entries));
+        if (NULL == cache->Entries)
+        {
+            perror("Error allocating input cache");
+            exit(1);
+        }
+    }
+
+    CACHE_ENTRY *entry = &cache->Entries[cache->EntryCount++];
+    memset(entry, 0, sizeof(*entry));
+    entry->Device = file->Device;
+    entry->Inode = file->Inode;
+    entry->File = file;
+    cache->Slots[slot] = cache->EntryCount;
+
+    // Kept at most half full, so probes stay short and always end at an empty slot.
+    if (cache->EntryCount * 2 > cache->SlotCount)
+    {
+        _grow_slots(cache);
+    }
+
+    return entry;
+}
+
+static void _grow_slots(INPUT_CACHE *cache)
+{
+    uint32_t slot_count = cache->SlotCount * 2;
+    uint32_t *slots = calloc(slot_count, sizeof(*slots));
+    if (NULL == slots)
+    {
+        perror("Error allocating input cache");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < cache->EntryCount; ++i)
+    {
+        uint32_t slot = _hash_file(cache->Entries[i].Device, cache->Entries[i].Inode) & (slot_count - 1);
+        while (0 != slots[slot])
+        {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    free(cache->Slots);
+    cache->Slots = slots;
+    cache->SlotCount = slot_count;
+}
+
+// Inodes of one directory are often consecutive, the finalizer of MurmurHash3 spreads them over the table.
+static uint32_t _hash_file(uint64_t device, uint64_t inode)
+{
+    uint64_t hash = inode ^ (device * 0x9E3779B97F4A7C15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+
+    return (uint32_t)hash;
+}
+
+static void *_run_cache_loader(void *argument)
+{
+    CACHE_LOADER *loader = argument;
+    uint32_t index;
+
+    while ((index = atomic_fetch_add(&loader->NextEntry, 1)) < loader->EntryCount)
+    {
+        CACHE_ENTRY *entry = loader->Entries[index];
+        const INPUT_NODE *file = entry->File;
+
+        uint8_t *data = malloc(file->Size);
+        if (NULL == data)
+        {
+            perror("Error allocating input cache");
+            exit(1);
+        }
+
+        int descriptor = open_input_file(file);
+        uint64_t copied = read_input_file(file, descriptor, 0, data, file->Size);
+        close_input_file(file, descriptor);
+
+        // Like a file that shrinks while it is copied, the missing end reads as zeros.
+        if (copied < file->Size)
+        {
+            fprintf(stderr, "File %s shrank while building the image\n", file->Path);
+            memset(data + copied, 0, file->Size - copied);
+        }
+
+        entry->Data = data;
+    }
+
+    return NULL;
+}
+
+static int _compare_entries(const void *first, const void *second)
+{
+    const CACHE_ENTRY *first_entry = *(CACHE_ENTRY *const *)first;
+    const CACHE_ENTRY *second_entry = *(CACHE_ENTRY *const *)second;
+
+    if (first_entry->Uses != second_entry->Uses)
+    {
+        return first_entry->Uses > second_entry->Uses ? -1 : 1;
+    }
+
+    return (first_entry->File->Size > second_entry->File->Size) - (first_entry->File->Size < second_entry->File->Size);
+}
@@ -0,0 +1,29 @@
+#ifndef _INPUT_CACHE_H_
+#define _INPUT_CACHE_H_
+
+#include <stdint.h>
+
+#include "input_scan.h"
+
+// Holds the contents of files that several input trees share, so they are read once for all images built from the trees.
+// A file is known by the device and inode it was scanned from, files from archives or the builder API are never cached.
+typedef struct _INPUT_CACHE INPUT_CACHE;
+
+// At most capacity bytes are kept, the files that are left out are read by every image as usual.
+INPUT_CACHE *create_input_cache(uint64_t capacity);
+
+// Counts the files of one more image. A tree used by several images, or twice by the same image, is added every time.
+void add_input_cache_tree(INPUT_CACHE *cache, INPUT_NODE *root);
+
+// Reads every file counted more than once with jobs threads, the files used most often first, and turns their nodes
+// in all added trees into memory files. Returns the number of bytes read into the cache.
+uint64_t load_input_cache(INPUT_CACHE *cache, uint32_t jobs);
+
+// Drops one count of every cached file of the tree, a file is freed when its last image is done with it.
+// Thread safe, the nodes of a file must not be read after its last release.
+void release_input_cache_tree(INPUT_CACHE *cache, const INPUT_NODE *root);
+
+// The trees keep pointing at freed memory for files that were never released.
+void free_input_cache(INPUT_CACHE *cache);
+
+#endif /* _INPUT_CACHE_H_ */
@@ -0,0 +1,799 @@
+#include "input_scan.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define DT_UNKNOWN_TYPE 0
+#define DT_DIRECTORY 4
+#define DT_REGULAR_FILE 8
+
+#define STAT_BATCH_SIZE 64
+#define DIRECTORY_BUFFER_SIZE (256 * 1024)
+#define STATX_FILE_MASK (STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO)
+
+// An open directory, its children are opened and stat'd relative to it so no path is resolved twice.
+// Every task that still needs it holds a reference, the last one closes it.
+typedef struct _SCAN_DIRECTORY
+{
+    int Descriptor;
+    atomic_uint References;
+} SCAN_DIRECTORY;
+
+// A task either enumerates a directory (Count == 0) or stats Count of its children starting at First.
+// Directory is the open parent of the directory to enumerate, NULL for the root, or the open directory of the children to stat.
+typedef struct _SCAN_TASK
+{
+    INPUT_NODE *Node;
+    SCAN_DIRECTORY *Directory;
+    uint32_t First;
+    uint32_t Count;
+} SCAN_TASK;
+
+// Owners push and pop at the tail, idle workers steal from the head.
+typedef struct _SCAN_QUEUE
+{
+    pthread_mutex_t Lock;
+    SCAN_TASK *Tasks;
+    uint32_t Head;
+    uint32_t Length;
+    uint32_t Capacity;
+} SCAN_QUEUE;
+
+typedef struct _SCAN_POOL
+{
+    SCAN_QUEUE *Queues;
+    uint32_t WorkerCount;
+    atomic_uint_fast64_t Pending;
+    atomic_uint_fast64_t Queued;
+    atomic_uint Sleepers;
+    pthread_mutex_t IdleLock;
+    pthread_cond_t IdleCondition;
+} SCAN_POOL;
+
+typedef struct _SCAN_WORKER
+{
+    SCAN_POOL *Pool;
+    uint32_t Index;
+    // getdents64 returns as many entries as fit, so a large directory takes few calls.
+    uint8_t *Entries;
+} SCAN_WORKER;
+
+static void *_run_worker(void *argument);
+static void _run_task(SCAN_WORKER *worker, const SCAN_TASK *task);
+static void _scan_directory(SCAN_WORKER *worker, INPUT_NODE *directory, SCAN_DIRECTORY *parent);
+static void _add_scanned_entry(INPUT_NODE *directory, int descriptor, const struct dirent64 *entry, uint32_t *capacity);
+static void _stat_files(INPUT_NODE *directory, int descriptor, uint32_t first, uint32_t count);
+static void _set_file_status(INPUT_NODE *file, const struct statx *status);
+static void _release_directory(SCAN_DIRECTORY *directory);
+static int _open_long_path(const char *path);
+static void _push_task(SCAN_POOL *pool, uint32_t worker, SCAN_TASK task);
+static bool _pop_task(SCAN_QUEUE *queue, SCAN_TASK *task);
+static bool _steal_task(SCAN_QUEUE *queue, SCAN_TASK *task);
+static char *_join_path(const char *directoryPath, const char *name);
+static INPUT_NODE *_add_child(INPUT_NODE *directory, const char *name, size_t name_length, bool isDirectory);
+static INPUT_NODE *_find_child(INPUT_NODE *directory, const char *name, size_t name_length);
+static size_t _next_path_component(const char **path);
+static int _compare_nodes(const void *first, const void *second);
+static uint64_t _hash_bytes(uint64_t hash, const void *data, size_t size);
+static void _free_node(INPUT_NODE *node);
+
+INPUT_NODE *scan_input_directory(const char *inputDirectoryPath, uint32_t jobs)
+{
+    INPUT_NODE *root = calloc(1, sizeof(*root));
+    if (NULL == root)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+    root->Name = strdup("");
+    root->Path = strdup(inputDirectoryPath);
+    root->IsDirectory = true;
+
+    if (0 == jobs)
+    {
+        jobs = 1;
+    }
+
+    SCAN_POOL pool = {
+        .Queues = calloc(jobs, sizeof(SCAN_QUEUE)),
+        .WorkerCount = jobs,
+    };
+    if (NULL == pool.Queues)
+    {
+        perror("Error allocating scan queues");
+        exit(1);
+    }
+    atomic_init(&pool.Pending, 0);
+    atomic_init(&pool.Queued, 0);
+    atomic_init(&pool.Sleepers, 0);
+    pthread_mutex_init(&pool.IdleLock, NULL);
+    pthread_cond_init(&pool.IdleCondition, NULL);
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        pthread_mutex_init(&pool.Queues[i].Lock, NULL);
+    }
+
+    _push_task(&pool, 0, (SCAN_TASK){.Node = root, .Directory = NULL, .First = 0, .Count = 0});
+
+    // The calling thread is worker 0.
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    SCAN_WORKER *workers = calloc(jobs, sizeof(SCAN_WORKER));
+    if (NULL == threads || NULL == workers)
+    {
+        perror("Error allocating scan workers");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        workers[i].Pool = &pool;
+        workers[i].Index = i;
+        workers[i].Entries = malloc(DIRECTORY_BUFFER_SIZE);
+        if (NULL == workers[i].Entries)
+        {
+            perror("Error allocating scan workers");
+            exit(1);
+        }
+        if (i > 0 && 0 != pthread_create(&threads[i], NULL, _run_worker, &workers[i]))
+        {
+            perror("Error creating scan worker");
+            exit(1);
+        }
+    }
+
+    _run_worker(&workers[0]);
+
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        pthread_mutex_destroy(&pool.Queues[i].Lock);
+        free(pool.Queues[i].Tasks);
+        free(workers[i].Entries);
+    }
+    pthread_cond_destroy(&pool.IdleCondition);
+    pthread_mutex_destroy(&pool.IdleLock);
+    free(pool.Queues);
+    free(workers);
+    free(threads);
+
+    return root;
+}
+
+void sort_input_tree(INPUT_NODE *root)
+{
+    // Empty directories have no children array.
+    if (0 == root->ChildCount)
+    {
+        return;
+    }
+
+    qsort(root->Children, root->ChildCount, sizeof(*root->Children), _compare_nodes);
+
+    for (uint32_t i = 0; i < root->ChildCount; ++i)
+    {
+        if (root->Children[i].IsDirectory)
+        {
+            sort_input_tree(&root->Children[i]);
+        }
+    }
+}
+
+// FNV-1a, the child count and trailing zero of each name keep differently nested trees apart.
+uint64_t hash_input_tree(const INPUT_NODE *root)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint8_t is_directory = root->IsDirectory;
+
+    hash = _hash_bytes(hash, root->Name, strlen(root->Name) + 1);
+    hash = _hash_bytes(hash, &is_directory, sizeof(is_directory));
+    hash = _hash_bytes(hash, &root->Size, sizeof(root->Size));
+    hash = _hash_bytes(hash, &root->ChildCount, sizeof(root->ChildCount));
+
+    for (uint32_t i = 0; i < root->ChildCount; ++i)
+    {
+        uint64_t child_hash = hash_input_tree(&root->Children[i]);
+        hash = _hash_bytes(hash, &child_hash, sizeof(child_hash));
+    }
+
+    return hash;
+}
+
+void free_input_tree(INPUT_NODE *root)
+{
+    if (INPUT_SOURCE_DESCRIPTOR == root->Source)
+    {
+        close(root->Descriptor);
+    }
+
+    _free_node(root);
+    free(root);
+}
+
+INPUT_NODE *create_input_tree(void)
+{
+    INPUT_NODE *root = calloc(1, sizeof(*root));
+    if (NULL == root)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+    root->Name = strdup("");
+    root->Path = strdup("");
+    root->IsDirectory = true;
+
+    return root;
+}
+
+INPUT_NODE *add_input_node(INPUT_NODE *root, const char *path, bool isDirectory)
+{
+    const char *fullPath = path;
+    INPUT_NODE *node = root;
+    size_t name_length = 0;
+
+    while (0 != (name_length = _next_path_component(&path)))
+    {
+        const char *rest = path + name_length;
+        bool is_last = 0 == _next_path_component(&rest);
+        if (!node->IsDirectory)
+        {
+            break;
+        }
+
+        INPUT_NODE *child = _find_child(node, path, name_length);
+        if (NULL == child)
+        {
+            child = _add_child(node, path, name_length, is_last ? isDirectory : true);
+        }
+
+        node = child;
+        path += name_length;
+    }
+
+    if (node->IsDirectory != isDirectory || 0 != name_length)
+    {
+        fprintf(stderr, "Can not add %s, the name is already used\n", fullPath);
+        exit(1);
+    }
+
+    return node;
+}
+
+INPUT_NODE *find_input_node(INPUT_NODE *root, const char *path)
+{
+    INPUT_NODE *node = root;
+    size_t name_length = 0;
+
+    while (NULL != node && 0 != (name_length = _next_path_component(&path)))
+    {
+        node = node->IsDirectory ? _find_child(node, path, name_length) : NULL;
+        path += name_length;
+    }
+
+    return node;
+}
+
+void graft_input_tree(INPUT_NODE *directory, INPUT_NODE *tree)
+{
+    directory->Children = realloc(directory->Children, (directory->ChildCount + tree->ChildCount) * sizeof(*directory->Children));
+    if (NULL == directory->Children && 0 != directory->ChildCount + tree->ChildCount)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+
+    // Nodes are moved by value, their own children arrays do not move.
+    memcpy(directory->Children + directory->ChildCount, tree->Children, tree->ChildCount * sizeof(*tree->Children));
+    directory->ChildCount += tree->ChildCount;
+
+    tree->ChildCount = 0;
+    free_input_tree(tree);
+}
+
+int open_input_file(const INPUT_NODE *file)
+{
+    if (INPUT_SOURCE_DESCRIPTOR == file->Source)
+    {
+        return file->Descriptor;
+    }
+    if (INPUT_SOURCE_PATH != file->Source)
+    {
+        return -1;
+    }
+
+    int descriptor = open(file->Path, O_RDONLY);
+    if (descriptor < 0 && ENAMETOOLONG == errno)
+    {
+        descriptor = _open_long_path(file->Path);
+    }
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "Can not open file %s\n", file->Path);
+        exit(1);
+    }
+
+    return descriptor;
+}
+
+void close_input_file(const INPUT_NODE *file, int descriptor)
+{
+    // Descriptors handed in by the caller stay open.
+    if (INPUT_SOURCE_PATH == file->Source)
+    {
+        close(descriptor);
+    }
+}
+
+uint64_t read_input_file(const INPUT_NODE *file, int descriptor, uint64_t offset, void *buffer, uint64_t size)
+{
+    uint8_t *data = buffer;
+    uint64_t copied = 0;
+
+    if (INPUT_SOURCE_MEMORY == file->Source)
+    {
+        copied = offset < file->Size ? (file->Size - offset < size ? file->Size - offset : size) : 0;
+        if (copied > 0)
+        {
+            memcpy(data, (const uint8_t *)file->Buffer + offset, copied);
+        }
+        return copied;
+    }
+
+    while (copied < size)
+    {
+        int64_t result = 0;
+        if (INPUT_SOURCE_CALLBACK == file->Source)
+        {
+            uint64_t read = file->Read(file->ReadContext, offset + copied, data + copied, size - copied);
+            result = UINT64_MAX == read ? -1 : (int64_t)read;
+        }
+        else
+        {
+            result = pread(descriptor, data + copied, size - copied, file->SourceOffset + offset + copied);
+        }
+
+        if (result < 0 && INPUT_SOURCE_CALLBACK != file->Source && EINTR == errno)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            fprintf(stderr, "Error reading file %s\n", file->Path);
+            exit(1);
+        }
+        if (0 == result)
+        {
+            break;
+        }
+        copied += result;
+    }
+
+    return copied;
+}
+
+static void *_run_worker(void *argument)
+{
+    SCAN_WORKER *worker = argument;
+    SCAN_POOL *pool = worker->Pool;
+    SCAN_TASK task;
+
+    while (true)
+    {
+        bool found = _pop_task(&pool->Queues[worker->Index], &task);
+        for (uint32_t i = 1; !found && i < pool->WorkerCount; ++i)
+        {
+            found = _steal_task(&pool->Queues[(worker->Index + i) % pool->WorkerCount], &task);
+        }
+
+        if (found)
+        {
+            atomic_fetch_sub(&pool->Queued, 1);
+            _run_task(worker, &task);
+
+            if (1 == atomic_fetch_sub(&pool->Pending, 1))
+            {
+                pthread_mutex_lock(&pool->IdleLock);
+                pthread_cond_broadcast(&pool->IdleCondition);
+                pthread_mutex_unlock(&pool->IdleLock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->IdleLock);
+        atomic_fetch_add(&pool->Sleepers, 1);
+        while (0 == atomic_load(&pool->Queued) && 0 != atomic_load(&pool->Pending))
+        {
+            pthread_cond_wait(&pool->IdleCondition, &pool->IdleLock);
+        }
+        atomic_fetch_sub(&pool->Sleepers, 1);
+        pthread_mutex_unlock(&pool->IdleLock);
+
+        if (0 == atomic_load(&pool->Pending))
+        {
+            return NULL;
+        }
+    }
+}
+
+static void _run_task(SCAN_WORKER *worker, const SCAN_TASK *task)
+{
+    if (0 == task->Count)
+    {
+        _scan_directory(worker, task->Node, task->Directory);
+    }
+    else
+    {
+        _stat_files(task->Node, task->Directory->Descriptor, task->First, task->Count);
+        _release_directory(task->Directory);
+    }
+}
+
+static void _scan_directory(SCAN_WORKER *worker, INPUT_NODE *directory, SCAN_DIRECTORY *parent)
+{
+    SCAN_POOL *pool = worker->Pool;
+
+    // Only the root is opened by its path, everything below by its name in the parent.
+    int descriptor = NULL == parent ? open(directory->Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                                    : openat(parent->Descriptor, directory->Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    _release_directory(parent);
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "Can not open directory %s\n", directory->Path);
+        exit(1);
+    }
+
+    SCAN_DIRECTORY *open_directory = malloc(sizeof(*open_directory));
+    if (NULL == open_directory)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+    open_directory->Descriptor = descriptor;
+    atomic_init(&open_directory->References, 1);
+
+    uint32_t capacity = 0;
+    ssize_t length = 0;
+    while (0 < (length = getdents64(descriptor, worker->Entries, DIRECTORY_BUFFER_SIZE)))
+    {
+        for (ssize_t offset = 0; offset < length;)
+        {
+            const struct dirent64 *entry = (const struct dirent64 *)(worker->Entries + offset);
+            _add_scanned_entry(directory, descriptor, entry, &capacity);
+            offset += entry->d_reclen;
+        }
+    }
+    if (length < 0)
+    {
+        fprintf(stderr, "Can not read directory %s\n", directory->Path);
+        exit(1);
+    }
+
+    // The children array is final from here on, so tasks can hold pointers into it.
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        if (directory->Children[i].IsDirectory)
+        {
+            atomic_fetch_add(&open_directory->References, 1);
+            _push_task(pool, worker->Index, (SCAN_TASK){.Node = &directory->Children[i], .Directory = open_directory, .First = 0, .Count = 0});
+        }
+    }
+
+    // Other workers take the stat batches while this one keeps the last batch for itself.
+    uint32_t first = 0;
+    while (directory->ChildCount - first > STAT_BATCH_SIZE)
+    {
+        atomic_fetch_add(&open_directory->References, 1);
+        _push_task(pool, worker->Index, (SCAN_TASK){.Node = directory, .Directory = open_directory, .First = first, .Count = STAT_BATCH_SIZE});
+        first += STAT_BATCH_SIZE;
+    }
+    _stat_files(directory, descriptor, first, directory->ChildCount - first);
+    _release_directory(open_directory);
+}
+
+// Entries of file systems that do not report a type, like XFS without ftype or some NFS servers, are typed with statx.
+// The status of such a file is kept, so its stat batch does not ask again.
+static void _add_scanned_entry(INPUT_NODE *directory, int descriptor, const struct dirent64 *entry, uint32_t *capacity)
+{
+    if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+    {
+        return;
+    }
+
+    char *path = _join_path(directory->Path, entry->d_name);
+    uint8_t type = entry->d_type;
+    struct statx status;
+    if (DT_UNKNOWN_TYPE == type)
+    {
+        if (0 != statx(descriptor, entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_FILE_MASK, &status))
+        {
+            fprintf(stderr, "Can not open file %s\n", path);
+            exit(1);
+        }
+        type = S_ISDIR(status.stx_mode) ? DT_DIRECTORY : (S_ISREG(status.stx_mode) ? DT_REGULAR_FILE : DT_UNKNOWN_TYPE);
+    }
+
+    if (DT_DIRECTORY != type && DT_REGULAR_FILE != type)
+    {
+        fprintf(stderr, "Skipped file: %s file type unkown\n", path);
+        free(path);
+        return;
+    }
+
+    if (directory->ChildCount == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        directory->Children = realloc(directory->Children, *capacity * sizeof(*directory->Children));
+        if (NULL == directory->Children)
+        {
+            perror("Error allocating input tree");
+            exit(1);
+        }
+    }
+
+    INPUT_NODE *child = &directory->Children[directory->ChildCount++];
+    memset(child, 0, sizeof(*child));
+    child->Name = strdup(entry->d_name);
+    child->Path = path;
+    child->IsDirectory = DT_DIRECTORY == type;
+    if (DT_UNKNOWN_TYPE == entry->d_type && !child->IsDirectory)
+    {
+        _set_file_status(child, &status);
+    }
+}
+
+static void _stat_files(INPUT_NODE *directory, int descriptor, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        INPUT_NODE *child = &directory->Children[i];
+        if (child->IsDirectory || 0 != child->Inode)
+        {
+            continue;
+        }
+
+        struct statx status;
+        if (0 != statx(descriptor, child->Name, AT_SYMLINK_NOFOLLOW, STATX_FILE_MASK, &status))
+        {
+            fprintf(stderr, "Can not open file %s\n", child->Path);
+            exit(1);
+        }
+        _set_file_status(child, &status);
+    }
+}
+
+static void _set_file_status(INPUT_NODE *file, const struct statx *status)
+{
+    file->Size = status->stx_size;
+    file->ModificationTime = status->stx_mtime.tv_sec;
+    file->Device = makedev(status->stx_dev_major, status->stx_dev_minor);
+    file->Inode = status->stx_ino;
+}
+
+static void _release_directory(SCAN_DIRECTORY *directory)
+{
+    if (NULL != directory && 1 == atomic_fetch_sub(&directory->References, 1))
+    {
+        close(directory->Descriptor);
+        free(directory);
+    }
+}
+
+// The scan never resolves a whole path, so a deep tree can hold files whose path is longer than PATH_MAX.
+// Those are opened one directory at a time.
+static int _open_long_path(const char *path)
+{
+    char *components = strdup(path);
+    if (NULL == components)
+    {
+        perror("Error allocating input path");
+        exit(1);
+    }
+
+    int directory = '/' == *path ? open("/", O_PATH | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+    int descriptor = -1;
+    char *state = NULL;
+    char *name = strtok_r(components, "/", &state);
+    while (NULL != name && (AT_FDCWD == directory || directory >= 0))
+    {
+        char *next = strtok_r(NULL, "/", &state);
+        descriptor = openat(directory, name, NULL == next ? O_RDONLY | O_CLOEXEC : O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (AT_FDCWD != directory)
+        {
+            close(directory);
+        }
+
+        directory = NULL == next ? AT_FDCWD : descriptor;
+        name = next;
+    }
+
+    free(components);
+    return descriptor;
+}
+
+static void _push_task(SCAN_POOL *pool, uint32_t worker, SCAN_TASK task)
+{
+    SCAN_QUEUE *queue = &pool->Queues[worker];
+
+    atomic_fetch_add(&pool->Pending, 1);
+
+    pthread_mutex_lock(&queue->Lock);
+    if (queue->Length == queue->Capacity)
+    {
+        uint32_t capacity = queue->Capacity ? queue->Capacity * 2 : 64;
+        SCAN_TASK *tasks = malloc(capacity * sizeof(*tasks));
+        if (NULL == tasks)
+        {
+            perror("Error allocating scan queue");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < queue->Length; ++i)
+        {
+            tasks[i] = queue->Tasks[(queue->Head + i) % queue->Capacity];
+        }
+        free(queue->Tasks);
+        queue->Tasks = tasks;
+        queue->Head = 0;
+        queue->Capacity = capacity;
+    }
+    queue->Tasks[(queue->Head + queue->Length) % queue->Capacity] = task;
+    queue->Length++;
+    pthread_mutex_unlock(&queue->Lock);
+
+    atomic_fetch_add(&pool->Queued, 1);
+    if (0 != atomic_load(&pool->Sleepers))
+    {
+        pthread_mutex_lock(&pool->IdleLock);
+        pthread_cond_signal(&pool->IdleCondition);
+        pthread_mutex_unlock(&pool->IdleLock);
+    }
+}
+
+static bool _pop_task(SCAN_QUEUE *queue, SCAN_TASK *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->Lock);
+    if (queue->Length > 0)
+    {
+        queue->Length--;
+        *task = queue->Tasks[(queue->Head + queue->Length) % queue->Capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->Lock);
+
+    return found;
+}
+
+static bool _steal_task(SCAN_QUEUE *queue, SCAN_TASK *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->Lock);
+    if (queue->Length > 0)
+    {
+        *task = queue->Tasks[queue->Head];
+        queue->Head = (queue->Head + 1) % queue->Capacity;
+        queue->Length--;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->Lock);
+
+    return found;
+}
+
+static char *_join_path(const char *directoryPath, const char *name)
+{
+    size_t directory_length = strlen(directoryPath);
+    size_t name_length = strlen(name);
+
+    char *path = malloc(directory_length + name_length + 2);
+    if (NULL == path)
+    {
+        perror("Error allocating input path");
+        exit(1);
+    }
+
+    memcpy(path, directoryPath, directory_length);
+    path[directory_length] = '/';
+    memcpy(path + directory_length + 1, name, name_length + 1);
+
+    return path;
+}
+
+static INPUT_NODE *_add_child(INPUT_NODE *directory, const char *name, size_t name_length, bool isDirectory)
+{
+    directory->Children = realloc(directory->Children, (directory->ChildCount + 1) * sizeof(*directory->Children));
+    if (NULL == directory->Children)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+
+    INPUT_NODE *child = &directory->Children[directory->ChildCount++];
+    memset(child, 0, sizeof(*child));
+    child->Name = strndup(name, name_length);
+    child->Path = _join_path(directory->Path, child->Name);
+    child->IsDirectory = isDirectory;
+    if (NULL == child->Name)
+    {
+        perror("Error allocating input tree");
+        exit(1);
+    }
+
+    return child;
+}
+
+static INPUT_NODE *_find_child(INPUT_NODE *directory, const char *name, size_t name_length)
+{
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        if (0 == strncmp(directory->Children[i].Name, name, name_length) && '\0' == directory->Children[i].Name[name_length])
+        {
+            return &directory->Children[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Moves path to the next name and returns its length, 0 at the end. A tree has no way up, so .. is fatal.
+static size_t _next_path_component(const char **path)
+{
+    while ('\0' != **path)
+    {
+        size_t name_length = strcspn(*path, "/");
+        if (2 == name_length && 0 == strncmp(*path, "..", 2))
+        {
+            fprintf(stderr, "Can not add %s, .. is not allowed\n", *path);
+            exit(1);
+        }
+        if (0 != name_length && !(1 == name_length && '.' == **path))
+        {
+            return name_length;
+        }
+
+        *path += name_length + ('\0' != (*path)[name_length]);
+    }
+
+    return 0;
+}
+
+static int _compare_nodes(const void *first, const void *second)
+{
+    return strcmp(((const INPUT_NODE *)first)->Name, ((const INPUT_NODE *)second)->Name);
+}
+
+static uint64_t _hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void _free_node(INPUT_NODE *node)
+{
+    for (uint32_t i = 0; i < node->ChildCount; ++i)
+    {
+        _free_node(&node->Children[i]);
+    }
+
+    free(node->Children);
+    free(node->Name);
+    free(node->Path);
+}
@@ -0,0 +1,78 @@
+#ifndef _INPUT_SCAN_H_
+#define _INPUT_SCAN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Where the contents of a file come from. Scanned files are read from Path, files added through the builder API from the caller.
+typedef enum _INPUT_SOURCE
+{
+    INPUT_SOURCE_PATH,
+    INPUT_SOURCE_MEMORY,
+    INPUT_SOURCE_DESCRIPTOR,
+    INPUT_SOURCE_CALLBACK,
+} INPUT_SOURCE;
+
+// Reads up to size bytes at offset into buffer and returns how many were read, less only at the end of the file.
+// Called from several threads at once, returning UINT64_MAX reports an error.
+typedef uint64_t (*INPUT_READ_CALLBACK)(void *context, uint64_t offset, void *buffer, uint64_t size);
+
+typedef struct _INPUT_NODE
+{
+    char *Name;
+    // Only used in messages unless Source is INPUT_SOURCE_PATH.
+    char *Path;
+    bool IsDirectory;
+    uint64_t Size;
+    // Only set for files, directories are stamped with the build time.
+    time_t ModificationTime;
+    // Only set for scanned files, trees that contain the same file can share its contents.
+    uint64_t Device;
+    uint64_t Inode;
+    INPUT_SOURCE Source;
+    const void *Buffer;
+    int Descriptor;
+    // Where the contents start in Descriptor, archive members share the descriptor of their archive.
+    uint64_t SourceOffset;
+    INPUT_READ_CALLBACK Read;
+    void *ReadContext;
+    struct _INPUT_NODE *Children;
+    uint32_t ChildCount;
+} INPUT_NODE;
+
+// Enumerates the input tree with a pool of jobs worker threads. Children keep the readdir order of their directory.
+INPUT_NODE *scan_input_directory(const char *inputDirectoryPath, uint32_t jobs);
+
+// Orders the children of every directory by name, so the image no longer depends on readdir order.
+void sort_input_tree(INPUT_NODE *root);
+
+// Hash of the names, types and sizes in the tree. File contents and times are not read.
+uint64_t hash_input_tree(const INPUT_NODE *root);
+
+// Also closes the descriptor of an archive tree, which its root holds as a descriptor source.
+void free_input_tree(INPUT_NODE *root);
+
+// An empty root directory for trees built in memory.
+INPUT_NODE *create_input_tree(void);
+
+// Adds a node at a / separated path below root, creating the missing parent directories. Empty and . components are ignored. An existing node of the same type is returned as is.
+// The node stays valid until the next node is added to the same directory.
+INPUT_NODE *add_input_node(INPUT_NODE *root, const char *path, bool isDirectory);
+
+// Returns NULL when there is no node at path.
+INPUT_NODE *find_input_node(INPUT_NODE *root, const char *path);
+
+// Moves the children of a scanned tree below directory and frees what is left of the tree.
+void graft_input_tree(INPUT_NODE *directory, INPUT_NODE *tree);
+
+// Returns a descriptor the file can be read or copied from at any offset, or -1 when its contents are in memory or behind a callback.
+// Thread safe, every call has to be paired with close_input_file().
+int open_input_file(const INPUT_NODE *file);
+void close_input_file(const INPUT_NODE *file, int descriptor);
+
+// Reads at offset from the descriptor of open_input_file() or from the memory or callback of the file.
+// Returns the bytes read, which is short only at the end of the file.
+uint64_t read_input_file(const INPUT_NODE *file, int descriptor, uint64_t offset, void *buffer, uint64_t size);
+
+#endif /* _INPUT_SCAN_H_ */
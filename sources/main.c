@@ -1,16 +1,741 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "build_stats.h"
+#include "guid_provider.h"
 #include "write_image.h"
+#include "zstd_image.h"
 
-int main(int argc, const char** argv)
+#define MAX_JOBS 1024
+#define MAX_HEADROOM 1000
+#define MAX_DEVICES 16
+#define MAX_QUEUE_DEPTH 256
+#define MAX_PARTITIONS 128
+#define MAX_PARTITION_NAME 36
+
+#define OPTION_SIZE 256
+#define OPTION_HEADROOM 257
+#define OPTION_SEED 258
+#define OPTION_STATS 259
+#define OPTION_FORMAT 260
+#define OPTION_DEVICE 261
+#define OPTION_QUEUE_DEPTH 262
+#define OPTION_CLUSTER_SIZE 263
+#define OPTION_PARTITION 264
+#define OPTION_VERIFY 265
+#define OPTION_BATCH 266
+#define OPTION_CACHE_SIZE 267
+
+#define DEFAULT_CACHE_SIZE (1ULL * 1024 * 1024 * 1024)
+
+// Start of the FAT date range, used when SOURCE_DATE_EPOCH is not set.
+#define DEFAULT_REPRODUCIBLE_EPOCH 315532800
+
+static void _print_usage(const char *programName);
+static uint32_t _parse_jobs(const char *value);
+static uint64_t _parse_size(const char *value);
+static uint32_t _parse_headroom(const char *value);
+static time_t _get_reproducible_epoch(void);
+static FILE *_open_standard_output(const IMAGE_OPTIONS *options);
+static IMAGE_FORMAT _parse_format(const char *value);
+static uint32_t _parse_queue_depth(const char *value);
+static uint32_t _parse_cluster_size(const char *value);
+static void _parse_partition(char *value, bool first, PARTITION_SPEC *spec);
+static IMAGE_JOB *_read_manifest(const char *manifestPath, const IMAGE_OPTIONS *options, uint32_t *jobCount, char **text);
+static bool _parse_manifest_line(char *line, const char *manifestPath, uint32_t lineNumber, IMAGE_JOB *job);
+
+int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        perror("Invalid number of parameters.");
+    IMAGE_OPTIONS options = {
+        .Sparse = false,
+        .Format = IMAGE_FORMAT_RAW,
+        .Jobs = 1,
+        .ImageSize = 0,
+        .AutoSize = false,
+        .Headroom = 10,
+        .ClusterSize = 0,
+        .Update = false,
+        .Reproducible = false,
+        .Seed = NULL,
+        .BuildTime = 0,
+        .Devices = NULL,
+        .DeviceCount = 0,
+        .QueueDepth = 32,
+        .Partitions = NULL,
+        .PartitionCount = 0,
+        .CacheSize = DEFAULT_CACHE_SIZE,
+        .Verbose = true,
+    };
+    static const char *devices[MAX_DEVICES];
+    static PARTITION_SPEC partitions[MAX_PARTITIONS];
+
+    static const struct option long_options[] = {
+        {"sparse", no_argument, NULL, 's'},
+        {"update", no_argument, NULL, 'u'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"size", required_argument, NULL, OPTION_SIZE},
+        {"headroom", required_argument, NULL, OPTION_HEADROOM},
+        {"reproducible", no_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, OPTION_SEED},
+        {"stats", required_argument, NULL, OPTION_STATS},
+        {"format", required_argument, NULL, OPTION_FORMAT},
+        {"device", required_argument, NULL, OPTION_DEVICE},
+        {"queue-depth", required_argument, NULL, OPTION_QUEUE_DEPTH},
+        {"cluster-size", required_argument, NULL, OPTION_CLUSTER_SIZE},
+        {"partition", required_argument, NULL, OPTION_PARTITION},
+        {"verify", no_argument, NULL, OPTION_VERIFY},
+        {"batch", required_argument, NULL, OPTION_BATCH},
+        {"cache-size", required_argument, NULL, OPTION_CACHE_SIZE},
+        {NULL, 0, NULL, 0},
+    };
+
+    const char *statsPath = NULL;
+    bool verify = false;
+    const char *batchPath = NULL;
+    bool hasCacheSize = false;
+    int option;
+    while (-1 != (option = getopt_long(argc, argv, "surj:", long_options, NULL)))
+    {
+        switch (option)
+        {
+        case 's':
+            options.Sparse = true;
+            break;
+        case 'u':
+            options.Update = true;
+            break;
+        case 'r':
+            options.Reproducible = true;
+            break;
+        case OPTION_SEED:
+            options.Seed = optarg;
+            break;
+        case OPTION_STATS:
+            statsPath = optarg;
+            break;
+        case OPTION_FORMAT:
+            options.Format = _parse_format(optarg);
+            break;
+        case OPTION_DEVICE:
+            if (MAX_DEVICES == options.DeviceCount)
+            {
+                fprintf(stderr, "At most %u devices can be written at once.\n", MAX_DEVICES);
+                exit(1);
+            }
+            devices[options.DeviceCount++] = optarg;
+            options.Devices = devices;
+            break;
+        case OPTION_QUEUE_DEPTH:
+            options.QueueDepth = _parse_queue_depth(optarg);
+            break;
+        case 'j':
+            options.Jobs = _parse_jobs(optarg);
+            break;
+        case OPTION_SIZE:
+            options.AutoSize = 0 == strcmp(optarg, "auto");
+            options.ImageSize = options.AutoSize ? 0 : _parse_size(optarg);
+            break;
+        case OPTION_HEADROOM:
+            options.Headroom = _parse_headroom(optarg);
+            break;
+        case OPTION_CLUSTER_SIZE:
+            options.ClusterSize = 0 == strcmp(optarg, "auto") ? 0 : _parse_cluster_size(optarg);
+            break;
+        case OPTION_PARTITION:
+            if (MAX_PARTITIONS == options.PartitionCount)
+            {
+                fprintf(stderr, "At most %u partitions can be created.\n", MAX_PARTITIONS);
+                exit(1);
+            }
+            _parse_partition(optarg, 0 == options.PartitionCount, &partitions[options.PartitionCount]);
+            options.PartitionCount++;
+            options.Partitions = partitions;
+            break;
+        case OPTION_VERIFY:
+            verify = true;
+            break;
+        case OPTION_BATCH:
+            batchPath = optarg;
+            break;
+        case OPTION_CACHE_SIZE:
+            options.CacheSize = 0 == strcmp(optarg, "0") ? 0 : _parse_size(optarg);
+            hasCacheSize = true;
+            break;
+        default:
+            _print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    // Devices take the place of the output image and partitions the place of the input directory. A verified image may go without its input,
+    // a batch takes its inputs and outputs from the manifest.
+    int parameterCount = argc - optind;
+    int expectedCount = NULL != batchPath ? 0 : (verify || 0 == options.DeviceCount ? 2 : 1) - (0 == options.PartitionCount ? 0 : 1);
+    if (parameterCount != expectedCount && !(verify && parameterCount == expectedCount - 1 && 0 == options.PartitionCount)) {
+        fprintf(stderr, "Invalid number of parameters.\n");
+        _print_usage(argv[0]);
+        exit(1);
+    }
+
+    if (options.Update && (options.AutoSize || 0 != options.ImageSize))
+    {
+        fprintf(stderr, "--size can not be used with --update, the existing image keeps its geometry.\n");
+        exit(1);
+    }
+
+    if (0 != options.PartitionCount && (options.Update || options.AutoSize || 0 != options.ImageSize))
+    {
+        fprintf(stderr, "--partition can not be used with --update or --size, every partition has its own size.\n");
+        exit(1);
+    }
+
+    if (options.Update && 0 != options.ClusterSize)
+    {
+        fprintf(stderr, "--cluster-size can not be used with --update, the existing volume keeps its clusters.\n");
+        exit(1);
+    }
+
+    if (options.Update && IMAGE_FORMAT_RAW != options.Format)
+    {
+        fprintf(stderr, "--update only works on raw images.\n");
+        exit(1);
+    }
+
+    if (0 != options.DeviceCount && (options.Update || IMAGE_FORMAT_RAW != options.Format))
+    {
+        fprintf(stderr, "--device writes new raw images only, it can not be used with --update or --format.\n");
+        exit(1);
+    }
+
+    if (verify && (options.Update || 0 != options.DeviceCount || IMAGE_FORMAT_RAW != options.Format))
+    {
+        fprintf(stderr, "--verify reads a raw image, it can not be used with --update, --device or --format.\n");
+        exit(1);
+    }
+
+    if (NULL != batchPath && (verify || options.Update || 0 != options.DeviceCount || 0 != options.PartitionCount))
+    {
+        fprintf(stderr, "--batch builds new image files, it can not be used with --verify, --update, --device or --partition.\n");
+        exit(1);
+    }
+
+    if (NULL == batchPath && hasCacheSize)
+    {
+        fprintf(stderr, "--cache-size only applies to --batch.\n");
+        exit(1);
+    }
+
+    if (NULL != options.Seed && !options.Reproducible)
+    {
+        fprintf(stderr, "--seed requires --reproducible.\n");
+        exit(1);
+    }
+
+    // One timestamp for the whole run, every entry gets the same creation time.
+    options.BuildTime = options.Reproducible ? _get_reproducible_epoch() : time(NULL);
+
+    // Opened up front so a bad path fails before the image is built.
+    FILE *statsFile = NULL;
+    if (NULL != statsPath)
+    {
+        statsFile = fopen(statsPath, "w");
+        if (NULL == statsFile)
+        {
+            perror("Error opening stats file");
+            exit(1);
+        }
+    }
+
+    bool verified = true;
+    if (verify)
+    {
+        verified = verify_image(optind + 1 < argc ? argv[optind + 1] : NULL, argv[optind], &options);
+    }
+    else if (NULL != batchPath)
+    {
+        uint32_t jobCount = 0;
+        char *manifestText = NULL;
+        IMAGE_JOB *jobs = _read_manifest(batchPath, &options, &jobCount, &manifestText);
+        write_image_batch(jobs, jobCount, &options);
+
+        for (uint32_t i = 0; i < jobCount; ++i)
+        {
+            free((void *)jobs[i].Options.Partitions);
+        }
+        free(jobs);
+        free(manifestText);
+    }
+    else
+    {
+        const char *inputPath = 0 == options.PartitionCount ? argv[optind++] : NULL;
+
+        FILE* outputFile = NULL;
+        if (0 == options.DeviceCount)
+        {
+            outputFile = 0 == strcmp(argv[optind], "-") ? _open_standard_output(&options) : fopen(argv[optind], options.Update ? "r+b" : "wb");
+        }
+        if (0 == options.DeviceCount && NULL == outputFile) {
+            perror("Error opening output image");
+            exit(1);
+        }
+
+        write_image(inputPath, outputFile, &options);
+    }
+
+    if (NULL != statsFile)
+    {
+        write_stats_report(statsFile);
+        if (0 != fclose(statsFile))
+        {
+            perror("Error writing stats file");
+            exit(1);
+        }
+    }
+    return verified ? 0 : 1;
+}
+
+static void _print_usage(const char *programName)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <input directory or archive> <output image>\n"
+            "       %s [options] --device PATH... <input directory or archive>\n"
+            "       %s [options] --partition SPEC... <output image>\n"
+            "       %s --verify [options] <image> [<input directory or archive>]\n"
+            "       %s --batch MANIFEST [options]\n"
+            "  an input tar (ustar, GNU, pax) or cpio (newc) archive is read in one pass without extracting it,\n"
+            "  an input of - reads the archive from stdin\n"
+            "  an output image of - streams the image to stdout in LBA order\n"
+            "  -s, --sparse    only write allocated regions, leave the rest of the image as holes\n"
+            "  -u, --update    rewrite only what changed in an existing image created by this tool\n"
+            "  -j, --jobs N    scan the input and copy file data with N worker threads (default 1)\n"
+            "  --size SIZE     total image size in bytes, K/M/G/T suffixes allowed, rounded down to whole MiB (default 4G volume)\n"
+            "  --size auto     smallest FAT32 image that holds the input directory plus the headroom\n"
+            "  --headroom PCT  free space added to --size auto, in percent of the input (default 10)\n"
+            "  --cluster-size SIZE\n"
+            "                  FAT32 cluster size, a power of two from 512 to 32K, or auto (default) to pick 4K to 32K\n"
+            "                  from the input file sizes, or a smaller size when the volume is too small for 4K\n"
+            "  -r, --reproducible\n"
+            "                  byte identical images for identical input: sorted entries, SOURCE_DATE_EPOCH (default 1980-01-01)\n"
+            "                  on every entry and GUIDs derived from the input names and sizes\n"
+            "  --seed STRING   derive the GUIDs of --reproducible from STRING instead of the input\n"
+            "  --stats FILE    write per phase timings and counters as JSON to FILE\n"
+            "  --format FORMAT raw (default), qcow2 or zstd, a qcow2 image only stores the clusters that hold data,\n"
+            "                  zstd is a raw image compressed in 1 MiB seekable frames by the -j threads\n"
+            "  --device PATH   write the image to a block device or file with O_DIRECT and io_uring, repeat to write several at once\n"
+            "  --queue-depth N 1 MiB blocks in flight per device for --device (default 32)\n"
+            "  --partition dir=PATH[,size=SIZE|auto][,type=esp|data|GUID][,name=NAME]\n"
+            "                  add a FAT32 partition holding PATH instead of the single input directory, repeat for more\n"
+            "                  partitions in order; they are laid out in parallel. size defaults to auto with the headroom,\n"
+            "                  type to esp for the first partition and data for the others, name to BontaOS.hddN\n"
+            "  --verify        check the protective MBR, both GPTs, the FATs, every FAT chain and FSInfo of an existing image with\n"
+            "                  the -j threads, and compare its files with the input when one is given, or with the --partition inputs\n"
+            "  --batch MANIFEST\n"
+            "                  build one image per line of MANIFEST: [--size SIZE] [--headroom PCT] [--cluster-size SIZE]\n"
+            "                  [--partition SPEC]... <input directory or archive> <output image>, or only <output image> with\n"
+            "                  partitions, # starts a comment. The command line options are the defaults of every line. Each input\n"
+            "                  is scanned once and the images are built at the same time with the -j threads\n"
+            "  --cache-size SIZE\n"
+            "                  memory for files that several images of a batch contain, they are read once (default 1G, 0 disables)\n",
+            programName, programName, programName, programName, programName);
+}
+
+static uint32_t _parse_jobs(const char *value)
+{
+    char *end = NULL;
+    unsigned long jobs = strtoul(value, &end, 10);
+
+    if ('\0' == *value || '\0' != *end || 0 == jobs || jobs > MAX_JOBS)
+    {
+        fprintf(stderr, "Invalid number of jobs: %s\n", value);
+        exit(1);
+    }
+
+    return (uint32_t)jobs;
+}
+
+static uint32_t _parse_queue_depth(const char *value)
+{
+    char *end = NULL;
+    unsigned long depth = strtoul(value, &end, 10);
+
+    if ('\0' == *value || '\0' != *end || 0 == depth || depth > MAX_QUEUE_DEPTH)
+    {
+        fprintf(stderr, "Invalid queue depth: %s\n", value);
+        exit(1);
+    }
+
+    return (uint32_t)depth;
+}
+
+static uint32_t _parse_cluster_size(const char *value)
+{
+    char *end = NULL;
+    unsigned long size = strtoul(value, &end, 10);
+
+    if (end != value && ('K' == (*end & ~0x20)) && '\0' == end[1])
+    {
+        size <<= 10;
+        end++;
+    }
+
+    if (end == value || '\0' != *end || size < 512 || size > 32768 || 0 != (size & (size - 1)))
+    {
+        fprintf(stderr, "Invalid cluster size: %s\n", value);
+        exit(1);
+    }
+
+    return (uint32_t)size;
+}
+
+// Keys are separated by commas, so PATH and NAME can not contain one.
+static void _parse_partition(char *value, bool first, PARTITION_SPEC *spec)
+{
+    enum { KEY_DIR, KEY_SIZE, KEY_TYPE, KEY_NAME };
+    static char *const keys[] = {"dir", "size", "type", "name", NULL};
+    const char *type = first ? "esp" : "data";
+    char *setting = NULL;
+
+    while ('\0' != *value)
+    {
+        char *token = value;
+        int key = getsubopt(&value, keys, &setting);
+        if (key < 0 || (NULL == setting && KEY_NAME != key))
+        {
+            fprintf(stderr, "Invalid partition setting: %s\n", token);
+            exit(1);
+        }
+
+        switch (key)
+        {
+        case KEY_DIR:
+            spec->InputPath = setting;
+            break;
+        case KEY_SIZE:
+            spec->Size = 0 == strcmp(setting, "auto") ? 0 : _parse_size(setting);
+            break;
+        case KEY_TYPE:
+            type = setting;
+            break;
+        default:
+            spec->Name = NULL == setting ? "" : setting;
+            break;
+        }
+    }
+
+    if (NULL == spec->InputPath || '\0' == *spec->InputPath)
+    {
+        fprintf(stderr, "Every --partition needs dir=PATH.\n");
+        exit(1);
+    }
+
+    // GPT names are UTF-16, only ASCII converts without a table.
+    for (const char *c = spec->Name; NULL != c && '\0' != *c; ++c)
+    {
+        if (*c < ' ' || *c > '~' || c - spec->Name >= MAX_PARTITION_NAME)
+        {
+            fprintf(stderr, "Invalid partition name, up to %u ASCII characters: %s\n", MAX_PARTITION_NAME, spec->Name);
+            exit(1);
+        }
+    }
+
+    if (0 == strcmp(type, "esp"))
+    {
+        type = "C12A7328-F81F-11D2-BA4B-00A0C93EC93B";
+    }
+    else if (0 == strcmp(type, "data"))
+    {
+        type = "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7";
+    }
+
+    if (!parse_guid(spec->TypeGuid, type))
+    {
+        fprintf(stderr, "Invalid partition type: %s\n", type);
+        exit(1);
+    }
+}
+
+static uint64_t _parse_size(const char *value)
+{
+    char *end = NULL;
+    unsigned long long size = strtoull(value, &end, 10);
+    unsigned int shift = 0;
+
+    if (end != value && '\0' != *end && '\0' == end[1])
+    {
+        const char *suffixes = "KMGT";
+        const char *suffix = strchr(suffixes, *end & ~0x20);
+        if (NULL != suffix)
+        {
+            shift = 10 * (suffix - suffixes + 1);
+            end++;
+        }
+    }
+
+    if (end == value || '\0' != *end || 0 == size || size > (UINT64_MAX >> shift))
+    {
+        fprintf(stderr, "Invalid image size: %s\n", value);
+        exit(1);
+    }
+
+    return (uint64_t)size << shift;
+}
+
+static uint32_t _parse_headroom(const char *value)
+{
+    char *end = NULL;
+    unsigned long headroom = strtoul(value, &end, 10);
+
+    if ('\0' == *value || '\0' != *end || headroom > MAX_HEADROOM)
+    {
+        fprintf(stderr, "Invalid headroom: %s\n", value);
+        exit(1);
+    }
+
+    return (uint32_t)headroom;
+}
+
+static time_t _get_reproducible_epoch(void)
+{
+    const char *value = getenv("SOURCE_DATE_EPOCH");
+    if (NULL == value)
+    {
+        return DEFAULT_REPRODUCIBLE_EPOCH;
+    }
+
+    char *end = NULL;
+    long long epoch = strtoll(value, &end, 10);
+    if ('\0' == *value || '\0' != *end || epoch < 0)
+    {
+        fprintf(stderr, "Invalid SOURCE_DATE_EPOCH: %s\n", value);
+        exit(1);
+    }
+
+    return (time_t)epoch;
+}
+
+// The image takes over stdout, the progress messages printed to stdout go to stderr instead.
+static FILE *_open_standard_output(const IMAGE_OPTIONS *options)
+{
+    if (options->Update)
+    {
+        fprintf(stderr, "--update needs an image file, it can not update stdout.\n");
+        exit(1);
+    }
+    if (isatty(STDOUT_FILENO))
+    {
+        fprintf(stderr, "Refusing to write an image to a terminal.\n");
+        exit(1);
+    }
+
+    fflush(stdout);
+    int imageDescriptor = dup(STDOUT_FILENO);
+    if (imageDescriptor < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        perror("Error redirecting stdout");
+        exit(1);
+    }
+
+    return fdopen(imageDescriptor, "wb");
+}
+
+static IMAGE_FORMAT _parse_format(const char *value)
+{
+    if (0 == strcmp(value, "raw"))
+    {
+        return IMAGE_FORMAT_RAW;
+    }
+    if (0 == strcmp(value, "qcow2"))
+    {
+        return IMAGE_FORMAT_QCOW2;
+    }
+    if (0 == strcmp(value, "zstd"))
+    {
+        // Rejected before the output file is created and truncated.
+        if (!is_zstd_image_supported())
+        {
+            fprintf(stderr, "%s\n", ZSTD_IMAGE_UNSUPPORTED_MESSAGE);
+            exit(1);
+        }
+        return IMAGE_FORMAT_ZSTD;
+    }
+
+    fprintf(stderr, "Invalid image format: %s\n", value);
+    exit(1);
+}
+
+// The paths and partitions of the jobs point into text, which is read as a whole and split into lines in place.
+static IMAGE_JOB *_read_manifest(const char *manifestPath, const IMAGE_OPTIONS *options, uint32_t *jobCount, char **text)
+{
+    FILE *manifest = fopen(manifestPath, "r");
+    if (NULL == manifest)
+    {
+        perror("Error opening manifest");
+        exit(1);
+    }
+
+    size_t textCapacity = 0;
+    *text = NULL;
+    if (-1 == getdelim(text, &textCapacity, '\0', manifest) && ferror(manifest))
+    {
+        perror("Error reading manifest");
+        exit(1);
+    }
+    fclose(manifest);
+
+    IMAGE_JOB *jobs = NULL;
+    uint32_t capacity = 0;
+    uint32_t lineNumber = 0;
+
+    *jobCount = 0;
+    for (char *line = *text; NULL != line && '\0' != *line; )
+    {
+        char *next = strchr(line, '\n');
+        if (NULL != next)
+        {
+            *next++ = '\0';
+        }
+        lineNumber++;
+
+        if (*jobCount == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            jobs = realloc(jobs, capacity * sizeof(*jobs));
+            if (NULL == jobs)
+            {
+                perror("Error allocating manifest");
+                exit(1);
+            }
+        }
+
+        jobs[*jobCount].Options = *options;
+        if (_parse_manifest_line(line, manifestPath, lineNumber, &jobs[*jobCount]))
+        {
+            (*jobCount)++;
+        }
+        line = next;
+    }
+
+    if (0 == *jobCount)
+    {
+        fprintf(stderr, "The manifest %s lists no images.\n", manifestPath);
+        exit(1);
+    }
+
+    return jobs;
+}
+
+// Parsed like a command line that only has the size options. Returns false for empty and comment lines.
+static bool _parse_manifest_line(char *line, const char *manifestPath, uint32_t lineNumber, IMAGE_JOB *job)
+{
+    static const struct option job_options[] = {
+        {"size", required_argument, NULL, OPTION_SIZE},
+        {"headroom", required_argument, NULL, OPTION_HEADROOM},
+        {"cluster-size", required_argument, NULL, OPTION_CLUSTER_SIZE},
+        {"partition", required_argument, NULL, OPTION_PARTITION},
+        {NULL, 0, NULL, 0},
+    };
+
+    // getopt prints its errors after the first word.
+    char location[64];
+    snprintf(location, sizeof(location), "%s:%u", manifestPath, lineNumber);
+
+    // A word takes at least two characters with its separator, one more slot for the location and one for the terminating NULL.
+    char **words = calloc(strlen(line) / 2 + 3, sizeof(*words));
+    if (NULL == words)
+    {
+        perror("Error allocating manifest");
+        exit(1);
+    }
+
+    int wordCount = 0;
+    words[wordCount++] = location;
+    for (char *word = strtok(line, " \t\r\n"); NULL != word && '#' != *word; word = strtok(NULL, " \t\r\n"))
+    {
+        words[wordCount++] = word;
+    }
+    if (1 == wordCount)
+    {
+        free(words);
+        return false;
+    }
+
+    PARTITION_SPEC *partitions = NULL;
+    bool hasSize = false;
+    job->Options.Partitions = NULL;
+    job->Options.PartitionCount = 0;
+
+    // 0 starts getopt over for the new word list.
+    optind = 0;
+    int option;
+    while (-1 != (option = getopt_long(wordCount, words, "", job_options, NULL)))
+    {
+        switch (option)
+        {
+        case OPTION_SIZE:
+            job->Options.AutoSize = 0 == strcmp(optarg, "auto");
+            job->Options.ImageSize = job->Options.AutoSize ? 0 : _parse_size(optarg);
+            hasSize = true;
+            break;
+        case OPTION_HEADROOM:
+            job->Options.Headroom = _parse_headroom(optarg);
+            break;
+        case OPTION_CLUSTER_SIZE:
+            job->Options.ClusterSize = 0 == strcmp(optarg, "auto") ? 0 : _parse_cluster_size(optarg);
+            break;
+        case OPTION_PARTITION:
+            if (MAX_PARTITIONS == job->Options.PartitionCount)
+            {
+                fprintf(stderr, "%s: at most %u partitions can be created.\n", location, MAX_PARTITIONS);
+                exit(1);
+            }
+            partitions = realloc(partitions, (job->Options.PartitionCount + 1) * sizeof(*partitions));
+            if (NULL == partitions)
+            {
+                perror("Error allocating partitions");
+                exit(1);
+            }
+            memset(&partitions[job->Options.PartitionCount], 0, sizeof(*partitions));
+            _parse_partition(optarg, 0 == job->Options.PartitionCount, &partitions[job->Options.PartitionCount]);
+            job->Options.PartitionCount++;
+            job->Options.Partitions = partitions;
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    if (wordCount - optind != (0 == job->Options.PartitionCount ? 2 : 1))
+    {
+        fprintf(stderr, "%s: invalid number of parameters.\n", location);
+        exit(1);
+    }
+
+    // The --size of the command line is only a default for lines without partitions.
+    if (0 != job->Options.PartitionCount && hasSize)
+    {
+        fprintf(stderr, "%s: --partition can not be used with --size, every partition has its own size.\n", location);
+        exit(1);
+    }
+    if (0 != job->Options.PartitionCount)
+    {
+        job->Options.AutoSize = false;
+        job->Options.ImageSize = 0;
+    }
+
+    job->InputPath = 0 == job->Options.PartitionCount ? words[optind++] : NULL;
+    job->OutputPath = words[optind];
+    if (0 == strcmp(job->OutputPath, "-"))
+    {
+        fprintf(stderr, "%s: batch images can not be streamed to stdout.\n", location);
         exit(1);
     }
 
-    FILE* outputFile = fopen(argv[2], "wb");
-    write_image(argv[1], outputFile);
-    return 0;
+    free(words);
+    return true;
 }
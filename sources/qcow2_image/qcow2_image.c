@@ -0,0 +1,258 @@
+#include "qcow2_image.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QCOW2_MAGIC 0x514649FB
+#define QCOW2_VERSION 3
+#define CLUSTER_BITS 16
+#define CLUSTER_SIZE (1ULL << CLUSTER_BITS)
+#define L2_ENTRIES (CLUSTER_SIZE / sizeof(uint64_t))
+// 16 bit refcounts.
+#define REFCOUNT_ORDER 4
+#define REFCOUNTS_PER_BLOCK (CLUSTER_SIZE * 8 >> REFCOUNT_ORDER)
+// Set on L1 and L2 entries whose cluster has a refcount of exactly one.
+#define QCOW2_COPIED (1ULL << 63)
+
+typedef struct __attribute__((packed)) _QCOW2_HEADER
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t BackingFileOffset;
+    uint32_t BackingFileSize;
+    uint32_t ClusterBits;
+    uint64_t Size;
+    uint32_t CryptMethod;
+    uint32_t L1Size;
+    uint64_t L1TableOffset;
+    uint64_t RefcountTableOffset;
+    uint32_t RefcountTableClusters;
+    uint32_t NumberOfSnapshots;
+    uint64_t SnapshotsOffset;
+    uint64_t IncompatibleFeatures;
+    uint64_t CompatibleFeatures;
+    uint64_t AutoclearFeatures;
+    uint32_t RefcountOrder;
+    uint32_t HeaderLength;
+} QCOW2_HEADER;
+
+static uint64_t *_get_l2_entry(QCOW2_IMAGE *image, uint64_t guest_cluster);
+static void _write_clusters(int descriptor, uint64_t cluster, const void *buffer, uint64_t size);
+
+void init_qcow2_image(QCOW2_IMAGE *image, int descriptor)
+{
+    image->Descriptor = descriptor;
+    image->L2Tables = NULL;
+    image->L2TableCount = 0;
+    // Cluster 0 holds the header.
+    image->NextHostCluster = 1;
+    pthread_mutex_init(&image->Lock, NULL);
+}
+
+uint64_t map_qcow2_region(QCOW2_IMAGE *image, uint64_t guest_offset, uint64_t size, uint64_t *host_offset)
+{
+    uint64_t mapped = 0;
+    uint64_t next_host_offset = 0;
+
+    pthread_mutex_lock(&image->Lock);
+    while (mapped < size)
+    {
+        uint64_t guest = guest_offset + mapped;
+        uint64_t *entry = _get_l2_entry(image, guest >> CLUSTER_BITS);
+
+        if (0 == *entry)
+        {
+            // A new cluster only extends the run if it lands right behind it.
+            if (0 != mapped && next_host_offset != image->NextHostCluster << CLUSTER_BITS)
+            {
+                break;
+            }
+            *entry = image->NextHostCluster++ << CLUSTER_BITS;
+        }
+
+        uint64_t host = *entry + (guest & (CLUSTER_SIZE - 1));
+        if (0 == mapped)
+        {
+            *host_offset = host;
+        }
+        else if (host != next_host_offset)
+        {
+            break;
+        }
+
+        uint64_t piece = CLUSTER_SIZE - (guest & (CLUSTER_SIZE - 1));
+        piece = piece < size - mapped ? piece : size - mapped;
+        mapped += piece;
+        next_host_offset = host + piece;
+    }
+    pthread_mutex_unlock(&image->Lock);
+
+    return mapped;
+}
+
+// The metadata goes behind the data: L2 tables, the L1 table, the refcount blocks and finally the refcount table.
+void finish_qcow2_image(QCOW2_IMAGE *image, uint64_t virtual_size)
+{
+    uint64_t l1_size = (virtual_size + CLUSTER_SIZE * L2_ENTRIES - 1) / (CLUSTER_SIZE * L2_ENTRIES);
+    uint64_t l1_clusters = (l1_size * sizeof(uint64_t) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    uint64_t l2_cluster_count = 0;
+    for (uint64_t i = 0; i < image->L2TableCount; ++i)
+    {
+        if (NULL != image->L2Tables[i] && i >= l1_size)
+        {
+            fprintf(stderr, "Data written past the end of the qcow2 image\n");
+            exit(1);
+        }
+        l2_cluster_count += NULL != image->L2Tables[i];
+    }
+
+    // The refcount blocks have to count themselves and the refcount table, so their number is found by iterating.
+    uint64_t refcount_blocks = 0;
+    uint64_t refcount_table_clusters = 0;
+    uint64_t total_clusters;
+    while (true)
+    {
+        total_clusters = image->NextHostCluster + l2_cluster_count + l1_clusters + refcount_blocks + refcount_table_clusters;
+        uint64_t needed_blocks = (total_clusters + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+        uint64_t needed_table_clusters = (needed_blocks * sizeof(uint64_t) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        if (needed_blocks == refcount_blocks && needed_table_clusters == refcount_table_clusters)
+        {
+            break;
+        }
+        refcount_blocks = needed_blocks;
+        refcount_table_clusters = needed_table_clusters;
+    }
+
+    uint64_t l2_cluster = image->NextHostCluster;
+    uint64_t l1_cluster = l2_cluster + l2_cluster_count;
+    uint64_t refcount_block_cluster = l1_cluster + l1_clusters;
+    uint64_t refcount_table_cluster = refcount_block_cluster + refcount_blocks;
+
+    uint64_t *buffer = calloc(1, CLUSTER_SIZE);
+    uint64_t *l1_table = calloc(l1_clusters, CLUSTER_SIZE);
+    uint64_t *refcount_table = calloc(refcount_table_clusters, CLUSTER_SIZE);
+    if (NULL == buffer || NULL == l1_table || NULL == refcount_table)
+    {
+        perror("Error allocating qcow2 metadata");
+        exit(1);
+    }
+
+    for (uint64_t i = 0; i < image->L2TableCount; ++i)
+    {
+        if (NULL == image->L2Tables[i])
+        {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < L2_ENTRIES; ++j)
+        {
+            buffer[j] = image->L2Tables[i][j] ? htobe64(image->L2Tables[i][j] | QCOW2_COPIED) : 0;
+        }
+        l1_table[i] = htobe64((l2_cluster << CLUSTER_BITS) | QCOW2_COPIED);
+        _write_clusters(image->Descriptor, l2_cluster++, buffer, CLUSTER_SIZE);
+
+        free(image->L2Tables[i]);
+    }
+    _write_clusters(image->Descriptor, l1_cluster, l1_table, l1_clusters * CLUSTER_SIZE);
+
+    // Every cluster of the file is used exactly once.
+    uint16_t *refcounts = (uint16_t *)buffer;
+    for (uint64_t i = 0; i < refcount_blocks; ++i)
+    {
+        for (uint64_t j = 0; j < REFCOUNTS_PER_BLOCK; ++j)
+        {
+            refcounts[j] = i * REFCOUNTS_PER_BLOCK + j < total_clusters ? htobe16(1) : 0;
+        }
+        refcount_table[i] = htobe64((refcount_block_cluster + i) << CLUSTER_BITS);
+        _write_clusters(image->Descriptor, refcount_block_cluster + i, buffer, CLUSTER_SIZE);
+    }
+    _write_clusters(image->Descriptor, refcount_table_cluster, refcount_table, refcount_table_clusters * CLUSTER_SIZE);
+
+    memset(buffer, 0, CLUSTER_SIZE);
+    QCOW2_HEADER *header = (QCOW2_HEADER *)buffer;
+    header->Magic = htobe32(QCOW2_MAGIC);
+    header->Version = htobe32(QCOW2_VERSION);
+    header->ClusterBits = htobe32(CLUSTER_BITS);
+    header->Size = htobe64(virtual_size);
+    header->L1Size = htobe32((uint32_t)l1_size);
+    header->L1TableOffset = htobe64(l1_cluster << CLUSTER_BITS);
+    header->RefcountTableOffset = htobe64(refcount_table_cluster << CLUSTER_BITS);
+    header->RefcountTableClusters = htobe32((uint32_t)refcount_table_clusters);
+    header->RefcountOrder = htobe32(REFCOUNT_ORDER);
+    header->HeaderLength = htobe32(sizeof(QCOW2_HEADER));
+    // The zeros behind the header are the end of the header extensions.
+    _write_clusters(image->Descriptor, 0, buffer, CLUSTER_SIZE);
+
+    free(refcount_table);
+    free(l1_table);
+    free(buffer);
+    free(image->L2Tables);
+    image->L2Tables = NULL;
+    image->L2TableCount = 0;
+    pthread_mutex_destroy(&image->Lock);
+}
+
+static uint64_t *_get_l2_entry(QCOW2_IMAGE *image, uint64_t guest_cluster)
+{
+    uint64_t l1_index = guest_cluster / L2_ENTRIES;
+
+    if (l1_index >= image->L2TableCount)
+    {
+        uint64_t count = image->L2TableCount ? image->L2TableCount : 8;
+        while (count <= l1_index)
+        {
+            count *= 2;
+        }
+
+        image->L2Tables = realloc(image->L2Tables, count * sizeof(*image->L2Tables));
+        if (NULL == image->L2Tables)
+        {
+            perror("Error allocating qcow2 tables");
+            exit(1);
+        }
+        memset(image->L2Tables + image->L2TableCount, 0, (count - image->L2TableCount) * sizeof(*image->L2Tables));
+        image->L2TableCount = count;
+    }
+
+    if (NULL == image->L2Tables[l1_index])
+    {
+        image->L2Tables[l1_index] = calloc(L2_ENTRIES, sizeof(uint64_t));
+        if (NULL == image->L2Tables[l1_index])
+        {
+            perror("Error allocating qcow2 tables");
+            exit(1);
+        }
+    }
+
+    return &image->L2Tables[l1_index][guest_cluster % L2_ENTRIES];
+}
+
+static void _write_clusters(int descriptor, uint64_t cluster, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+    uint64_t offset = cluster << CLUSTER_BITS;
+
+    while (size > 0)
+    {
+        ssize_t written = pwrite(descriptor, data, size, offset);
+        if (written < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("Error writing qcow2 metadata");
+            exit(1);
+        }
+
+        data += written;
+        offset += written;
+        size -= written;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef _QCOW2_IMAGE_H_
+#define _QCOW2_IMAGE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A qcow2 version 3 image that is filled front to back. Host clusters are handed out in the order guest clusters are first written,
+// the L2 tables, L1 table and refcounts are only written by finish_qcow2_image(). Guest clusters never written stay unallocated and read as zeros.
+typedef struct _QCOW2_IMAGE
+{
+    int Descriptor;
+    // One table of host offsets per L1 entry, NULL until a guest cluster it covers is written.
+    uint64_t **L2Tables;
+    uint64_t L2TableCount;
+    uint64_t NextHostCluster;
+    pthread_mutex_t Lock;
+} QCOW2_IMAGE;
+
+void init_qcow2_image(QCOW2_IMAGE *image, int descriptor);
+
+// Maps guest bytes to file offsets, allocating clusters that are not mapped yet. Stores where guest_offset lives in host_offset
+// and returns how many bytes from there are contiguous in the file, at most size.
+uint64_t map_qcow2_region(QCOW2_IMAGE *image, uint64_t guest_offset, uint64_t size, uint64_t *host_offset);
+
+void finish_qcow2_image(QCOW2_IMAGE *image, uint64_t virtual_size);
+
+#endif /* _QCOW2_IMAGE_H_ */
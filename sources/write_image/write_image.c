@@ -1,27 +1,38 @@
 #include "write_image.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <uchar.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
+#include "build_stats.h"
+#include "crc32.h"
 #include "guid_provider.h"
 #include "fat32_system_format.h"
+#include "image_output.h"
+#include "input_archive.h"
+#include "input_cache.h"
+#include "input_scan.h"
+#include "zstd_image.h"
 
 #define LBA_SIZE 512
-#define ALIGNMENT 1ULL * 1024 * 1024 / LBA_SIZE
-#define NUMBER_OF_USABLE_BLOCKS 4ULL * 1024 * 1024 * 1024 / LBA_SIZE
-#define NUMBER_OF_BLOCKS ALIGNMENT * 2 + NUMBER_OF_USABLE_BLOCKS
+#define ALIGNMENT (1ULL * 1024 * 1024 / LBA_SIZE)
+#define DEFAULT_USABLE_BLOCKS 4ULL * 1024 * 1024 * 1024 / LBA_SIZE
 #define SIZE_OF_PARTITION_ENTRY 128
+#define NUMBER_OF_PARTITION_ENTRIES (ALIGNMENT * 4 - 8)
+#define GPT_SIGNATURE 0x5452415020494645
 
 #define EFI_SYSTEM_PARTITION_GUID                                                                      \
     {                                                                                                  \
         0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11, 0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B \
     }
 
-static uint32_t crc_table[256];
-
-static void create_crc32_table(void);
-static uint32_t calculate_crc32(void *buf, int32_t len);
-
 typedef struct _PARTITION_RECORD
 {
     uint8_t BootIndicator;
@@ -76,9 +87,408 @@ typedef struct _GPT_ENTRY
 #endif /* SIZE_OF_PARTITION_ENTRY > 128 */
 } __attribute__((packed)) GPT_ENTRY;
 
-void write_image(const char* inputDirectoryPath, FILE *outputFile)
+// One partition and the FAT32 volume built for it. Each partition has its own input tree and volume, so they are laid out on separate threads.
+typedef struct _PARTITION_BUILD
+{
+    PARTITION_SPEC Spec;
+    uint32_t Index;
+    const IMAGE_OPTIONS *Options;
+    // Sized to the input, or RequestedBlocks long.
+    bool AutoSize;
+    uint64_t RequestedBlocks;
+    INPUT_NODE *InputTree;
+    FAT32_VOLUME *Volume;
+    uint64_t UsableBlocks;
+    uint64_t StartingLBA;
+} PARTITION_BUILD;
+
+// One image of a batch. Its partitions share their input trees with every other partition of the batch that has the same input path.
+typedef struct _BATCH_JOB
+{
+    const IMAGE_JOB *Job;
+    IMAGE_OPTIONS Options;
+    PARTITION_BUILD *Builds;
+    uint32_t BuildCount;
+    FILE *OutputFile;
+    uint64_t InputSize;
+} BATCH_JOB;
+
+typedef struct _IMAGE_BATCH
+{
+    // Largest input first.
+    BATCH_JOB **Order;
+    uint32_t JobCount;
+    atomic_uint NextJob;
+    INPUT_CACHE *Cache;
+} IMAGE_BATCH;
+
+static PARTITION_BUILD *_create_partition_builds(const char *inputDirectoryPath, const IMAGE_OPTIONS *options, uint32_t *buildCount);
+static void _run_partition_threads(PARTITION_BUILD *builds, uint32_t buildCount, void *(*routine)(void *));
+static void *_scan_partition(void *argument);
+static void *_lay_out_partition(void *argument);
+static void _set_partition_name(GPT_ENTRY *entry, const PARTITION_BUILD *build);
+static uint64_t _get_usable_blocks(PARTITION_BUILD *build);
+static void _build_image(PARTITION_BUILD *builds, uint32_t buildCount, IMAGE_OUTPUT *output, const IMAGE_OPTIONS *options);
+static void _init_output(IMAGE_OUTPUT *output, FILE *outputFile, const IMAGE_SINK *sink, DEVICE_WRITER *devices, const IMAGE_OPTIONS *options);
+static void _update_image(const INPUT_NODE *inputTree, FILE *outputFile, const IMAGE_OPTIONS *options);
+static void _get_disk_guids(const PARTITION_BUILD *builds, uint32_t buildCount, const IMAGE_OPTIONS *options, uint8_t diskGuid[16], GPT_ENTRY *entries);
+static bool _verify_gpt_header(const uint8_t *image, uint64_t numberOfBlocks, uint64_t myLba, uint64_t alternateLba, const char *name, uint64_t *problemCount);
+static void _report_image_problem(uint64_t *problemCount, const char *format, ...);
+static IMAGE_OPTIONS _get_image_options(const IMAGE_OPTIONS *options);
+static void _check_image_format(const IMAGE_OPTIONS *options);
+static INPUT_NODE *_find_batch_tree(BATCH_JOB *jobs, uint32_t jobIndex, uint32_t buildIndex);
+static uint64_t _get_input_size(const INPUT_NODE *directory);
+static void *_run_batch_worker(void *argument);
+static int _compare_batch_jobs(const void *first, const void *second);
+
+void write_image(const char* inputDirectoryPath, FILE *outputFile, const IMAGE_OPTIONS *options)
+{
+    IMAGE_OPTIONS Options = _get_image_options(options);
+    options = &Options;
+    start_stats_phase(STATS_PHASE_TOTAL);
+
+    // Devices are opened before the long scan, so a wrong path fails right away.
+    DEVICE_WRITER *Devices = NULL;
+    if (0 != options->DeviceCount)
+    {
+        Devices = open_device_writer(options->Devices, options->DeviceCount, options->QueueDepth);
+    }
+
+    uint32_t BuildCount = 0;
+    PARTITION_BUILD *Builds = _create_partition_builds(inputDirectoryPath, options, &BuildCount);
+
+    start_stats_phase(STATS_PHASE_SCAN);
+    _run_partition_threads(Builds, BuildCount, _scan_partition);
+    stop_stats_phase(STATS_PHASE_SCAN);
+
+    if (options->Update)
+    {
+        _update_image(Builds[0].InputTree, outputFile, options);
+    }
+    else
+    {
+        IMAGE_OUTPUT Output;
+        _init_output(&Output, outputFile, NULL, Devices, options);
+        _build_image(Builds, BuildCount, &Output, options);
+    }
+
+    for (uint32_t i = 0; i < BuildCount; ++i)
+    {
+        free_input_tree(Builds[i].InputTree);
+    }
+    if (NULL != outputFile)
+    {
+        fclose(outputFile);
+    }
+    free(Builds);
+    stop_stats_phase(STATS_PHASE_TOTAL);
+}
+
+void write_image_trees(INPUT_NODE *const *inputTrees, FILE *outputFile, const IMAGE_SINK *sink, const IMAGE_OPTIONS *options)
+{
+    IMAGE_OPTIONS Options = _get_image_options(options);
+    options = &Options;
+    start_stats_phase(STATS_PHASE_TOTAL);
+
+    if (NULL != sink && (options->Update || 0 != options->DeviceCount || IMAGE_FORMAT_RAW != options->Format))
+    {
+        fprintf(stderr, "A sink only takes new raw images\n");
+        exit(1);
+    }
+
+    DEVICE_WRITER *Devices = NULL;
+    if (NULL == sink && 0 != options->DeviceCount)
+    {
+        Devices = open_device_writer(options->Devices, options->DeviceCount, options->QueueDepth);
+    }
+
+    uint32_t BuildCount = 0;
+    PARTITION_BUILD *Builds = _create_partition_builds(NULL, options, &BuildCount);
+    for (uint32_t i = 0; i < BuildCount; ++i)
+    {
+        Builds[i].InputTree = inputTrees[i];
+        if (options->Reproducible)
+        {
+            sort_input_tree(Builds[i].InputTree);
+        }
+    }
+
+    if (options->Update)
+    {
+        _update_image(Builds[0].InputTree, outputFile, options);
+    }
+    else
+    {
+        IMAGE_OUTPUT Output;
+        _init_output(&Output, outputFile, sink, Devices, options);
+        _build_image(Builds, BuildCount, &Output, options);
+    }
+
+    free(Builds);
+    stop_stats_phase(STATS_PHASE_TOTAL);
+}
+
+void write_image_batch(const IMAGE_JOB *imageJobs, uint32_t jobCount, const IMAGE_OPTIONS *options)
+{
+    IMAGE_OPTIONS Options = _get_image_options(options);
+    options = &Options;
+    if (0 == jobCount)
+    {
+        return;
+    }
+
+    start_stats_phase(STATS_PHASE_TOTAL);
+
+    IMAGE_BATCH Batch = {
+        .Order = calloc(jobCount, sizeof(BATCH_JOB *)),
+        .JobCount = jobCount,
+        .Cache = create_input_cache(options->CacheSize),
+    };
+    BATCH_JOB *Jobs = calloc(jobCount, sizeof(*Jobs));
+    if (NULL == Batch.Order || NULL == Jobs)
+    {
+        perror("Error allocating batch");
+        exit(1);
+    }
+    atomic_init(&Batch.NextJob, 0);
+
+    // Outputs are opened up front so a bad path fails before the first image is built. Inputs are scanned with all jobs.
+    for (uint32_t i = 0; i < jobCount; ++i)
+    {
+        Jobs[i].Job = &imageJobs[i];
+        Jobs[i].Options = imageJobs[i].Options;
+        Jobs[i].Options.Jobs = options->Jobs;
+        _check_image_format(&Jobs[i].Options);
+        Jobs[i].Builds = _create_partition_builds(imageJobs[i].InputPath, &Jobs[i].Options, &Jobs[i].BuildCount);
+        Jobs[i].OutputFile = fopen(imageJobs[i].OutputPath, "wb");
+        if (NULL == Jobs[i].OutputFile)
+        {
+            fprintf(stderr, "Can not open output image %s\n", imageJobs[i].OutputPath);
+            exit(1);
+        }
+        Batch.Order[i] = &Jobs[i];
+    }
+
+    start_stats_phase(STATS_PHASE_SCAN);
+    for (uint32_t i = 0; i < jobCount; ++i)
+    {
+        for (uint32_t j = 0; j < Jobs[i].BuildCount; ++j)
+        {
+            PARTITION_BUILD *Build = &Jobs[i].Builds[j];
+            Build->InputTree = _find_batch_tree(Jobs, i, j);
+            if (NULL == Build->InputTree)
+            {
+                _scan_partition(Build);
+            }
+
+            Jobs[i].InputSize += _get_input_size(Build->InputTree);
+            add_input_cache_tree(Batch.Cache, Build->InputTree);
+        }
+    }
+    stop_stats_phase(STATS_PHASE_SCAN);
+
+    start_stats_phase(STATS_PHASE_CACHE);
+    add_stats_counter(STATS_COUNTER_BYTES_CACHED, load_input_cache(Batch.Cache, options->Jobs));
+    stop_stats_phase(STATS_PHASE_CACHE);
+
+    // Several small images keep more threads busy than one image with all of them, the largest ones start first so none is left running alone at the end.
+    uint32_t WorkerCount = options->Jobs < jobCount ? options->Jobs : jobCount;
+    for (uint32_t i = 0; i < jobCount; ++i)
+    {
+        Jobs[i].Options.Jobs = options->Jobs / WorkerCount;
+    }
+    qsort(Batch.Order, jobCount, sizeof(*Batch.Order), _compare_batch_jobs);
+
+    // The calling thread is worker 0.
+    pthread_t *Workers = calloc(WorkerCount, sizeof(*Workers));
+    if (NULL == Workers)
+    {
+        perror("Error allocating batch workers");
+        exit(1);
+    }
+    for (uint32_t i = 1; i < WorkerCount; ++i)
+    {
+        if (0 != pthread_create(&Workers[i], NULL, _run_batch_worker, &Batch))
+        {
+            perror("Error creating batch worker");
+            exit(1);
+        }
+    }
+
+    _run_batch_worker(&Batch);
+
+    for (uint32_t i = 1; i < WorkerCount; ++i)
+    {
+        pthread_join(Workers[i], NULL);
+    }
+    free(Workers);
+
+    for (uint32_t i = 0; i < jobCount; ++i)
+    {
+        for (uint32_t j = 0; j < Jobs[i].BuildCount; ++j)
+        {
+            // Builds that share a tree point to the tree of the first build with their path.
+            if (NULL == _find_batch_tree(Jobs, i, j))
+            {
+                free_input_tree(Jobs[i].Builds[j].InputTree);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < jobCount; ++i)
+    {
+        free(Jobs[i].Builds);
+    }
+    free_input_cache(Batch.Cache);
+    free(Jobs);
+    free(Batch.Order);
+    stop_stats_phase(STATS_PHASE_TOTAL);
+}
+
+// The image is mapped once, the volumes are checked in place one after the other with all jobs.
+bool verify_image(const char *inputDirectoryPath, const char *imagePath, const IMAGE_OPTIONS *options)
+{
+    IMAGE_OPTIONS Options = _get_image_options(options);
+    options = &Options;
+    start_stats_phase(STATS_PHASE_TOTAL);
+
+    uint32_t BuildCount = 0;
+    PARTITION_BUILD *Builds = _create_partition_builds(inputDirectoryPath, options, &BuildCount);
+    bool HasInput = NULL != Builds[0].Spec.InputPath;
+    if (HasInput)
+    {
+        start_stats_phase(STATS_PHASE_SCAN);
+        _run_partition_threads(Builds, BuildCount, _scan_partition);
+        stop_stats_phase(STATS_PHASE_SCAN);
+    }
+
+    // Block devices report no size through stat, seeking to the end works for both.
+    int ImageDescriptor = open(imagePath, O_RDONLY);
+    off_t ImageSize = ImageDescriptor < 0 ? -1 : lseek(ImageDescriptor, 0, SEEK_END);
+    if (ImageSize < 0)
+    {
+        perror("Error opening image");
+        exit(1);
+    }
+
+    uint64_t NumberOfBlocks = ImageSize / LBA_SIZE;
+    if (NumberOfBlocks < ALIGNMENT * 2)
+    {
+        fprintf(stderr, "%s is too small to hold an image\n", imagePath);
+        exit(1);
+    }
+
+    const uint8_t *Image = mmap(NULL, ImageSize, PROT_READ, MAP_SHARED, ImageDescriptor, 0);
+    if (MAP_FAILED == Image)
+    {
+        perror("Error mapping image");
+        exit(1);
+    }
+
+    start_stats_phase(STATS_PHASE_VERIFY);
+    uint64_t ProblemCount = 0;
+
+    const PROTECTIVE_MBR *ProtectedMbr = (const PROTECTIVE_MBR *)Image;
+    const PARTITION_RECORD EmptyRecords[3] = {0};
+    if (0xAA55 != ProtectedMbr->Signature || 0xEE != ProtectedMbr->PartitionRecords[0].OsType || 1 != ProtectedMbr->PartitionRecords[0].StartingLBA ||
+        (NumberOfBlocks - 1 > UINT32_MAX ? UINT32_MAX : NumberOfBlocks - 1) != ProtectedMbr->PartitionRecords[0].SizeInLBA ||
+        0 != memcmp(&ProtectedMbr->PartitionRecords[1], EmptyRecords, sizeof(EmptyRecords)))
+    {
+        _report_image_problem(&ProblemCount, "The protective MBR does not cover the disk");
+    }
+
+    bool PrimaryValid = _verify_gpt_header(Image, NumberOfBlocks, 1, NumberOfBlocks - 1, "primary", &ProblemCount);
+    bool BackupValid = _verify_gpt_header(Image, NumberOfBlocks, NumberOfBlocks - 1, 1, "backup", &ProblemCount);
+    const GPT_HEADER *GptHeader = (const GPT_HEADER *)(Image + (PrimaryValid ? 1 : NumberOfBlocks - 1) * LBA_SIZE);
+    uint64_t EntryTableSize = (uint64_t)NUMBER_OF_PARTITION_ENTRIES * SIZE_OF_PARTITION_ENTRY;
+
+    if (PrimaryValid && BackupValid)
+    {
+        const GPT_HEADER *BackupGptHeader = (const GPT_HEADER *)(Image + (NumberOfBlocks - 1) * LBA_SIZE);
+        if (0 != memcmp(GptHeader->DiskGUID, BackupGptHeader->DiskGUID, sizeof(GptHeader->DiskGUID)) ||
+            GptHeader->FirstUsableLba != BackupGptHeader->FirstUsableLba || GptHeader->LastUsableLba != BackupGptHeader->LastUsableLba ||
+            0 != memcmp(Image + GptHeader->PartitionEntryLBA * LBA_SIZE, Image + BackupGptHeader->PartitionEntryLBA * LBA_SIZE, EntryTableSize))
+        {
+            _report_image_problem(&ProblemCount, "The backup GPT does not match the primary GPT");
+        }
+    }
+
+    uint32_t PartitionCount = 0;
+    const GPT_ENTRY *GptEntryTable = (const GPT_ENTRY *)(Image + GptHeader->PartitionEntryLBA * LBA_SIZE);
+    const uint8_t UnusedTypeGuid[16] = {0};
+    for (uint32_t i = 0; i < NUMBER_OF_PARTITION_ENTRIES && (PrimaryValid || BackupValid); ++i)
+    {
+        const GPT_ENTRY *Entry = &GptEntryTable[i];
+        if (0 == memcmp(Entry->PartitionTypeGUID, UnusedTypeGuid, sizeof(UnusedTypeGuid)))
+        {
+            continue;
+        }
+
+        PartitionCount++;
+        if (Entry->StartingLBA < GptHeader->FirstUsableLba || Entry->EndingLBA > GptHeader->LastUsableLba || Entry->StartingLBA > Entry->EndingLBA)
+        {
+            _report_image_problem(&ProblemCount, "Partition %u lies outside the usable LBAs", i + 1);
+            continue;
+        }
+
+        for (uint32_t j = 0; j < i; ++j)
+        {
+            if (0 != memcmp(GptEntryTable[j].PartitionTypeGUID, UnusedTypeGuid, sizeof(UnusedTypeGuid)) &&
+                Entry->StartingLBA <= GptEntryTable[j].EndingLBA && GptEntryTable[j].StartingLBA <= Entry->EndingLBA)
+            {
+                _report_image_problem(&ProblemCount, "Partitions %u and %u overlap", j + 1, i + 1);
+            }
+        }
+
+        if (options->Verbose)
+        {
+            printf("Verifying partition %u\n", i + 1);
+        }
+        const INPUT_NODE *InputTree = HasInput && PartitionCount <= BuildCount ? Builds[PartitionCount - 1].InputTree : NULL;
+        ProblemCount += verify_fat32_file_system(Image + Entry->StartingLBA * LBA_SIZE, Entry->EndingLBA - Entry->StartingLBA + 1, InputTree, options->Jobs);
+    }
+
+    if (HasInput && PartitionCount != BuildCount)
+    {
+        _report_image_problem(&ProblemCount, "The image has %u partitions, the input has %u", PartitionCount, BuildCount);
+    }
+    stop_stats_phase(STATS_PHASE_VERIFY);
+
+    munmap((void *)Image, ImageSize);
+    close(ImageDescriptor);
+    for (uint32_t i = 0; i < BuildCount && HasInput; ++i)
+    {
+        free_input_tree(Builds[i].InputTree);
+    }
+    free(Builds);
+
+    if (0 == ProblemCount && options->Verbose)
+    {
+        printf("No problems found in %s\n", imagePath);
+    }
+    else
+    {
+        fprintf(stderr, "%llu problems found in %s\n", (unsigned long long)ProblemCount, imagePath);
+    }
+
+    stop_stats_phase(STATS_PHASE_TOTAL);
+    return 0 == ProblemCount;
+}
+
+// Lays out every partition, then writes the partition table and the volumes. The input trees stay with the caller.
+static void _build_image(PARTITION_BUILD *builds, uint32_t buildCount, IMAGE_OUTPUT *output, const IMAGE_OPTIONS *options)
 {
-    create_crc32_table();
+    start_stats_phase(STATS_PHASE_LAYOUT);
+    _run_partition_threads(builds, buildCount, _lay_out_partition);
+    stop_stats_phase(STATS_PHASE_LAYOUT);
+
+    // The volumes follow each other from the first aligned LBA, their sizes are multiples of ALIGNMENT.
+    // The last partition ends one LBA after its volume, at the last usable LBA.
+    uint64_t NumberOfBlocks = ALIGNMENT * 2;
+    for (uint32_t i = 0; i < buildCount; ++i)
+    {
+        builds[i].StartingLBA = NumberOfBlocks - ALIGNMENT;
+        NumberOfBlocks += builds[i].UsableBlocks;
+    }
 
     PROTECTIVE_MBR ProtectedMbr =
     {
@@ -93,7 +503,7 @@ void write_image(const char* inputDirectoryPath, FILE *outputFile)
                     .OsType = 0xEE,
                     .EndingCHS = {0xFF, 0xFF, 0xFF},
                     .StartingLBA = 0x00000001,
-                    .SizeInLBA = NUMBER_OF_BLOCKS - 1,
+                    .SizeInLBA = NumberOfBlocks - 1 > UINT32_MAX ? UINT32_MAX : NumberOfBlocks - 1,
                 },
                 {0},
                 {0},
@@ -105,59 +515,56 @@ void write_image(const char* inputDirectoryPath, FILE *outputFile)
 #endif /* LBA_SIZE > 512 */
     };
 
-    GPT_ENTRY GptEntryTable[ALIGNMENT * 4 - 8] = {
-        {
-            .PartitionTypeGUID = EFI_SYSTEM_PARTITION_GUID,
-            .UniquePartitionGUID = {0},
-            .StartingLBA = ALIGNMENT,
-            .EndingLBA = NUMBER_OF_BLOCKS - ALIGNMENT,
-            .Attributes = 0,
-            .PartitionName = u"BontaOS.hdd1",
-#if SIZE_OF_PARTITION_ENTRY > 128
-            .Reserved = {0},
-#endif
-        },
-        {0},
-    };
-    get_guid(GptEntryTable[0].UniquePartitionGUID);
+    GPT_ENTRY GptEntryTable[NUMBER_OF_PARTITION_ENTRIES] = {0};
+    for (uint32_t i = 0; i < buildCount; ++i)
+    {
+        memcpy(GptEntryTable[i].PartitionTypeGUID, builds[i].Spec.TypeGuid, sizeof(GptEntryTable[i].PartitionTypeGUID));
+        GptEntryTable[i].StartingLBA = builds[i].StartingLBA;
+        GptEntryTable[i].EndingLBA = builds[i].StartingLBA + builds[i].UsableBlocks - (i + 1 < buildCount ? 1 : 0);
+        _set_partition_name(&GptEntryTable[i], &builds[i]);
+    }
 
     GPT_HEADER GptHeader =
         {
-            .Signature = 0x5452415020494645,
+            .Signature = GPT_SIGNATURE,
             .Revision = 0x00010000,
             .HeaderSize = 92,
             .HeaderCRC32 = 0,
             .Reserved = 0,
             .MyLBA = 1,
-            .AlternateLBA = NUMBER_OF_BLOCKS - 1,
+            .AlternateLBA = NumberOfBlocks - 1,
             .FirstUsableLba = ALIGNMENT,
-            .LastUsableLba = NUMBER_OF_BLOCKS - ALIGNMENT,
+            .LastUsableLba = NumberOfBlocks - ALIGNMENT,
             .DiskGUID = {0},
             .PartitionEntryLBA = 2,
-            .NumberOfPartitionEntries = ALIGNMENT * 4 - 8,
+            .NumberOfPartitionEntries = NUMBER_OF_PARTITION_ENTRIES,
             .SizeOfPartitionEntries = SIZE_OF_PARTITION_ENTRY,
             .PartitionEntryCRC32 = 0,
             .ReservedPadding = {0},
         };
 
-    get_guid(GptHeader.DiskGUID);
-    GptHeader.PartitionEntryCRC32 = calculate_crc32(GptEntryTable, (ALIGNMENT * 4 - 8) * sizeof(*GptEntryTable));
+    start_stats_phase(STATS_PHASE_GPT);
+    _get_disk_guids(builds, buildCount, options, GptHeader.DiskGUID, GptEntryTable);
+
+    // Both headers describe the same entry array, so its CRC is computed once.
+    uint32_t PartitionEntryCRC32 = calculate_crc32(GptEntryTable, sizeof(GptEntryTable));
+    GptHeader.PartitionEntryCRC32 = PartitionEntryCRC32;
     GptHeader.HeaderCRC32 = calculate_crc32(&GptHeader, GptHeader.HeaderSize);
 
     GPT_HEADER BackupGptHeader =
         {
-            .Signature = 0x5452415020494645,
+            .Signature = GPT_SIGNATURE,
             .Revision = 0x00010000,
             .HeaderSize = 92,
             .HeaderCRC32 = 0,
             .Reserved = 0,
-            .MyLBA = NUMBER_OF_BLOCKS - 1,
+            .MyLBA = NumberOfBlocks - 1,
             .AlternateLBA = 1,
             .FirstUsableLba = ALIGNMENT,
-            .LastUsableLba = NUMBER_OF_BLOCKS - ALIGNMENT,
+            .LastUsableLba = NumberOfBlocks - ALIGNMENT,
             .DiskGUID = {0},
-            .PartitionEntryLBA = NUMBER_OF_BLOCKS - ALIGNMENT + 1,
-            .NumberOfPartitionEntries = ALIGNMENT * 4 - 8,
+            .PartitionEntryLBA = NumberOfBlocks - ALIGNMENT + 1,
+            .NumberOfPartitionEntries = NUMBER_OF_PARTITION_ENTRIES,
             .SizeOfPartitionEntries = SIZE_OF_PARTITION_ENTRY,
             .PartitionEntryCRC32 = 0,
             .ReservedPadding = {0},
@@ -167,52 +574,466 @@ void write_image(const char* inputDirectoryPath, FILE *outputFile)
     {
         BackupGptHeader.DiskGUID[i] = GptHeader.DiskGUID[i];
     }
-    BackupGptHeader.PartitionEntryCRC32 = calculate_crc32(GptEntryTable, (ALIGNMENT * 4 - 8) * sizeof(*GptEntryTable));
+    BackupGptHeader.PartitionEntryCRC32 = PartitionEntryCRC32;
     BackupGptHeader.HeaderCRC32 = calculate_crc32(&BackupGptHeader, BackupGptHeader.HeaderSize);
 
-    fwrite(&ProtectedMbr, sizeof(ProtectedMbr), 1, outputFile);
-    fwrite(&GptHeader, sizeof(GptHeader), 1, outputFile);
-    fwrite(GptEntryTable, sizeof(*GptEntryTable), ALIGNMENT * 4 - 8, outputFile);
+    write_output_region(output, 0, &ProtectedMbr, sizeof(ProtectedMbr));
+    write_output_region(output, GptHeader.MyLBA * LBA_SIZE, &GptHeader, sizeof(GptHeader));
+    write_output_region(output, GptHeader.PartitionEntryLBA * LBA_SIZE, GptEntryTable, sizeof(GptEntryTable));
+    stop_stats_phase(STATS_PHASE_GPT);
 
-    init_fat32_file_system();
-    format_fat32_file_system();
-    copy_input_directory(inputDirectoryPath);
-    write_fat32_file_system(outputFile);
-    
-    uint8_t lba[LBA_SIZE] = {0};
-    fwrite(lba, sizeof(lba), 1, outputFile);
-    fwrite(GptEntryTable, sizeof(*GptEntryTable), ALIGNMENT * 4 - 8, outputFile);
-    fwrite(&BackupGptHeader, sizeof(BackupGptHeader), 1, outputFile);
+    // Written one after the other in LBA order, which a stream needs anyway. Each volume copies its file data with all jobs.
+    for (uint32_t i = 0; i < buildCount; ++i)
+    {
+        write_fat32_file_system(builds[i].Volume, output, builds[i].StartingLBA * LBA_SIZE, options->Jobs);
+        free_fat32_file_system(builds[i].Volume);
+    }
 
-    fclose(outputFile);
+    // The last LBA of the last partition is never used by the volume.
+    skip_output_region(output, GptEntryTable[buildCount - 1].EndingLBA * LBA_SIZE, LBA_SIZE);
+    start_stats_phase(STATS_PHASE_GPT);
+    write_output_region(output, BackupGptHeader.PartitionEntryLBA * LBA_SIZE, GptEntryTable, sizeof(GptEntryTable));
+    write_output_region(output, BackupGptHeader.MyLBA * LBA_SIZE, &BackupGptHeader, sizeof(BackupGptHeader));
+    stop_stats_phase(STATS_PHASE_GPT);
+
+    finish_image_output(output, NumberOfBlocks * LBA_SIZE);
 }
 
-static void create_crc32_table(void)
+static void _init_output(IMAGE_OUTPUT *output, FILE *outputFile, const IMAGE_SINK *sink, DEVICE_WRITER *devices, const IMAGE_OPTIONS *options)
 {
-    uint32_t c = 0;
+    if (NULL != sink)
+    {
+        init_sink_image_output(output, sink);
+    }
+    else if (NULL != devices)
+    {
+        init_device_image_output(output, devices);
+    }
+    else if (IMAGE_FORMAT_ZSTD == options->Format)
+    {
+        init_zstd_image_output(output, outputFile, options->Jobs);
+    }
+    else
+    {
+        init_image_output(output, outputFile, options->Sparse, options->Format);
+    }
+}
 
-    for (int32_t n = 0; n < 256; n++)
+// Without partition specs the input directory becomes the EFI system partition, sized by the image options.
+static PARTITION_BUILD *_create_partition_builds(const char *inputDirectoryPath, const IMAGE_OPTIONS *options, uint32_t *buildCount)
+{
+    *buildCount = 0 != options->PartitionCount ? options->PartitionCount : 1;
+    PARTITION_BUILD *builds = calloc(*buildCount, sizeof(*builds));
+    if (NULL == builds)
     {
-        c = (uint32_t)n;
-        for (uint8_t k = 0; k < 8; k++)
+        perror("Error allocating partitions");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < *buildCount; ++i)
+    {
+        builds[i].Index = i;
+        builds[i].Options = options;
+    }
+
+    if (0 != options->PartitionCount)
+    {
+        for (uint32_t i = 0; i < *buildCount; ++i)
         {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
+            builds[i].Spec = options->Partitions[i];
+            builds[i].AutoSize = 0 == builds[i].Spec.Size;
+            builds[i].RequestedBlocks = builds[i].Spec.Size / LBA_SIZE / ALIGNMENT * ALIGNMENT;
         }
-        crc_table[n] = c;
+        return builds;
+    }
+
+    const uint8_t EfiSystemPartitionGuid[16] = EFI_SYSTEM_PARTITION_GUID;
+    builds[0].Spec.InputPath = inputDirectoryPath;
+    memcpy(builds[0].Spec.TypeGuid, EfiSystemPartitionGuid, sizeof(EfiSystemPartitionGuid));
+    builds[0].AutoSize = options->AutoSize;
+    builds[0].RequestedBlocks = DEFAULT_USABLE_BLOCKS;
+    if (0 != options->ImageSize)
+    {
+        uint64_t requested_blocks = options->ImageSize / LBA_SIZE;
+        builds[0].RequestedBlocks = requested_blocks > ALIGNMENT * 2 ? (requested_blocks - ALIGNMENT * 2) / ALIGNMENT * ALIGNMENT : 0;
+    }
+
+    return builds;
+}
+
+// The first partition runs on the calling thread.
+static void _run_partition_threads(PARTITION_BUILD *builds, uint32_t buildCount, void *(*routine)(void *))
+{
+    pthread_t *threads = calloc(buildCount, sizeof(*threads));
+    if (NULL == threads)
+    {
+        perror("Error allocating partition threads");
+        exit(1);
+    }
+
+    for (uint32_t i = 1; i < buildCount; ++i)
+    {
+        if (0 != pthread_create(&threads[i], NULL, routine, &builds[i]))
+        {
+            perror("Error creating partition thread");
+            exit(1);
+        }
+    }
+
+    routine(&builds[0]);
+
+    for (uint32_t i = 1; i < buildCount; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+static void *_scan_partition(void *argument)
+{
+    PARTITION_BUILD *build = argument;
+
+    const char *input_path = build->Spec.InputPath;
+    build->InputTree = is_input_archive(input_path) ? scan_input_archive(input_path) : scan_input_directory(input_path, build->Options->Jobs);
+    if (build->Options->Reproducible)
+    {
+        sort_input_tree(build->InputTree);
+    }
+
+    return NULL;
+}
+
+static void *_lay_out_partition(void *argument)
+{
+    PARTITION_BUILD *build = argument;
+
+    build->Volume = init_fat32_file_system(build->Options->BuildTime, build->Options->Reproducible, build->Options->Verbose);
+    build->UsableBlocks = _get_usable_blocks(build);
+    format_fat32_file_system(build->Volume, build->UsableBlocks);
+    copy_input_tree(build->Volume, build->InputTree);
+
+    return NULL;
+}
+
+static void _set_partition_name(GPT_ENTRY *entry, const PARTITION_BUILD *build)
+{
+    char name[sizeof(entry->PartitionName) / sizeof(entry->PartitionName[0]) + 1] = {0};
+    if (NULL != build->Spec.Name)
+    {
+        strncpy(name, build->Spec.Name, sizeof(name) - 1);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "BontaOS.hdd%u", build->Index + 1);
+    }
+
+    for (uint32_t i = 0; '\0' != name[i] && i < sizeof(entry->PartitionName) / sizeof(entry->PartitionName[0]); ++i)
+    {
+        entry->PartitionName[i] = (char16_t)(unsigned char)name[i];
+    }
+}
+
+// The partition layout is taken from the image, only the volume contents change.
+static void _update_image(const INPUT_NODE *inputTree, FILE *outputFile, const IMAGE_OPTIONS *options)
+{
+    IMAGE_OUTPUT Output;
+    // Blocks that become zero still have to overwrite the old data, so holes are never left.
+    init_image_output(&Output, outputFile, false, IMAGE_FORMAT_RAW);
+
+    start_stats_phase(STATS_PHASE_GPT);
+    GPT_HEADER GptHeader;
+    read_output_region(&Output, 1 * LBA_SIZE, &GptHeader, sizeof(GptHeader));
+
+    uint32_t HeaderCRC32 = GptHeader.HeaderCRC32;
+    GptHeader.HeaderCRC32 = 0;
+    if (GPT_SIGNATURE != GptHeader.Signature || 92 != GptHeader.HeaderSize || HeaderCRC32 != calculate_crc32(&GptHeader, GptHeader.HeaderSize) ||
+        NUMBER_OF_PARTITION_ENTRIES != GptHeader.NumberOfPartitionEntries || SIZE_OF_PARTITION_ENTRY != GptHeader.SizeOfPartitionEntries)
+    {
+        fprintf(stderr, "The output image has no valid GPT header\n");
+        exit(1);
+    }
+
+    uint64_t EntryTableSize = (uint64_t)NUMBER_OF_PARTITION_ENTRIES * SIZE_OF_PARTITION_ENTRY;
+    GPT_ENTRY *GptEntryTable = malloc(EntryTableSize);
+    GPT_ENTRY *BackupGptEntryTable = malloc(EntryTableSize);
+    if (NULL == GptEntryTable || NULL == BackupGptEntryTable)
+    {
+        perror("Error allocating partition entries");
+        exit(1);
+    }
+    read_output_region(&Output, GptHeader.PartitionEntryLBA * LBA_SIZE, GptEntryTable, EntryTableSize);
+
+    const uint8_t EfiSystemPartitionGuid[16] = EFI_SYSTEM_PARTITION_GUID;
+    if (0 != memcmp(GptEntryTable[0].PartitionTypeGUID, EfiSystemPartitionGuid, sizeof(EfiSystemPartitionGuid)) ||
+        GptEntryTable[0].StartingLBA < GptHeader.FirstUsableLba || GptEntryTable[0].EndingLBA > GptHeader.LastUsableLba)
+    {
+        fprintf(stderr, "The output image has no EFI system partition\n");
+        exit(1);
+    }
+
+    stop_stats_phase(STATS_PHASE_GPT);
+
+    start_stats_phase(STATS_PHASE_LAYOUT);
+    FAT32_VOLUME *Volume = init_fat32_file_system(options->BuildTime, options->Reproducible, options->Verbose);
+    load_fat32_file_system(Volume, &Output, GptEntryTable[0].StartingLBA * LBA_SIZE, GptEntryTable[0].EndingLBA - GptEntryTable[0].StartingLBA + 1);
+    copy_input_tree(Volume, inputTree);
+    stop_stats_phase(STATS_PHASE_LAYOUT);
+    write_fat32_file_system(Volume, &Output, GptEntryTable[0].StartingLBA * LBA_SIZE, options->Jobs);
+    free_fat32_file_system(Volume);
+
+    start_stats_phase(STATS_PHASE_GPT);
+
+    // The partition table itself is unchanged. Both headers get fresh CRCs and the backup entries are only rewritten if they got damaged.
+    uint32_t PartitionEntryCRC32 = calculate_crc32(GptEntryTable, EntryTableSize);
+
+    GptHeader.PartitionEntryCRC32 = PartitionEntryCRC32;
+    GptHeader.HeaderCRC32 = calculate_crc32(&GptHeader, GptHeader.HeaderSize);
+
+    GPT_HEADER BackupGptHeader = GptHeader;
+    BackupGptHeader.MyLBA = GptHeader.AlternateLBA;
+    BackupGptHeader.AlternateLBA = GptHeader.MyLBA;
+    BackupGptHeader.PartitionEntryLBA = GptHeader.LastUsableLba + 1;
+    BackupGptHeader.HeaderCRC32 = 0;
+    BackupGptHeader.HeaderCRC32 = calculate_crc32(&BackupGptHeader, BackupGptHeader.HeaderSize);
+
+    read_output_region(&Output, BackupGptHeader.PartitionEntryLBA * LBA_SIZE, BackupGptEntryTable, EntryTableSize);
+    if (0 != memcmp(GptEntryTable, BackupGptEntryTable, EntryTableSize))
+    {
+        write_output_region(&Output, BackupGptHeader.PartitionEntryLBA * LBA_SIZE, GptEntryTable, EntryTableSize);
     }
+
+    write_output_region(&Output, GptHeader.MyLBA * LBA_SIZE, &GptHeader, sizeof(GptHeader));
+    write_output_region(&Output, BackupGptHeader.MyLBA * LBA_SIZE, &BackupGptHeader, sizeof(BackupGptHeader));
+    stop_stats_phase(STATS_PHASE_GPT);
+
+    finish_image_output(&Output, (BackupGptHeader.MyLBA + 1) * LBA_SIZE);
+    free(BackupGptEntryTable);
+    free(GptEntryTable);
 }
 
-static uint32_t calculate_crc32(void *buf, int32_t len)
+// FAT sectors and LBAs have the same size, so volume sectors and partition blocks are interchangeable.
+// The cluster size is selected here as well, an auto sized volume depends on it and it depends on a fixed volume size.
+static uint64_t _get_usable_blocks(PARTITION_BUILD *build)
 {
-    uint8_t *bufp = buf;
-    uint32_t c = 0xFFFFFFFFL;
+    const IMAGE_OPTIONS *options = build->Options;
+    uint64_t usable_blocks = build->RequestedBlocks;
+
+    if (build->AutoSize)
+    {
+        select_fat32_cluster_size(build->Volume, build->InputTree, options->ClusterSize, 0);
+        uint64_t cluster_count = count_fat32_clusters(build->Volume, build->InputTree);
+        cluster_count += cluster_count * options->Headroom / 100;
+
+        usable_blocks = calculate_fat32_volume_sectors(build->Volume, cluster_count);
+        if (0 == usable_blocks)
+        {
+            fprintf(stderr, "The input of partition %u does not fit in a FAT32 volume\n", build->Index + 1);
+            exit(1);
+        }
+        usable_blocks = (usable_blocks + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+    else
+    {
+        select_fat32_cluster_size(build->Volume, build->InputTree, options->ClusterSize, usable_blocks);
+        // Automatic selection falls back to the smallest clusters for a volume this small, a chosen size has its own minimum.
+        uint64_t minimum_blocks = calculate_fat32_volume_sectors(build->Volume, 0);
+        minimum_blocks = (minimum_blocks + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        const char *hint = 0 != options->ClusterSize ? " with this --cluster-size" : "";
+        if (usable_blocks < minimum_blocks && 0 == options->PartitionCount)
+        {
+            fprintf(stderr, "Image size too small for FAT32, the minimum is %llu bytes%s\n", (unsigned long long)(minimum_blocks + ALIGNMENT * 2) * LBA_SIZE, hint);
+            exit(1);
+        }
+        if (usable_blocks < minimum_blocks)
+        {
+            fprintf(stderr, "Partition %u too small for FAT32, the minimum is %llu bytes%s\n", build->Index + 1, (unsigned long long)minimum_blocks * LBA_SIZE, hint);
+            exit(1);
+        }
+    }
 
-    for (int32_t n = 0; n < len; n++)
-        c = crc_table[(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
+    // TotalSectors32 can not describe anything larger.
+    if (usable_blocks > UINT32_MAX / ALIGNMENT * ALIGNMENT)
+    {
+        fprintf(stderr, "Image size too large for FAT32\n");
+        exit(1);
+    }
+
+    return usable_blocks;
+}
+
+// Partition i gets seeded GUID 1 + i, a single partition keeps the GUIDs of a single input tree.
+static void _get_disk_guids(const PARTITION_BUILD *builds, uint32_t buildCount, const IMAGE_OPTIONS *options, uint8_t diskGuid[16], GPT_ENTRY *entries)
+{
+    if (!options->Reproducible)
+    {
+        get_guid(diskGuid);
+        for (uint32_t i = 0; i < buildCount; ++i)
+        {
+            get_guid(entries[i].UniquePartitionGUID);
+        }
+        return;
+    }
+
+    if (NULL != options->Seed)
+    {
+        get_seeded_guid(diskGuid, options->Seed, strlen(options->Seed), 0);
+        for (uint32_t i = 0; i < buildCount; ++i)
+        {
+            get_seeded_guid(entries[i].UniquePartitionGUID, options->Seed, strlen(options->Seed), 1 + i);
+        }
+        return;
+    }
+
+    uint64_t *TreeHashes = calloc(buildCount, sizeof(*TreeHashes));
+    if (NULL == TreeHashes)
+    {
+        perror("Error allocating tree hashes");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < buildCount; ++i)
+    {
+        TreeHashes[i] = hash_input_tree(builds[i].InputTree);
+    }
+
+    get_seeded_guid(diskGuid, TreeHashes, buildCount * sizeof(*TreeHashes), 0);
+    for (uint32_t i = 0; i < buildCount; ++i)
+    {
+        get_seeded_guid(entries[i].UniquePartitionGUID, TreeHashes, buildCount * sizeof(*TreeHashes), 1 + i);
+    }
+    free(TreeHashes);
+}
+
+// Checks one GPT header and its entry array. Returns false when they can not be trusted to find the partitions.
+static bool _verify_gpt_header(const uint8_t *image, uint64_t numberOfBlocks, uint64_t myLba, uint64_t alternateLba, const char *name, uint64_t *problemCount)
+{
+    GPT_HEADER Header = *(const GPT_HEADER *)(image + myLba * LBA_SIZE);
+    uint32_t HeaderCRC32 = Header.HeaderCRC32;
+    Header.HeaderCRC32 = 0;
+    if (GPT_SIGNATURE != Header.Signature || 92 != Header.HeaderSize || HeaderCRC32 != calculate_crc32(&Header, Header.HeaderSize))
+    {
+        _report_image_problem(problemCount, "The %s GPT header is invalid", name);
+        return false;
+    }
+
+    if (myLba != Header.MyLBA || alternateLba != Header.AlternateLBA)
+    {
+        _report_image_problem(problemCount, "The %s GPT header does not point to itself and the other header", name);
+    }
+
+    uint64_t EntryTableBlocks = (uint64_t)NUMBER_OF_PARTITION_ENTRIES * SIZE_OF_PARTITION_ENTRY / LBA_SIZE;
+    if (NUMBER_OF_PARTITION_ENTRIES != Header.NumberOfPartitionEntries || SIZE_OF_PARTITION_ENTRY != Header.SizeOfPartitionEntries ||
+        Header.FirstUsableLba > Header.LastUsableLba || Header.LastUsableLba >= numberOfBlocks - 1 ||
+        Header.PartitionEntryLBA < 2 || Header.PartitionEntryLBA + EntryTableBlocks > numberOfBlocks - 1 ||
+        (Header.PartitionEntryLBA + EntryTableBlocks > Header.FirstUsableLba && Header.PartitionEntryLBA <= Header.LastUsableLba))
+    {
+        _report_image_problem(problemCount, "The %s GPT header has an invalid layout", name);
+        return false;
+    }
+
+    if (Header.PartitionEntryCRC32 != calculate_crc32(image + Header.PartitionEntryLBA * LBA_SIZE, EntryTableBlocks * LBA_SIZE))
+    {
+        _report_image_problem(problemCount, "The %s GPT partition entries do not match their CRC", name);
+        return false;
+    }
+
+    return true;
+}
+
+// Returns the tree of the first build before this one that has the same input path, NULL when this build is the first.
+static INPUT_NODE *_find_batch_tree(BATCH_JOB *jobs, uint32_t jobIndex, uint32_t buildIndex)
+{
+    const char *input_path = jobs[jobIndex].Builds[buildIndex].Spec.InputPath;
+
+    for (uint32_t i = 0; i <= jobIndex; ++i)
+    {
+        for (uint32_t j = 0; j < (i < jobIndex ? jobs[i].BuildCount : buildIndex); ++j)
+        {
+            if (0 == strcmp(jobs[i].Builds[j].Spec.InputPath, input_path))
+            {
+                return jobs[i].Builds[j].InputTree;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t _get_input_size(const INPUT_NODE *directory)
+{
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < directory->ChildCount; ++i)
+    {
+        size += directory->Children[i].IsDirectory ? _get_input_size(&directory->Children[i]) : directory->Children[i].Size;
+    }
+
+    return size;
+}
+
+// Each image is built with the share of the threads that its job got, its cached files are let go as soon as it is written.
+static void *_run_batch_worker(void *argument)
+{
+    IMAGE_BATCH *batch = argument;
+    uint32_t index;
+
+    while ((index = atomic_fetch_add(&batch->NextJob, 1)) < batch->JobCount)
+    {
+        BATCH_JOB *job = batch->Order[index];
+
+        IMAGE_OUTPUT Output;
+        _init_output(&Output, job->OutputFile, NULL, NULL, &job->Options);
+        _build_image(job->Builds, job->BuildCount, &Output, &job->Options);
+        fclose(job->OutputFile);
+
+        for (uint32_t i = 0; i < job->BuildCount; ++i)
+        {
+            release_input_cache_tree(batch->Cache, job->Builds[i].InputTree);
+        }
+    }
+
+    // The phases of the images add up over all workers.
+    merge_stats_phases();
+    return NULL;
+}
+
+static int _compare_batch_jobs(const void *first, const void *second)
+{
+    uint64_t first_size = (*(BATCH_JOB *const *)first)->InputSize;
+    uint64_t second_size = (*(BATCH_JOB *const *)second)->InputSize;
+
+    return (first_size < second_size) - (first_size > second_size);
+}
+
+// Library callers often zero the options, 0 jobs means a single thread.
+static IMAGE_OPTIONS _get_image_options(const IMAGE_OPTIONS *options)
+{
+    IMAGE_OPTIONS image_options = *options;
+    if (0 == image_options.Jobs)
+    {
+        image_options.Jobs = 1;
+    }
+    _check_image_format(&image_options);
+
+    return image_options;
+}
+
+// Runs before anything is written, an unsupported format would otherwise fail after the output was truncated.
+static void _check_image_format(const IMAGE_OPTIONS *options)
+{
+    if (IMAGE_FORMAT_ZSTD == options->Format && !is_zstd_image_supported())
+    {
+        fprintf(stderr, "%s\n", ZSTD_IMAGE_UNSUPPORTED_MESSAGE);
+        exit(1);
+    }
+}
+
+static void _report_image_problem(uint64_t *problemCount, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+    fputc('\n', stderr);
 
-    // Invert bits for return value
-    return c ^ 0xFFFFFFFFL;
+    (*problemCount)++;
 }
@@ -1,8 +1,82 @@
 #ifndef _WRITE_IMAGE_H_
 #define _WRITE_IMAGE_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdio.h>
 
-void write_image(const char* inputDirectoryPath, FILE *outputFile);
+#include "image_output.h"
+#include "input_scan.h"
+
+typedef struct _PARTITION_SPEC
+{
+    const char *InputPath;
+    // Partition size in bytes rounded down to whole MiB, 0 sizes it to the input plus the headroom.
+    uint64_t Size;
+    uint8_t TypeGuid[16];
+    // ASCII, NULL names the partition after its position.
+    const char *Name;
+} PARTITION_SPEC;
+
+typedef struct _IMAGE_OPTIONS
+{
+    bool Sparse;
+    IMAGE_FORMAT Format;
+    // Write the image straight to these block devices or files instead of the output file, with QueueDepth blocks in flight.
+    const char *const *Devices;
+    uint32_t DeviceCount;
+    uint32_t QueueDepth;
+    // Worker threads for scanning, copying, compressing and verifying, 0 means one.
+    uint32_t Jobs;
+    // Total image size in bytes rounded down to whole MiB, 0 keeps the default 4 GiB volume.
+    uint64_t ImageSize;
+    // Size the volume to the input tree plus Headroom percent instead.
+    bool AutoSize;
+    uint32_t Headroom;
+    // FAT32 cluster size in bytes, 0 picks one from the sizes of the input files.
+    uint32_t ClusterSize;
+    // One FAT32 volume per partition, built in parallel. Without partitions the input directory becomes a single EFI system partition.
+    const PARTITION_SPEC *Partitions;
+    uint32_t PartitionCount;
+    // Bring an existing image in line with the input instead of creating a new one.
+    bool Update;
+    // Identical inputs give byte identical images: sorted entries, BuildTime on every entry and GUIDs derived from Seed,
+    // or from the input tree when Seed is NULL.
+    bool Reproducible;
+    const char *Seed;
+    time_t BuildTime;
+    // Batches keep the files that several of their images contain in memory, up to CacheSize bytes.
+    uint64_t CacheSize;
+    // Report every entry that is added, updated or removed and every verified partition on stdout. Problems always go to stderr.
+    bool Verbose;
+} IMAGE_OPTIONS;
+
+// One image of a batch. Options is used as is, only its Jobs are replaced by a share of the jobs of the batch.
+typedef struct _IMAGE_JOB
+{
+    // Ignored when Options.Partitions is set.
+    const char *InputPath;
+    const char *OutputPath;
+    IMAGE_OPTIONS Options;
+} IMAGE_JOB;
+
+// inputDirectoryPath is ignored when options->Partitions is set.
+void write_image(const char* inputDirectoryPath, FILE *outputFile, const IMAGE_OPTIONS *options);
+
+// Builds the image from trees that are already in memory, one per partition or a single one without partitions.
+// The image goes to outputFile, the devices of the options or the sink when it is not NULL. Neither the trees nor outputFile are freed,
+// reproducible builds sort the trees in place.
+void write_image_trees(INPUT_NODE *const *inputTrees, FILE *outputFile, const IMAGE_SINK *sink, const IMAGE_OPTIONS *options);
+
+// Builds new images from a manifest of jobs with options->Jobs threads in total. Every input path is scanned once for all jobs
+// that name it and files that several images contain are read once into a cache of options->CacheSize bytes. The images are
+// built largest first, up to options->Jobs at once with an equal share of the threads each.
+void write_image_batch(const IMAGE_JOB *imageJobs, uint32_t jobCount, const IMAGE_OPTIONS *options);
+
+// Checks an existing raw image or device: the protective MBR, both GPT headers and entry arrays, then every FAT32 volume with options->Jobs threads.
+// The volumes are also compared with inputDirectoryPath, or with the inputs of options->Partitions, when they are set.
+// Prints each problem and returns true when there was none.
+bool verify_image(const char *inputDirectoryPath, const char *imagePath, const IMAGE_OPTIONS *options);
 
 #endif /* _GPT_H_ */
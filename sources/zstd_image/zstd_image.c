@@ -0,0 +1,443 @@
+#include "zstd_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+bool is_zstd_image_supported(void)
+{
+#ifdef HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_ZSTD
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#define COMPRESSION_LEVEL 3
+#define FRAMES_PER_JOB 4
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEK_TABLE_FOOTER_SIZE 9
+
+typedef enum _FRAME_STATE
+{
+    FRAME_FREE,
+    FRAME_FILLING,
+    FRAME_QUEUED,
+    FRAME_DONE,
+} FRAME_STATE;
+
+typedef struct _ZSTD_FRAME
+{
+    uint8_t *Data;
+    uint64_t Size;
+    // Nothing was written into Data yet, the frame is all zeros up to Size.
+    bool Untouched;
+    uint8_t *Compressed;
+    uint64_t CompressedSize;
+    FRAME_STATE State;
+} ZSTD_FRAME;
+
+typedef struct _SEEK_ENTRY
+{
+    uint32_t CompressedSize;
+    uint32_t DecompressedSize;
+} SEEK_ENTRY;
+
+// Frame n lives in slot n % FrameCount. The calling thread fills frames and writes finished ones in order, workers compress them.
+struct _ZSTD_IMAGE
+{
+    int Descriptor;
+    uint64_t Position;
+    ZSTD_FRAME *Frames;
+    uint32_t FrameCount;
+    uint64_t SubmittedFrames;
+    uint64_t ClaimedFrames;
+    uint64_t WrittenFrames;
+    // Frame SubmittedFrames is being filled, only the calling thread looks at it.
+    bool Filling;
+    bool Stopping;
+    pthread_t *Workers;
+    uint32_t WorkerCount;
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+    // A full frame of zeros is compressed once, every further one reuses it.
+    uint8_t *ZeroFrame;
+    uint64_t ZeroFrameSize;
+    SEEK_ENTRY *SeekEntries;
+    uint64_t SeekEntryCapacity;
+};
+
+static ZSTD_FRAME *_get_filling_frame(ZSTD_IMAGE *image);
+static void _submit_frame(ZSTD_IMAGE *image, ZSTD_FRAME *frame);
+static void _write_next_frame(ZSTD_IMAGE *image);
+static void *_run_compressor(void *argument);
+static uint64_t _compress_frame(ZSTD_CCtx *context, ZSTD_FRAME *frame);
+static void _write_bytes(int descriptor, const void *buffer, uint64_t size);
+static bool _is_zero(const uint8_t *buffer, uint64_t size);
+
+ZSTD_IMAGE *open_zstd_image(int descriptor, uint32_t jobs)
+{
+    ZSTD_IMAGE *image = calloc(1, sizeof(*image));
+    if (NULL == image)
+    {
+        perror("Error allocating zstd image");
+        exit(1);
+    }
+
+    image->Descriptor = descriptor;
+    image->FrameCount = jobs * FRAMES_PER_JOB;
+    image->WorkerCount = jobs;
+    image->Frames = calloc(image->FrameCount, sizeof(*image->Frames));
+    image->Workers = calloc(jobs, sizeof(*image->Workers));
+    image->ZeroFrame = malloc(ZSTD_compressBound(ZSTD_FRAME_SIZE));
+    if (NULL == image->Frames || NULL == image->Workers || NULL == image->ZeroFrame)
+    {
+        perror("Error allocating zstd image");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < image->FrameCount; ++i)
+    {
+        image->Frames[i].Data = malloc(ZSTD_FRAME_SIZE);
+        image->Frames[i].Compressed = malloc(ZSTD_compressBound(ZSTD_FRAME_SIZE));
+        if (NULL == image->Frames[i].Data || NULL == image->Frames[i].Compressed)
+        {
+            perror("Error allocating zstd frames");
+            exit(1);
+        }
+    }
+
+    uint8_t *zeros = calloc(1, ZSTD_FRAME_SIZE);
+    if (NULL == zeros)
+    {
+        perror("Error allocating zstd image");
+        exit(1);
+    }
+    image->ZeroFrameSize = ZSTD_compress(image->ZeroFrame, ZSTD_compressBound(ZSTD_FRAME_SIZE), zeros, ZSTD_FRAME_SIZE, COMPRESSION_LEVEL);
+    free(zeros);
+    if (ZSTD_isError(image->ZeroFrameSize))
+    {
+        fprintf(stderr, "Error compressing image: %s\n", ZSTD_getErrorName(image->ZeroFrameSize));
+        exit(1);
+    }
+
+    pthread_mutex_init(&image->Lock, NULL);
+    pthread_cond_init(&image->Changed, NULL);
+
+    for (uint32_t i = 0; i < jobs; ++i)
+    {
+        if (0 != pthread_create(&image->Workers[i], NULL, _run_compressor, image))
+        {
+            perror("Error creating zstd compressor");
+            exit(1);
+        }
+    }
+
+    return image;
+}
+
+void write_zstd_region(ZSTD_IMAGE *image, uint64_t offset, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+
+    if (offset < image->Position)
+    {
+        fprintf(stderr, "Compressed image written out of order at offset %llu\n", (unsigned long long)offset);
+        exit(1);
+    }
+
+    // Gaps only grow the frame, an untouched frame needs no zeros in its buffer.
+    while (image->Position < offset)
+    {
+        ZSTD_FRAME *frame = _get_filling_frame(image);
+        uint64_t piece = ZSTD_FRAME_SIZE - frame->Size;
+        piece = piece < offset - image->Position ? piece : offset - image->Position;
+        if (!frame->Untouched)
+        {
+            memset(frame->Data + frame->Size, 0, piece);
+        }
+
+        frame->Size += piece;
+        image->Position += piece;
+        if (ZSTD_FRAME_SIZE == frame->Size)
+        {
+            _submit_frame(image, frame);
+        }
+    }
+
+    while (size > 0)
+    {
+        ZSTD_FRAME *frame = _get_filling_frame(image);
+        if (frame->Untouched)
+        {
+            memset(frame->Data, 0, frame->Size);
+            frame->Untouched = false;
+        }
+
+        uint64_t piece = ZSTD_FRAME_SIZE - frame->Size;
+        piece = piece < size ? piece : size;
+        memcpy(frame->Data + frame->Size, data, piece);
+
+        frame->Size += piece;
+        image->Position += piece;
+        data += piece;
+        size -= piece;
+        if (ZSTD_FRAME_SIZE == frame->Size)
+        {
+            _submit_frame(image, frame);
+        }
+    }
+}
+
+void close_zstd_image(ZSTD_IMAGE *image, uint64_t image_size)
+{
+    if (image->Position < image_size)
+    {
+        write_zstd_region(image, image_size, NULL, 0);
+    }
+
+    if (image->Filling)
+    {
+        _submit_frame(image, &image->Frames[image->SubmittedFrames % image->FrameCount]);
+    }
+
+    while (image->WrittenFrames < image->SubmittedFrames)
+    {
+        _write_next_frame(image);
+    }
+
+    pthread_mutex_lock(&image->Lock);
+    image->Stopping = true;
+    pthread_cond_broadcast(&image->Changed);
+    pthread_mutex_unlock(&image->Lock);
+
+    for (uint32_t i = 0; i < image->WorkerCount; ++i)
+    {
+        pthread_join(image->Workers[i], NULL);
+    }
+
+    // Seek table: a skippable frame holding one entry per frame and a footer, all little endian and without checksums.
+    uint64_t table_size = 8 + image->WrittenFrames * sizeof(SEEK_ENTRY) + SEEK_TABLE_FOOTER_SIZE;
+    uint8_t *table = malloc(table_size);
+    if (NULL == table)
+    {
+        perror("Error allocating seek table");
+        exit(1);
+    }
+
+    uint32_t header[2] = {SKIPPABLE_MAGIC, (uint32_t)(table_size - 8)};
+    memcpy(table, header, sizeof(header));
+    memcpy(table + 8, image->SeekEntries, image->WrittenFrames * sizeof(SEEK_ENTRY));
+
+    uint8_t *footer = table + table_size - SEEK_TABLE_FOOTER_SIZE;
+    uint32_t frame_count = (uint32_t)image->WrittenFrames;
+    uint32_t magic = SEEKABLE_MAGIC;
+    memcpy(footer, &frame_count, sizeof(frame_count));
+    footer[4] = 0;
+    memcpy(footer + 5, &magic, sizeof(magic));
+
+    _write_bytes(image->Descriptor, table, table_size);
+    free(table);
+
+    pthread_cond_destroy(&image->Changed);
+    pthread_mutex_destroy(&image->Lock);
+    for (uint32_t i = 0; i < image->FrameCount; ++i)
+    {
+        free(image->Frames[i].Data);
+        free(image->Frames[i].Compressed);
+    }
+    free(image->Frames);
+    free(image->Workers);
+    free(image->ZeroFrame);
+    free(image->SeekEntries);
+    free(image);
+}
+
+// The frame that takes the next image byte, its slot is written out first if it still holds an older frame.
+static ZSTD_FRAME *_get_filling_frame(ZSTD_IMAGE *image)
+{
+    ZSTD_FRAME *frame = &image->Frames[image->SubmittedFrames % image->FrameCount];
+    if (image->Filling)
+    {
+        return frame;
+    }
+
+    while (image->SubmittedFrames >= image->WrittenFrames + image->FrameCount)
+    {
+        _write_next_frame(image);
+    }
+
+    frame->Size = 0;
+    frame->Untouched = true;
+    frame->State = FRAME_FILLING;
+    image->Filling = true;
+
+    return frame;
+}
+
+static void _submit_frame(ZSTD_IMAGE *image, ZSTD_FRAME *frame)
+{
+    pthread_mutex_lock(&image->Lock);
+    frame->State = FRAME_QUEUED;
+    image->SubmittedFrames++;
+    image->Filling = false;
+    pthread_cond_broadcast(&image->Changed);
+    pthread_mutex_unlock(&image->Lock);
+}
+
+static void _write_next_frame(ZSTD_IMAGE *image)
+{
+    ZSTD_FRAME *frame = &image->Frames[image->WrittenFrames % image->FrameCount];
+
+    pthread_mutex_lock(&image->Lock);
+    while (FRAME_DONE != frame->State)
+    {
+        pthread_cond_wait(&image->Changed, &image->Lock);
+    }
+    pthread_mutex_unlock(&image->Lock);
+
+    // A zero frame keeps pointing at the shared compressed zeros.
+    const uint8_t *compressed = 0 == frame->CompressedSize ? image->ZeroFrame : frame->Compressed;
+    uint64_t compressed_size = 0 == frame->CompressedSize ? image->ZeroFrameSize : frame->CompressedSize;
+    _write_bytes(image->Descriptor, compressed, compressed_size);
+
+    if (image->WrittenFrames == image->SeekEntryCapacity)
+    {
+        image->SeekEntryCapacity = image->SeekEntryCapacity ? image->SeekEntryCapacity * 2 : 1024;
+        image->SeekEntries = realloc(image->SeekEntries, image->SeekEntryCapacity * sizeof(SEEK_ENTRY));
+        if (NULL == image->SeekEntries)
+        {
+            perror("Error allocating seek table");
+            exit(1);
+        }
+    }
+    image->SeekEntries[image->WrittenFrames].CompressedSize = (uint32_t)compressed_size;
+    image->SeekEntries[image->WrittenFrames].DecompressedSize = (uint32_t)frame->Size;
+
+    frame->State = FRAME_FREE;
+    image->WrittenFrames++;
+}
+
+static void *_run_compressor(void *argument)
+{
+    ZSTD_IMAGE *image = argument;
+    ZSTD_CCtx *context = ZSTD_createCCtx();
+    if (NULL == context)
+    {
+        fprintf(stderr, "Error creating zstd context\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&image->Lock);
+    while (true)
+    {
+        while (!image->Stopping && image->ClaimedFrames == image->SubmittedFrames)
+        {
+            pthread_cond_wait(&image->Changed, &image->Lock);
+        }
+        if (image->ClaimedFrames == image->SubmittedFrames)
+        {
+            break;
+        }
+
+        ZSTD_FRAME *frame = &image->Frames[image->ClaimedFrames++ % image->FrameCount];
+        pthread_mutex_unlock(&image->Lock);
+
+        uint64_t compressed_size = _compress_frame(context, frame);
+
+        pthread_mutex_lock(&image->Lock);
+        frame->CompressedSize = compressed_size;
+        frame->State = FRAME_DONE;
+        pthread_cond_broadcast(&image->Changed);
+    }
+    pthread_mutex_unlock(&image->Lock);
+
+    ZSTD_freeCCtx(context);
+    return NULL;
+}
+
+// Returns 0 for a full frame of zeros, it is written as the shared zero frame.
+static uint64_t _compress_frame(ZSTD_CCtx *context, ZSTD_FRAME *frame)
+{
+    if (ZSTD_FRAME_SIZE == frame->Size && (frame->Untouched || _is_zero(frame->Data, frame->Size)))
+    {
+        return 0;
+    }
+
+    if (frame->Untouched)
+    {
+        memset(frame->Data, 0, frame->Size);
+    }
+
+    size_t result = ZSTD_compressCCtx(context, frame->Compressed, ZSTD_compressBound(ZSTD_FRAME_SIZE), frame->Data, frame->Size, COMPRESSION_LEVEL);
+    if (ZSTD_isError(result))
+    {
+        fprintf(stderr, "Error compressing image: %s\n", ZSTD_getErrorName(result));
+        exit(1);
+    }
+
+    return result;
+}
+
+static void _write_bytes(int descriptor, const void *buffer, uint64_t size)
+{
+    const uint8_t *data = buffer;
+
+    while (size > 0)
+    {
+        ssize_t written = write(descriptor, data, size);
+        if (written < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("Error writing output image");
+            exit(1);
+        }
+
+        data += written;
+        size -= written;
+    }
+}
+
+static bool _is_zero(const uint8_t *buffer, uint64_t size)
+{
+    return 0 == size || (0 == buffer[0] && 0 == memcmp(buffer, buffer + 1, size - 1));
+}
+
+#else /* HAVE_ZSTD */
+
+ZSTD_IMAGE *open_zstd_image(int descriptor, uint32_t jobs)
+{
+    (void)descriptor;
+    (void)jobs;
+
+    fprintf(stderr, "%s\n", ZSTD_IMAGE_UNSUPPORTED_MESSAGE);
+    exit(1);
+}
+
+void write_zstd_region(ZSTD_IMAGE *image, uint64_t offset, const void *buffer, uint64_t size)
+{
+    (void)image;
+    (void)offset;
+    (void)buffer;
+    (void)size;
+}
+
+void close_zstd_image(ZSTD_IMAGE *image, uint64_t image_size)
+{
+    (void)image;
+    (void)image_size;
+}
+
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,26 @@
+#ifndef _ZSTD_IMAGE_H_
+#define _ZSTD_IMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Writes a raw image as seekable zstd: independent frames of ZSTD_FRAME_SIZE image bytes followed by a seek table in a skippable frame,
+// so any zstd tool can decompress it and a seekable reader can jump to any frame. The image has to arrive in ascending offset order,
+// bytes that are never written are zeros. Frames are compressed by worker threads while the next ones are filled.
+typedef struct _ZSTD_IMAGE ZSTD_IMAGE;
+
+#define ZSTD_FRAME_SIZE (1024 * 1024)
+#define ZSTD_IMAGE_UNSUPPORTED_MESSAGE "This image_creator was built without zstd support, rebuild with ZSTD_CFLAGS=-DHAVE_ZSTD ZSTD_LIBS=-lzstd"
+
+// False when the program was built without libzstd. Checked before an output is opened, so it is not truncated for nothing.
+bool is_zstd_image_supported(void);
+
+// Exits when the program was built without libzstd.
+ZSTD_IMAGE *open_zstd_image(int descriptor, uint32_t jobs);
+
+void write_zstd_region(ZSTD_IMAGE *image, uint64_t offset, const void *buffer, uint64_t size);
+
+// Zero fills up to image_size, writes the remaining frames and the seek table. The descriptor is left open.
+void close_zstd_image(ZSTD_IMAGE *image, uint64_t image_size);
+
+#endif /* _ZSTD_IMAGE_H_ */